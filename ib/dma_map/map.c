@@ -1,37 +1,345 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/spinlock.h>
+#include <linux/scatterlist.h>
+#include <linux/ktime.h>
+#include <linux/dma-mapping.h>
 
 #include <rdma/ib_verbs.h>
 
 
+/* What a DMA mapping costs per I/O. For every size from 64 bytes to 1M,
+ * iters map/unmap pairs are timed three ways: one contiguous buffer with
+ * ib_dma_map_single, the same length as a scatterlist of separate pages
+ * with ib_dma_map_sg, and through the mapping cache, where the buffer stays
+ * mapped and an I/O costs a lookup and two syncs. The IOMMU is the boot's
+ * business: run once with it on (intel_iommu=on) and once without
+ * (iommu=off or iommu=pt), the DMA ops in use are printed first. */
+
+#define MAP_MIN		64
+#define MAP_MAX		(1 << 20)
+#define MAP_PAGES	(MAP_MAX / PAGE_SIZE)
+#define MAP_HASH_BITS	6
+
+
+/* module params */
+static unsigned int iters = 1000;
+module_param (iters, uint, 0444);
+MODULE_PARM_DESC (iters, "map/unmap pairs timed per size and method");
+
+static int direction = DMA_TO_DEVICE;
+module_param (direction, int, 0444);
+MODULE_PARM_DESC (direction, "0 - bidirectional, 1 - to the device, 2 - from the device");
+
+static unsigned int cache_size = 64;
+module_param (cache_size, uint, 0444);
+MODULE_PARM_DESC (cache_size, "mappings the cache keeps once nobody uses them");
+
+
+/* Mapping cache: a buffer stays mapped after its I/O and the next one on
+ * it reuses the mapping, synced for the device instead of mapped again.
+ * Entries are keyed by address, length and direction. Once there are more
+ * than max, the least recently used one nobody holds is unmapped. The
+ * buffers must outlive the cache. */
+struct map_entry {
+	struct hlist_node node;
+	struct list_head lru;
+	void *addr;
+	size_t len;
+	enum dma_data_direction dir;
+	u64 dma;
+	unsigned int refs;
+};
+
+struct map_cache {
+	struct ib_device *dev;
+	spinlock_t lock;
+	unsigned int nr;
+	unsigned int max;
+	struct hlist_head hash[1 << MAP_HASH_BITS];
+	struct list_head lru;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+
+static void map_cache_init (struct map_cache *c, struct ib_device *dev, unsigned int max)
+{
+	memset (c, 0, sizeof (*c));
+	c->dev = dev;
+	c->max = max;
+	spin_lock_init (&c->lock);
+	INIT_LIST_HEAD (&c->lru);
+}
+
+
+/* caller holds the lock */
+static void map_entry_free (struct map_cache *c, struct map_entry *e)
+{
+	hlist_del (&e->node);
+	list_del (&e->lru);
+	ib_dma_unmap_single (c->dev, e->dma, e->len, e->dir);
+	kfree (e);
+	c->nr--;
+}
+
+
+/* The mapping of the buffer, held until map_cache_put(); e->dma is what
+ * goes into the SGE. A hit only syncs the buffer for the device. */
+static struct map_entry *map_cache_get (struct map_cache *c, void *addr, size_t len, enum dma_data_direction dir)
+{
+	struct hlist_head *head = &c->hash[hash_ptr (addr, MAP_HASH_BITS)];
+	struct map_entry *e, *old;
+	struct hlist_node *pos;
+	unsigned long flags;
+
+	spin_lock_irqsave (&c->lock, flags);
+
+	hlist_for_each_entry (e, pos, head, node)
+		if (e->addr == addr && e->len == len && e->dir == dir) {
+			list_move (&e->lru, &c->lru);
+			e->refs++;
+			c->hits++;
+			spin_unlock_irqrestore (&c->lock, flags);
+
+			ib_dma_sync_single_for_device (c->dev, e->dma, len, dir);
+			return e;
+		}
+
+	e = kmalloc (sizeof (*e), GFP_ATOMIC);
+	if (!e) {
+		spin_unlock_irqrestore (&c->lock, flags);
+		return ERR_PTR (-ENOMEM);
+	}
+
+	e->dma = ib_dma_map_single (c->dev, addr, len, dir);
+	if (ib_dma_mapping_error (c->dev, e->dma)) {
+		spin_unlock_irqrestore (&c->lock, flags);
+		kfree (e);
+		return ERR_PTR (-EIO);
+	}
+
+	e->addr = addr;
+	e->len = len;
+	e->dir = dir;
+	e->refs = 1;
+	hlist_add_head (&e->node, head);
+	list_add (&e->lru, &c->lru);
+	c->nr++;
+	c->misses++;
+
+	/* while all of them are in use the cache grows past max */
+	if (c->nr > c->max)
+		list_for_each_entry_reverse (old, &c->lru, lru)
+			if (!old->refs) {
+				map_entry_free (c, old);
+				c->evictions++;
+				break;
+			}
+
+	spin_unlock_irqrestore (&c->lock, flags);
+	return e;
+}
+
+
+/* the I/O is done, the CPU may look at the buffer again */
+static void map_cache_put (struct map_cache *c, struct map_entry *e)
+{
+	unsigned long flags;
+
+	ib_dma_sync_single_for_cpu (c->dev, e->dma, e->len, e->dir);
+
+	spin_lock_irqsave (&c->lock, flags);
+	e->refs--;
+	spin_unlock_irqrestore (&c->lock, flags);
+}
+
+
+static void map_cache_destroy (struct map_cache *c)
+{
+	struct map_entry *e, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave (&c->lock, flags);
+	list_for_each_entry_safe (e, tmp, &c->lru, lru)
+		map_entry_free (c, e);
+	spin_unlock_irqrestore (&c->lock, flags);
+}
+
+
+/* iters map/unmap pairs of one contiguous buffer, the sums in ns */
+static int bench_single (struct ib_device *dev, void *buf, size_t len, u64 *map_ns, u64 *unmap_ns)
+{
+	ktime_t t0, t1, t2;
+	unsigned int i;
+	u64 dma;
+
+	*map_ns = *unmap_ns = 0;
+
+	for (i = 0; i < iters; i++) {
+		t0 = ktime_get ();
+		dma = ib_dma_map_single (dev, buf, len, direction);
+		t1 = ktime_get ();
+		if (ib_dma_mapping_error (dev, dma))
+			return -EIO;
+		ib_dma_unmap_single (dev, dma, len, direction);
+		t2 = ktime_get ();
+
+		*map_ns += ktime_to_ns (ktime_sub (t1, t0));
+		*unmap_ns += ktime_to_ns (ktime_sub (t2, t1));
+	}
+
+	return 0;
+}
+
+
+/* the same for len bytes spread over separate pages, one entry each */
+static int bench_sg (struct ib_device *dev, struct scatterlist *sg, struct page **pages, size_t len,
+		     u64 *map_ns, u64 *unmap_ns)
+{
+	unsigned int i, n = DIV_ROUND_UP (len, PAGE_SIZE);
+	ktime_t t0, t1, t2;
+
+	sg_init_table (sg, n);
+	for (i = 0; i < n; i++)
+		sg_set_page (&sg[i], pages[i], min_t (size_t, len - i * PAGE_SIZE, PAGE_SIZE), 0);
+
+	*map_ns = *unmap_ns = 0;
+
+	for (i = 0; i < iters; i++) {
+		t0 = ktime_get ();
+		if (!ib_dma_map_sg (dev, sg, n, direction))
+			return -EIO;
+		t1 = ktime_get ();
+		ib_dma_unmap_sg (dev, sg, n, direction);
+		t2 = ktime_get ();
+
+		*map_ns += ktime_to_ns (ktime_sub (t1, t0));
+		*unmap_ns += ktime_to_ns (ktime_sub (t2, t1));
+	}
+
+	return n;
+}
+
+
+/* iters I/Os on one hot buffer through the cache: a miss, then hits */
+static int bench_cached (struct map_cache *c, void *buf, size_t len, u64 *ns)
+{
+	struct map_entry *e;
+	unsigned int i;
+	ktime_t t0;
+
+	t0 = ktime_get ();
+
+	for (i = 0; i < iters; i++) {
+		e = map_cache_get (c, buf, len, direction);
+		if (IS_ERR (e))
+			return PTR_ERR (e);
+		map_cache_put (c, e);
+	}
+
+	*ns = ktime_to_ns (ktime_sub (ktime_get (), t0));
+	return 0;
+}
+
+
+static void map_bench (struct ib_device *dev, void *buf, struct page **pages, struct scatterlist *sg)
+{
+	u64 map_ns, unmap_ns, sg_map_ns, sg_unmap_ns, cached_ns;
+	struct map_cache cache;
+	size_t len;
+	int ents, ret;
+
+	map_cache_init (&cache, dev, cache_size);
+
+	printk (KERN_INFO "Map bench: %u iterations, direction %d, averages in ns\n", iters, direction);
+
+	for (len = MAP_MIN; len <= MAP_MAX; len <<= 1) {
+		ret = bench_single (dev, buf, len, &map_ns, &unmap_ns);
+		if (ret) {
+			printk (KERN_INFO "ib_dma_map_single of %zu bytes failed\n", len);
+			break;
+		}
+
+		ents = bench_sg (dev, sg, pages, len, &sg_map_ns, &sg_unmap_ns);
+		if (ents < 0) {
+			printk (KERN_INFO "ib_dma_map_sg of %zu bytes failed\n", len);
+			break;
+		}
+
+		ret = bench_cached (&cache, buf, len, &cached_ns);
+		if (ret) {
+			printk (KERN_INFO "cached mapping of %zu bytes failed: %d\n", len, ret);
+			break;
+		}
+
+		printk (KERN_INFO "%7zu bytes: single map %llu, unmap %llu; sg of %d map %llu, unmap %llu; cached %llu (%llu%% of single)\n",
+			len, div64_u64 (map_ns, iters), div64_u64 (unmap_ns, iters), ents,
+			div64_u64 (sg_map_ns, iters), div64_u64 (sg_unmap_ns, iters), div64_u64 (cached_ns, iters),
+			map_ns + unmap_ns ? div64_u64 (cached_ns * 100, map_ns + unmap_ns) : 0ULL);
+	}
+
+	printk (KERN_INFO "Map cache: %lu hits, %lu misses, %lu evictions, %u mapped\n",
+		cache.hits, cache.misses, cache.evictions, cache.nr);
+
+	map_cache_destroy (&cache);
+}
+
+
 static void map_add_device (struct ib_device *dev)
 {
-	char *buf;
-	u64 key;
-	size_t len = 2048;
-	struct ib_pd *pd;
-	struct ib_mr *mr;
- 
+	struct page **pages;
+	struct scatterlist *sg;
+	void *buf;
+	int i;
+
 	printk (KERN_INFO "IB add device called. Name = %s\n", dev->name);
-	printk (KERN_INFO "dev = %p, dma_ops = %p, map_single = %p\n", dev, dev->dma_ops, dev->dma_ops->map_single);
 
-	return;
+	/* providers with dma_ops of their own map in software, no IOMMU there */
+	printk (KERN_INFO "dev = %p, dma_ops = %p, %s\n", dev, dev->dma_ops,
+		dev->dma_ops ? "provider's own DMA mapping" : "DMA API of the device");
+#ifdef CONFIG_X86
+	if (!dev->dma_ops)
+		printk (KERN_INFO "DMA API ops: %pS\n", get_dma_ops (dev->dma_device));
+#endif
 
-	pd = ib_alloc_pd (dev);
-	mr = ib_get_dma_mr (pd, IB_ACCESS_LOCAL_WRITE);
+	buf = (void *)__get_free_pages (GFP_KERNEL | __GFP_ZERO, get_order (MAP_MAX));
+	pages = kcalloc (MAP_PAGES, sizeof (*pages), GFP_KERNEL);
+	sg = kcalloc (MAP_PAGES, sizeof (*sg), GFP_KERNEL);
 
-	buf = kzalloc (len, GFP_KERNEL);
+	if (!buf || !pages || !sg) {
+		printk (KERN_INFO "Memory allocation failed\n");
+		goto out;
+	}
 
-	if (!buf) {
-		printk (KERN_INFO "Memory allocation failed");
-		return;
+	for (i = 0; i < MAP_PAGES; i++) {
+		pages[i] = alloc_page (GFP_KERNEL | __GFP_ZERO);
+		if (!pages[i]) {
+			printk (KERN_INFO "Memory allocation failed\n");
+			goto out;
+		}
 	}
 
 	printk (KERN_INFO "Memory allocated\n");
 
-	key = ib_dma_map_single (dev, buf, len, DMA_TO_DEVICE);
+	map_bench (dev, buf, pages, sg);
 
-	printk (KERN_INFO "Map done\n", key);
+out:
+	if (pages)
+		for (i = 0; i < MAP_PAGES; i++)
+			if (pages[i])
+				__free_page (pages[i]);
+	kfree (pages);
+	kfree (sg);
+	if (buf)
+		free_pages ((unsigned long)buf, get_order (MAP_MAX));
 }
 
 
@@ -44,7 +352,7 @@ static void map_remove_device (struct ib_device *dev)
 
 
 static struct ib_client client = {
-	.name = "verbs_test",
+	.name = "dma_map",
 	.add  = map_add_device,
 	.remove = map_remove_device,
 };
@@ -52,6 +360,10 @@ static struct ib_client client = {
 
 static int __init map_init (void)
 {
+	iters = max (iters, 1U);
+	if (direction < DMA_BIDIRECTIONAL || direction > DMA_FROM_DEVICE)
+		direction = DMA_TO_DEVICE;
+
 	if (ib_register_client (&client)) {
 		printk (KERN_WARNING "IB client registration failed. Is IB modules loaded?\n");
 		return -ENODEV;
@@ -62,6 +374,7 @@ static int __init map_init (void)
 
 static void __exit map_exit (void)
 {
+	ib_unregister_client (&client);
 }
 
 
@@ -71,4 +384,3 @@ module_exit (map_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Max Lapan <max.lapan@gmail.com>");
 MODULE_DESCRIPTION("Verbs DMA mapping");
-
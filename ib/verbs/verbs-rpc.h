@@ -0,0 +1,61 @@
+/* RPC over the verbs test module's UD queues, for other kernel modules.
+ *
+ * A call goes to a peer by its place in the join order, 0 is the first one,
+ * and is matched with its response by a request id. Handlers and completion
+ * callbacks run in softirq context and must not sleep. A handler writes its
+ * response in place, at most *resp_len bytes, and returns 0 or a negative
+ * errno, which the caller gets as the status. Every call that was accepted
+ * completes exactly once: with the response, the handler's error,
+ * -ETIMEDOUT, or -ESHUTDOWN when the device goes away. */
+
+#ifndef __VERBS_RPC_H
+#define __VERBS_RPC_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+#define VERBS_RPC_METHODS	64
+#define VERBS_RPC_ECHO		0	/* built in, returns the request */
+
+
+struct verbs_rpc_call;
+
+typedef int (*verbs_rpc_handler_t) (u32 method, const void *req, unsigned int len, void *resp, unsigned int *resp_len);
+typedef void (*verbs_rpc_done_t) (struct verbs_rpc_call *call, int status, const void *resp, unsigned int len);
+
+
+/* owned by the caller until done() runs; resp is valid during done() only */
+struct verbs_rpc_call {
+	unsigned int peer;
+	u32 method;
+	const void *req;
+	unsigned int len;
+	unsigned long timeout;		/* jiffies, 0 - the module's rpc_timeout */
+	verbs_rpc_done_t done;
+	void *context;
+
+	/* the transport's */
+	struct hlist_node node;
+	struct list_head list;
+	u64 id;
+	unsigned long deadline;
+};
+
+
+int verbs_rpc_register (u32 method, verbs_rpc_handler_t handler);
+void verbs_rpc_unregister (u32 method);
+
+/* Returns 0 once the request is out, or an error and done() never runs:
+ * -ENOTCONN without the peer, -EAGAIN while its path is being resolved or
+ * the queue is full, -ENOBUFS without a send buffer. */
+int verbs_rpc_call (struct verbs_rpc_call *call);
+
+/* Process context. The response is copied to resp, its length to *resp_len. */
+int verbs_rpc_call_sync (unsigned int peer, u32 method, const void *req, unsigned int len,
+			 void *resp, unsigned int *resp_len, unsigned long timeout);
+
+unsigned int verbs_rpc_max_size (void);
+unsigned int verbs_rpc_peers (void);
+
+
+#endif /* __VERBS_RPC_H */
@@ -6,6 +6,25 @@
 #include <linux/in.h>
 #include <linux/igmp.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/slab.h>
+#include <linux/interrupt.h>
+#include <linux/cpumask.h>
+#include <linux/random.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/delay.h>
+#include <linux/rcupdate.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/uaccess.h>
+#include <linux/log2.h>
 
 #include <rdma/ib_verbs.h>
 #include <rdma/ib_cm.h>
@@ -13,25 +32,164 @@
 
 #include <net/sock.h>
 
+#include "lat-hist.h"
+#include "verbs-rpc.h"
+
 
 #define NEXTJIFF(secs)	(jiffies + (secs) * HZ)
 
 #define CQ_SIZE		255
 #define SEND_INTERVAL   1
 #define PORT		12347
-
-
-static void accept_work (struct work_struct *);
-
-
-static DECLARE_WORK (sock_accept, accept_work);
+#define POLL_BATCH_MAX	64
+#define GRH_SIZE	40	/* in front of every UD receive */
+#define MAX_QUEUES	64
+#define MAX_PORTS	4
+#define RC_SLOTS	8	/* rc_msg sized slots in the RDMA buffer */
+#define RC_MSG_MAX	(512 << 10)
+#define POOL_CACHE	32	/* free buffers a CPU keeps to itself */
+#define POOL_CHUNK_ORDER 2
+#define MAX_PEER_ADDRS	64
+#define PEER_HASH_SIZE	64
+#define RDV_TIMEOUT	5	/* seconds a peer gets for each step of the exchange */
+#define RDV_RETRIES	30
+#define MAX_PEERS	1024
+#define PATH_HASH_SIZE	256
+#define PATH_RETRY	(5 * HZ)	/* before a failed path lookup is tried again */
+#define PATH_HOP_LIMIT	64
+#define MCAST_QPN	0xffffff
+#define MCAST_FANOUT_MAX 64	/* peers a unicast publish goes to */
+#define MCAST_SETTLE	(2 * HZ)
+#define SEND_SGE	2	/* header and body */
+#define LAT_MIN		8
+#define LAT_MAX		4096
+#define BENCH_CHAIN	32	/* WRs per post in the message rate test */
+#define CREDIT_ACK_BITS	48	/* of an explicit ack, the queue goes above */
+#define RPC_HASH_SIZE	256	/* of the calls waiting on a queue */
+#define RPC_RESPONSE	1
+#define RPC_BENCH_SECS	5
+
+
+static void bench_start_work (struct work_struct *);
+
+
+static DECLARE_WORK (bench_start, bench_start_work);
 
 
 /* module params */
+static char *device;
+module_param (device, charp, 0444);
+MODULE_PARM_DESC (device, "name of the HCA to use, the first one found by default");
+
 static unsigned int server_addr;
 module_param (server_addr, uint, 0644);
 MODULE_PARM_DESC (server_addr, "server address. If not specified, wait for connection");
 
+static unsigned int peer_addrs[MAX_PEER_ADDRS];
+static int nr_peer_addrs;
+module_param_array (peer_addrs, uint, &nr_peer_addrs, 0444);
+MODULE_PARM_DESC (peer_addrs, "more peers to exchange queue pair info with, in parallel");
+
+static unsigned int send_depth = CQ_SIZE;
+module_param (send_depth, uint, 0444);
+MODULE_PARM_DESC (send_depth, "sends kept in flight, at most CQ_SIZE. 0 - don't send");
+
+static unsigned int send_chain = 16;
+module_param (send_chain, uint, 0444);
+MODULE_PARM_DESC (send_chain, "WRs chained into one ib_post_send call");
+
+static unsigned int signal_every = 16;
+module_param (signal_every, uint, 0444);
+MODULE_PARM_DESC (signal_every, "request a completion for every Nth send only");
+
+static unsigned int poll_batch = 32;
+module_param (poll_batch, uint, 0644);
+MODULE_PARM_DESC (poll_batch, "completions taken per ib_poll_cq call, at most 64");
+
+static unsigned int poll_budget = 256;
+module_param (poll_budget, uint, 0644);
+MODULE_PARM_DESC (poll_budget, "completions handled per tasklet run before yielding the CPU");
+
+static unsigned int recv_depth = 512;
+module_param (recv_depth, uint, 0444);
+MODULE_PARM_DESC (recv_depth, "receive buffers kept posted");
+
+static unsigned int refill_batch = 32;
+module_param (refill_batch, uint, 0444);
+MODULE_PARM_DESC (refill_batch, "consumed receive buffers reposted together, in one chained post");
+
+static int use_srq;
+module_param (use_srq, int, 0444);
+MODULE_PARM_DESC (use_srq, "post receives to a shared receive queue instead of the QP");
+
+static int multi_queue;
+module_param (multi_queue, int, 0444);
+MODULE_PARM_DESC (multi_queue, "one QP, CQ pair and sender per online CPU, each CQ on its own completion vector");
+
+static int rc_bench;
+module_param (rc_bench, int, 0444);
+MODULE_PARM_DESC (rc_bench, "RC queue pair: 0 - none, 1 - stream RDMA WRITEs to the peer, 2 - stream RDMA READs from it");
+
+static unsigned int rc_msg = 65536;
+module_param (rc_msg, uint, 0444);
+MODULE_PARM_DESC (rc_msg, "bytes moved by one RDMA WRITE or READ, at most 512K");
+
+static int fanout;
+module_param (fanout, int, 0644);
+MODULE_PARM_DESC (fanout, "UD sends go round robin over all known peers instead of the first one only");
+
+static int mcast;
+module_param (mcast, int, 0444);
+MODULE_PARM_DESC (mcast, "join the multicast group and compare publishing to it with unicast sends to every peer");
+
+static unsigned int mcast_count = 100000;
+module_param (mcast_count, uint, 0444);
+MODULE_PARM_DESC (mcast_count, "messages published in each pass of the multicast benchmark");
+
+static unsigned int buf_size = 1024;
+module_param (buf_size, uint, 0444);
+MODULE_PARM_DESC (buf_size, "UD message size, header included, at most the MTU");
+
+static unsigned int inline_size = 64;
+module_param (inline_size, uint, 0444);
+MODULE_PARM_DESC (inline_size, "messages up to this size are sent inline, as far as the device allows. 0 - never");
+
+static int lat_bench;
+module_param (lat_bench, int, 0444);
+MODULE_PARM_DESC (lat_bench, "measure send latency for 8 bytes to 4K, inline and not, before streaming; best without multi_queue");
+
+static unsigned int lat_rounds = 10000;
+module_param (lat_rounds, uint, 0444);
+MODULE_PARM_DESC (lat_rounds, "sends per message size in the latency bench");
+
+static int credits;
+module_param (credits, int, 0444);
+MODULE_PARM_DESC (credits, "credit based flow control of the UD sends to the first peer, which needs it too; no fanout with it");
+
+static int rpc;
+module_param (rpc, int, 0444);
+MODULE_PARM_DESC (rpc, "RPC queue next to every data queue, for other modules to call the peers through; the peers need them too");
+
+static unsigned int rpc_timeout = 1000;
+module_param (rpc_timeout, uint, 0644);
+MODULE_PARM_DESC (rpc_timeout, "ms a call waits for its response, unless the caller says otherwise");
+
+static int rpc_bench;
+module_param (rpc_bench, int, 0444);
+MODULE_PARM_DESC (rpc_bench, "with rpc: time lat_rounds echo calls to the first peer one by one, then pipeline them from a thread per RPC queue");
+
+static unsigned int rpc_depth = 32;
+module_param (rpc_depth, uint, 0444);
+MODULE_PARM_DESC (rpc_depth, "calls every RPC bench thread keeps in flight");
+
+static unsigned int rpc_size = 32;
+module_param (rpc_size, uint, 0444);
+MODULE_PARM_DESC (rpc_size, "payload of the RPC bench calls");
+
+static int suite;
+module_param (suite, int, 0444);
+MODULE_PARM_DESC (suite, "benchmark suite in debugfs verbs/, on a UD queue of its own and the RC queue, which then doesn't stream");
+
 
 /* module state */
 static struct ib_sa_client verbs_sa_client;
@@ -42,28 +200,231 @@ static struct ib_sa_path_rec path;
 
 static struct ib_device *ib_dev;
 static struct ib_device_attr dev_attr;
-static struct ib_port_attr port_attr;
+static struct ib_port_attr port_attr;	/* the first port's, with the smallest MTU of all */
 
 static struct ib_pd *pd;
 static struct ib_mr *mr;
-static struct ib_cq *send_cq;
-static struct ib_cq *recv_cq;
-static struct ib_qp *qp;
 u16 pkey;
-static struct ib_ah *ah;
 
 
-static size_t buf_size = 1024;
-static char *send_buf;
-static char *recv_buf;
+/* Ports of the device. The UD queues are spread over those active at load
+ * and move to another one while theirs is down. The RC, multicast, bench and
+ * credit queues stay on the first port that was active: the RC QP is
+ * connected and the group joined from there, and the LID and GID of that
+ * port are the ones the peers know us by, so moving them would make us a
+ * new peer to everyone. */
+struct verbs_port {
+	u8 num;
+	int active;
+	struct ib_port_attr attr;
+	union ib_gid gid;
+	u16 pkey;
+};
+
+static struct verbs_port ports[MAX_PORTS];
+static unsigned int nr_ports;
+static int first_port = -1;		/* picked by the first query */
+
+/* ports[], port_attr, pkey and the addresses in local_info change together
+ * under it; a reader that needs more than one of them takes a copy */
+static DEFINE_SEQLOCK (port_lock);
+
+
+
+/* Buffer pool: nr equal buffers carved out of page chunks allocated on the
+ * device's node and DMA-mapped once, for the life of the pool. A buffer is
+ * known by its index. Every CPU keeps a small cache of free indices and
+ * touches the shared stack, under the lock, only to take or give back half
+ * a cache at once; with interrupts off the cache needs no lock. */
+struct pool_cache {
+	unsigned int count;
+	u32 ids[POOL_CACHE];
+};
+
+struct buf_pool {
+	size_t len;		/* buffer stride, cache line aligned */
+	unsigned int nr;
+	enum dma_data_direction dir;
+	unsigned int order;
+	unsigned int per_chunk;
+	unsigned int nr_chunks;
+	struct page **chunks;
+	u64 *chunk_dma;
+
+	spinlock_t lock;
+	u32 *free;
+	unsigned int nfree;
+	struct pool_cache *cache;
+
+	unsigned long empty;
+};
+
+static struct buf_pool *send_pool;
+static struct buf_pool *recv_pool;
+
+
+/* in front of every UD message, in its own buffer */
+enum verbs_msg_op {
+	MSG_DATA,
+	MSG_PING,		/* bench queue: answer with a pong carrying the tag */
+	MSG_PONG,
+	MSG_CREDIT,		/* explicit ack, on the credit queues */
+};
+
+struct verbs_msg_hdr {
+	__be64	seq;
+	__be64	tag;
+	__be32	queue;
+	__be32	len;
+	__be32	op;
+	__be64	ack;		/* flow control: next seq expected from the queue we send to */
+} __attribute__ ((packed));
+
+
+/* RDMA buffer of the RC queue, the peer reads and writes it by rkey */
+static struct ib_mr *rc_mr;
+static void *rc_buf;
+static size_t rc_len;
+static u64 rc_dma;
+static u32 rc_psn;
+static int rc_connected;
+
+static void rc_connect_work (struct work_struct *);
+static void rc_rejoin_work (struct work_struct *);
+
+static DECLARE_WORK (rc_connect, rc_connect_work);
+static DECLARE_WORK (rc_rejoin, rc_rejoin_work);
+
+
+/* Receive ring: recv_depth buffers from recv_pool, wr_id is the buffer.
+ * Consumed buffers go back to the pool, and once refill_batch of them are
+ * missing the ring is topped up in one chained post. Each QP has its own,
+ * unless they share an SRQ; the lock only ever sees contention in that case. */
+struct recv_ring {
+	spinlock_t lock;
+	struct ib_srq *srq;
+	struct ib_qp *qp;	/* posted to when there is no SRQ */
+
+	unsigned int posted;
+	struct ib_recv_wr *wrs;
+	struct ib_sge *sges;
+
+	unsigned long recv;
+	unsigned long errors;
+	unsigned long refills;
+	unsigned long dry;
+	unsigned int low;
+};
+
 
-static u64 send_key;
-static u64 recv_key;
+/* Completion engine, one per CQ. The CQ event only schedules the tasklet,
+ * which polls completions in arrays under a budget and hands each to the
+ * CQ's handler. Out of budget it reschedules itself without re-arming; when
+ * the CQ is drained it re-arms, and polls again if completions slipped in
+ * before the arming. */
+struct verbs_queue;
+
+struct cq_poll {
+	struct ib_cq *cq;
+	struct tasklet_struct tasklet;
+	struct verbs_queue *q;
+	void (*handler) (struct verbs_queue *q, struct ib_wc *wc);
+	struct ib_wc wc[POLL_BATCH_MAX];
+
+	unsigned long events;
+	unsigned long runs;
+	unsigned long wcs;
+	unsigned long budget_hits;
+	unsigned long missed;
+};
+
+
+/* One QP with its own CQ pair and sender, homed on one CPU. The CQs sit on
+ * their own completion vector, so with the vectors' interrupts spread over
+ * the CPUs nothing is shared between queues but the device.
+ *
+ * Send engine: sends are numbered, wr_id is the number; only every
+ * signal_every-th one (or the one filling the window) asks for a completion,
+ * which retires it and every unsignaled send before it. */
+struct verbs_queue {
+	unsigned int idx;
+	int cpu;
+	int rc;			/* RDMA over a connected QP instead of UD sends */
+	struct ib_qp *qp;
+	struct ib_cq *send_cq;
+	struct ib_cq *recv_cq;
+	struct cq_poll send_poll;
+	struct cq_poll recv_poll;
+	struct recv_ring *ring;
+	struct buf_pool *hdr_pool;	/* slot per send in flight, no get/put */
+	unsigned int max_inline;	/* as negotiated with the device */
+	unsigned int max_sge;
+	unsigned int port;		/* index into ports[] */
+	unsigned int home;		/* the port it goes back to */
+
+	/* Flow control: at most cr_grant sends past the last one the peer's
+	 * queue acked. Acks come from the CQ tasklets, ours and the credit
+	 * queue's; one send at a time is timed from post to its ack. */
+	int fc;
+	unsigned int cr_grant;
+	unsigned long cr_acked;
+	unsigned long cr_sampling;	/* bit 0: a sample is out */
+	unsigned long cr_sample_seq;
+	ktime_t cr_sample_time;
+
+	struct task_struct *send_task;
+	wait_queue_head_t send_wait;
+	struct ib_send_wr *send_wrs;
+	struct ib_sge *send_sges;
+	u32 send_bufs[CQ_SIZE];		/* send_pool buffer of every send in flight */
+	unsigned long send_posted;
+	unsigned long send_done;	/* advanced by the send CQ tasklet */
+
+	unsigned long stat_last_sent;
+	unsigned long stat_post_calls;
+	unsigned long stat_send_errors;
+	unsigned long stat_inline;
+	unsigned long stat_cr_stalls;
+	u64 stat_cr_stall_ns;
+	u64 stat_cr_lat_ns;
+	u64 stat_cr_lat_max;
+	unsigned long stat_cr_lat_n;
+};
+
+static struct verbs_queue *queues;
+static unsigned int nr_queues;
+static struct recv_ring *shared_ring;
+static struct verbs_queue rc_queue;
+static struct verbs_queue mc_queue;	/* attached to the group, publishes to it */
+static struct verbs_queue bench_queue;	/* the suite's UD queue */
+static struct verbs_queue credit_queue;	/* explicit acks, both ways */
+static int cq_stopping;
+
+static unsigned long stat_last_recv;
+
+
+/* Multicast group of the benchmark, an IPoIB style MGID with our own
+ * signature; bytes 4 and 5 are the P_Key */
+static union ib_gid mcast_mgid = {
+	.raw = { 0xff, 0x12, 0x40, 0x1b, 0, 0, 0, 0, 0, 0, 0, 0, 0x56, 0x45, 0x52, 0x42 }
+};
+
+static struct ib_sa_multicast *mcast_group;
+static union ib_gid mcast_mgid_joined;
+static struct ib_ah *mcast_ah;
+static u16 mcast_mlid;
+static u32 mcast_qkey;
+static struct task_struct *mcast_task;
+static unsigned long stat_last_mcast;
 
 
 /* network socket (server-side) */
 static struct socket *sock;
 
+static struct task_struct *rdv_task;
+static struct workqueue_struct *rdv_wq;
+static int rdv_stopping;
+
 
 /* IB information required for data exchange in UD mode */
 struct ib_side_info {
@@ -71,16 +432,259 @@ struct ib_side_info {
 	u32		qp_num;
 	u16		lid;
 	u32		qkey;
+	u32		nr_qps;
+	u32		qpns[MAX_QUEUES];
+
+	/* RC QP and the buffer behind it, rc_qpn is 0 without one */
+	u32		rc_qpn;
+	u32		rc_psn;
+	u32		rc_rkey;
+	u64		rc_addr;
+	u64		rc_len;
+
+	u32		bench_qpn;	/* 0 - no benchmark suite */
+
+	/* flow control, credit_qpn is 0 without */
+	u32		credit_qpn;
+	u32		recv_credits;	/* buffers of one receive ring a sender may count on */
+	u32		recv_shared;	/* one ring for all queues */
+
+	/* RPC queues and their ports, nr_rpc is 0 without */
+	u32		nr_rpc;
+	u32		rpc_qpns[MAX_QUEUES];
+	u8		rpc_ports[MAX_QUEUES];
+
+	/* gid and lid above are the first port's; here are all of them, and
+	 * the port every QP in qpns is on */
+	u32		nr_ports;
+	u16		lids[MAX_PORTS];
+	union ib_gid	gids[MAX_PORTS];
+	u8		qp_ports[MAX_QUEUES];
+};
+
+
+static struct ib_side_info local_info;
+
+
+/* one exchange, incoming (sock set) or outgoing to addr */
+struct rdv_conn {
+	struct work_struct work;
+	struct socket *sock;
+	u32 addr;
+	struct ib_side_info local;	/* what we send, a copy of local_info */
 };
 
 
-static struct ib_side_info local_info, remote_info;
+/* Path cache: path record and address handle of every destination, keyed
+ * by local port, DLID and GID. Senders look entries up under RCU and never
+ * wait; a miss starts an SA query and the entry fills in when it completes.
+ * Port events that may move LIDs or paths empty the cache. */
+struct path_entry {
+	struct hlist_node node;
+	struct list_head gc;		/* on the way out */
+	unsigned int port;		/* ours, index into ports[] */
+	u16 dlid;
+	union ib_gid dgid;
+	struct ib_ah *ah;		/* NULL until resolved */
+	struct ib_sa_path_rec rec;
+	int pending;
+	int dead;			/* flushed while the query was out */
+	unsigned long failed;		/* jiffies of the last failed lookup */
+	int query_id;
+	struct ib_sa_query *query;	/* NULL without an SM */
+	struct work_struct fill;
+};
+
+static struct hlist_head path_hash[PATH_HASH_SIZE];
+static DEFINE_SPINLOCK (path_lock);
+static atomic_t path_pending = ATOMIC_INIT (0);
+static DECLARE_WAIT_QUEUE_HEAD (path_wait);
+static struct ib_event_handler port_event_handler;
+
+
+/* Receive side of the flow control, by the peer's sending queue: the next
+ * seq expected from it, the last one we told it, how far it may get ahead
+ * of that before it hears from us, and the seqs that never arrived. Each
+ * entry is written by the tasklet of the one queue that receives from it. */
+static unsigned long credit_rx_next[MAX_QUEUES];
+static unsigned long credit_rx_told[MAX_QUEUES];
+static unsigned int credit_thresh[MAX_QUEUES];
+static unsigned long credit_drops[MAX_QUEUES];
+static int credit_active;
+static DEFINE_SPINLOCK (credit_lock);	/* credit queue sends */
+static unsigned long stat_credit_updates;
+
+
+/* in front of every RPC message */
+struct verbs_rpc_hdr {
+	__be64	id;
+	__be32	method;
+	__be32	len;		/* of the payload behind */
+	__be32	flags;
+	__be32	status;		/* response: 0 or a negative errno */
+	__be16	lid;		/* request: our port the response goes to */
+	union ib_gid gid;
+} __attribute__ ((packed));
+
+
+/* RPC queue: a UD queue next to every data queue, which any context may
+ * send on under the lock. Calls waiting for a response are hashed by
+ * request id and listed by deadline, and the timer fails those past it. */
+struct rpc_queue {
+	struct verbs_queue q;
+	spinlock_t lock;
+	u64 next_id;
+	struct hlist_head pending[RPC_HASH_SIZE];
+	struct list_head by_deadline;
+	struct timer_list timer;
+
+	unsigned long stat_calls;
+	unsigned long stat_served;
+	unsigned long stat_timeouts;
+	unsigned long stat_dropped;
+
+	/* the bench thread, its calls go through the queue of the CPU it is on */
+	struct task_struct *bench_task;
+	wait_queue_head_t bench_wait;
+	atomic_t bench_out;
+	atomic_long_t bench_calls;
+	atomic_long_t bench_errors;
+	int bench_lat;			/* 0 while the call is out, then 1 or the error */
+};
+
+static struct rpc_queue *rpc_queues;
+static unsigned int nr_rpc;
+static int rpc_ready;
+static verbs_rpc_handler_t rpc_handlers[VERBS_RPC_METHODS];
+static DEFINE_SPINLOCK (rpc_handlers_lock);
+
+static int rpc_bench_go;
+static unsigned long rpc_bench_end;
+static ktime_t rpc_bench_t0;
+static atomic_t rpc_bench_running = ATOMIC_INIT (0);
+static DECLARE_WAIT_QUEUE_HEAD (rpc_bench_wait);
+
+static unsigned long stat_path_queries;
+static unsigned long stat_path_misses;
+
+static void path_flush_work (struct work_struct *);
+
+static DECLARE_WORK (path_flush, path_flush_work);
+
+
+/* Benchmark suite. A test runs when its name is written to debugfs "run",
+ * with the settings found in the files next to it, on queues nothing else
+ * sends on. The last result of every test stays in "results". */
+enum {
+	BENCH_SEND_BW,
+	BENCH_SEND_LAT,
+	BENCH_MSG_RATE,
+	BENCH_TESTS,
+};
+
+static const char *bench_names[] = { "send_bw", "send_lat", "msg_rate" };
+
+struct bench_result {
+	int valid;
+	u32 transport;
+	u32 size;
+	u32 depth;
+	u32 iters;
+	u64 ns;
+	u64 msgs;
+	struct lat_hist hist;
+};
+
+static u32 bench_transport;		/* 0 - UD sends, 1 - RC RDMA WRITEs */
+static u32 bench_size = 64;
+static u32 bench_depth = 128;
+static u32 bench_iters = 100000;
+
+static struct bench_result bench_results[BENCH_TESTS];
+static DEFINE_MUTEX (bench_mutex);
+static DEFINE_SPINLOCK (bench_lock);	/* bench_queue sends, pongs come from the tasklet */
+static unsigned long bench_pong;
+static struct dentry *dbg_dir;
+
+static int bench_queue_prepare (struct verbs_queue *q);
+static void bench_recv_handler (struct verbs_queue *q, struct ib_wc *wc);
+static ssize_t bench_run_write (struct file *file, const char __user *ubuf, size_t count, loff_t *ppos);
+static int bench_results_open (struct inode *inode, struct file *file);
+
+static const struct file_operations bench_run_fops = {
+	.owner = THIS_MODULE,
+	.write = bench_run_write,
+};
+
+static const struct file_operations bench_results_fops = {
+	.owner = THIS_MODULE,
+	.open = bench_results_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+
+/* Everyone we exchanged info with, keyed by GID and LID. An entry never
+ * changes once it is published: a rejoin puts a new one in its place, and
+ * the old one is freed after a grace period. */
+struct verbs_peer {
+	struct hlist_node node;
+	struct ib_side_info info;
+	u32 addr;
+	int slot;			/* in peer_array, -1 if it was full */
+	unsigned long joined;		/* jiffies of the last exchange */
+	unsigned int exchanges;
+};
+
+static struct hlist_head peer_hash[PEER_HASH_SIZE];
+static DEFINE_SPINLOCK (peer_lock);
+
+/* the same peers in the order they joined, for round robin senders; the
+ * entries are read under RCU */
+static struct verbs_peer *peer_array[MAX_PEERS];
+static unsigned int nr_peers;
+
+
+/* the benchmark's remote side, the first peer; under rcu_read_lock, NULL
+ * until it joins */
+static inline struct ib_side_info *remote_get (void)
+{
+	struct verbs_peer *peer = rcu_dereference (peer_array[0]);
+
+	return peer ? &peer->info : NULL;
+}
 
 
 /* prototypes */
-static int init_qp (struct ib_qp *qp);
-static int path_rec_lookup_start (void);
+static int init_qp (struct ib_qp *qp, u8 port_num);
+static int ports_query (void);
+static unsigned int port_mtu (void);
+static void port_addr (unsigned int i, u16 *lid, union ib_gid *gid, u16 *pk);
+static void local_info_get (struct ib_side_info *info);
+static int queue_move (struct verbs_queue *q);
+static struct path_entry *path_find (unsigned int port, u16 dlid, union ib_gid *gid);
+static struct ib_ah *path_ah (unsigned int port, u16 dlid, union ib_gid *gid);
+static void path_resolve (unsigned int port, u16 dlid, union ib_gid *gid);
+static void path_query (struct path_entry *e);
 static void verbs_path_rec_completion (int status, struct ib_sa_path_rec *resp, void *context);
+static void path_flush_all (void);
+static void path_fill_work (struct work_struct *work);
+static int path_ah_attr (unsigned int port, struct ib_sa_path_rec *rec, struct ib_ah_attr *av);
+
+static void credit_setup (void);
+static unsigned int credit_avail (struct verbs_queue *q);
+static void credit_acked (struct verbs_queue *q, unsigned long ack);
+static void credit_post (unsigned int s);
+static void credit_data_handler (struct verbs_queue *q, struct ib_wc *wc);
+static void credit_recv_handler (struct verbs_queue *q, struct ib_wc *wc);
+static void verbs_port_event (struct ib_event_handler *handler, struct ib_event *event);
+
+static void rpc_recv_handler (struct verbs_queue *q, struct ib_wc *wc);
+static void rpc_timer_func (unsigned long data);
+static int rpc_echo (u32 method, const void *req, unsigned int len, void *resp, unsigned int *resp_len);
+static void rpc_start (void);
+static void rpc_shutdown (void);
 
 static void timer_func (unsigned long);
 
@@ -89,30 +693,85 @@ static DEFINE_TIMER (verbs_timer, timer_func, 0, 0);
 static int send_remote_info (struct socket *sock, struct ib_side_info *info);
 static int recv_remote_info (struct socket *sock, struct ib_side_info *info);
 
-static int exchange_info (unsigned int addr);
-
-static void verbs_post_recv_req (void);
-
-
-static void verbs_comp_handler_recv (struct ib_cq *cq, void *context)
+static int rdv_start (void);
+static void rdv_stop (void);
+static int rdv_accept_thread (void *);
+static void rdv_work (struct work_struct *work);
+static void rdv_set_timeouts (struct socket *s);
+static void rdv_announce_work (struct work_struct *);
+
+static DECLARE_WORK (rdv_announce, rdv_announce_work);
+static void peer_add (struct ib_side_info *info, u32 addr);
+static void peer_resolve (struct ib_side_info *info);
+static struct ib_ah *peer_ah (struct verbs_queue *q, struct ib_side_info *info, unsigned int j);
+static void peer_table_free (void);
+
+static int mcast_join (void);
+static int verbs_mcast_join_done (int status, struct ib_sa_multicast *m);
+static int mcast_thread (void *);
+
+static struct buf_pool *buf_pool_create (size_t len, unsigned int nr, enum dma_data_direction dir);
+static void buf_pool_destroy (struct buf_pool *p);
+static int buf_get (struct buf_pool *p, u32 *id);
+static void buf_put (struct buf_pool *p, u32 id);
+static u64 buf_dma (struct buf_pool *p, u32 id);
+static void *buf_addr (struct buf_pool *p, u32 id);
+static void buf_sync (struct buf_pool *p, u32 id, size_t len);
+
+static struct recv_ring *recv_ring_alloc (void);
+static void recv_ring_free (struct recv_ring *r);
+static void recv_refill (struct recv_ring *r);
+
+static int queue_init (struct verbs_queue *q);
+static int rc_init (void);
+static int rc_qp_init (void);
+static void rc_start (void);
+static void rc_free (void);
+static void queue_destroy (struct verbs_queue *q);
+static int send_thread (void *);
+static void send_wake_all (void);
+static void send_fill_ud (struct verbs_queue *q, struct ib_send_wr *wr, struct ib_sge *sge,
+			  unsigned long seq, u32 id, unsigned int len, int inl, u32 op, u64 tag);
+static void lat_sweep (struct verbs_queue *q);
+
+static void cq_poll_init (struct cq_poll *p, struct verbs_queue *q, void (*handler) (struct verbs_queue *, struct ib_wc *));
+static void cq_poll_tasklet (unsigned long data);
+static void send_handler (struct verbs_queue *q, struct ib_wc *wc);
+static void recv_handler (struct verbs_queue *q, struct ib_wc *wc);
+
+
+static void verbs_comp_handler (struct ib_cq *cq, void *context)
 {
-	printk (KERN_INFO "verbs_comp_handler_recv called\n");
+	struct cq_poll *p = context;
+
+	p->events++;
+	if (!cq_stopping)
+		tasklet_schedule (&p->tasklet);
 }
 
 
 static void verbs_qp_event(struct ib_event *event, void *context)
 {
-	printk(KERN_ERR "QP event %d\n", event->event);
+	if (event->event == IB_EVENT_PATH_MIG)
+		printk (KERN_INFO "QP %x migrated to its alternate path\n", event->element.qp->qp_num);
+	else
+		printk(KERN_ERR "QP event %d\n", event->event);
 }
 
 
 static void verbs_add_device (struct ib_device *dev)
 {
-	int ret;
-	struct ib_qp_init_attr attrs;
+	unsigned int i, up[MAX_PORTS], nr_up = 0, len;
+	int ret, cpu;
 
-	if (ib_dev)
+	if (ib_dev) {
+		printk (KERN_INFO "IB device %s ignored, %s is in use\n", dev->name, ib_dev->name);
+		return;
+	}
+	if (device && strcmp (dev->name, device)) {
+		printk (KERN_INFO "IB device %s ignored, not %s\n", dev->name, device);
 		return;
+	}
 
 	/* durty hack for ib_dma_map_single not to segfault */
 	dev->dma_ops = NULL;
@@ -126,19 +785,26 @@ static void verbs_add_device (struct ib_device *dev)
 		return;
 	}
 
-	printk (KERN_INFO "IB device caps: max_qp %d, max_mcast_grp: %d, max_pkeys: %d\n",
-		dev_attr.max_qp, dev_attr.max_mcast_grp, (int)dev_attr.max_pkeys);
+	printk (KERN_INFO "IB device caps: max_qp %d, max_mcast_grp: %d, max_pkeys: %d, comp vectors: %d\n",
+		dev_attr.max_qp, dev_attr.max_mcast_grp, (int)dev_attr.max_pkeys, dev->num_comp_vectors);
 
-	/* We'll work with first port. It's a sample module, anyway. Who is that moron which decided
-	 * to count ports from one? */
-	ret = ib_query_port (dev, 1, &port_attr);
+	/* Who is that moron which decided to count ports from one? */
+	nr_ports = min ((unsigned int)dev->phys_port_cnt, (unsigned int)MAX_PORTS);
+	ret = ports_query ();
 	if (ret) {
-		printk (KERN_INFO "ib_query_port failed: %d\n", ret);
+		printk (KERN_INFO "port query failed: %d\n", ret);
 		return;
 	}
 
-	printk (KERN_INFO "Port info: lid: %u, sm_lid: %u, max_msg_size: %u\n",
-		(unsigned)port_attr.lid, (unsigned)port_attr.sm_lid, port_attr.max_msg_sz);
+	for (i = 0; i < nr_ports; i++) {
+		printk (KERN_INFO "Port %u info: %s, lid: %u, sm_lid: %u, max_msg_size: %u\n", ports[i].num,
+			ports[i].active ? "active" : "down", (unsigned)ports[i].attr.lid,
+			(unsigned)ports[i].attr.sm_lid, ports[i].attr.max_msg_sz);
+		if (ports[i].active)
+			up[nr_up++] = i;
+	}
+	if (!nr_up)
+		up[nr_up++] = first_port;
 
 	pd = ib_alloc_pd (dev);
 	if (IS_ERR (pd)) {
@@ -147,476 +813,3931 @@ static void verbs_add_device (struct ib_device *dev)
 		return;
 	}
 
-	printk (KERN_INFO "PD allocated\n");
+	printk (KERN_INFO "PD allocated\n");
+
+	mr = ib_get_dma_mr (pd, IB_ACCESS_LOCAL_WRITE);
+	if (IS_ERR (mr)) {
+		ret = PTR_ERR (mr);
+		printk (KERN_INFO "get_dma_mr failed: %d\n", ret);
+		return;
+	}
+
+	/* a UD message is one MTU at most */
+	buf_size = clamp (buf_size, 1U, (unsigned int)ib_mtu_enum_to_int (port_attr.active_mtu));
+	/* acks ride in the header */
+	if (credits)
+		buf_size = max (buf_size, (unsigned int)sizeof (struct verbs_msg_hdr));
+
+	if (ib_dev->dma_ops)
+		printk (KERN_INFO "DMA ops are defined\n");
+
+	recv_depth = clamp (recv_depth, 1U, (unsigned int)(use_srq ? dev_attr.max_srq_wr : dev_attr.max_qp_wr));
+	refill_batch = clamp (refill_batch, 1U, recv_depth);
+	send_depth = min (send_depth, (unsigned int)CQ_SIZE);
+	send_chain = clamp (send_chain, 1U, max (send_depth, 1U));
+	signal_every = clamp (signal_every, 1U, max (send_depth, 1U));
+
+	if (use_srq) {
+		struct ib_srq_init_attr srq_attrs;
+
+		shared_ring = recv_ring_alloc ();
+		if (!shared_ring) {
+			printk (KERN_INFO "Receive ring allocation failed\n");
+			return;
+		}
+
+		memset (&srq_attrs, 0, sizeof (srq_attrs));
+		srq_attrs.event_handler = verbs_qp_event;
+		srq_attrs.attr.max_wr = recv_depth;
+		srq_attrs.attr.max_sge = 1;
+
+		shared_ring->srq = ib_create_srq (pd, &srq_attrs);
+		if (IS_ERR (shared_ring->srq)) {
+			ret = PTR_ERR (shared_ring->srq);
+			printk (KERN_INFO "srq allocation failed: %d\n", ret);
+			shared_ring->srq = NULL;
+			return;
+		}
+	}
+
+	/* a queue on every active port at least, so that all of them carry traffic */
+	nr_queues = multi_queue ? min (num_online_cpus (), (unsigned int)MAX_QUEUES) : 1;
+	nr_queues = max (nr_queues, nr_up);
+	nr_queues = min (nr_queues, (unsigned int)dev_attr.max_qp);
+
+	/* every buffer the data path touches, mapped up front; the CPU caches
+	 * may hold some on top of what the queues keep in flight. An RPC may
+	 * take a whole MTU. */
+	len = lat_bench || suite ? max (buf_size, (unsigned int)LAT_MAX) : buf_size;
+	if (rpc)
+		len = max (len, (unsigned int)ib_mtu_enum_to_int (port_attr.active_mtu));
+	send_pool = buf_pool_create (len, nr_queues * send_depth + (mcast ? MCAST_FANOUT_MAX : 0) + (suite ? CQ_SIZE : 0) +
+				     (credits ? CQ_SIZE : 0) + (rpc ? nr_queues * CQ_SIZE : 0) +
+				     num_possible_cpus () * POOL_CACHE, DMA_TO_DEVICE);
+	/* whatever peers send us fits */
+	recv_pool = buf_pool_create (ib_mtu_enum_to_int (port_attr.active_mtu) + GRH_SIZE,
+				     (shared_ring ? 1 : nr_queues + !!mcast + !!suite + !!credits + (rpc ? nr_queues : 0)) * recv_depth +
+				     num_possible_cpus () * POOL_CACHE, DMA_FROM_DEVICE);
+	if (!send_pool || !recv_pool) {
+		printk (KERN_INFO "Buffer pool allocation failed\n");
+		return;
+	}
+
+	printk (KERN_INFO "Buffer pools: %u send, %u receive buffers\n", send_pool->nr, recv_pool->nr);
+
+	/* two ib_wc batches and the send buffers make a queue some 10 KB, too much
+	 * for one kmalloc of many of them */
+	queues = vzalloc (nr_queues * sizeof (*queues));
+	if (!queues) {
+		printk (KERN_INFO "Memory allocation error\n");
+		return;
+	}
+
+	cpu = first_cpu (cpu_online_map);
+
+	for (i = 0; i < nr_queues; i++) {
+		queues[i].idx = i;
+		queues[i].cpu = multi_queue ? cpu : -1;
+		queues[i].port = queues[i].home = up[i % nr_up];
+		cpu = next_cpu (cpu, cpu_online_map);
+
+		ret = queue_init (&queues[i]);
+		if (ret) {
+			printk (KERN_INFO "queue %u setup failed: %d\n", i, ret);
+			return;
+		}
+
+		local_info.qpns[i] = queues[i].qp->qp_num;
+		local_info.qp_ports[i] = queues[i].port;
+		if (credits)
+			queues[i].recv_poll.handler = credit_data_handler;
+	}
+
+	if (shared_ring) {
+		recv_refill (shared_ring);
+		printk (KERN_INFO "%u receive buffers posted to SRQ\n", shared_ring->posted);
+	}
+
+	printk (KERN_INFO "%u queues ready\n", nr_queues);
+
+	/* a queue of its own, so that its sends can be timed one by one */
+	if (mcast) {
+		mc_queue.idx = nr_queues;
+		mc_queue.cpu = -1;
+		mc_queue.port = mc_queue.home = first_port;
+		ret = queue_init (&mc_queue);
+		if (ret) {
+			printk (KERN_INFO "multicast queue setup failed: %d\n", ret);
+			return;
+		}
+	}
+
+	if (suite) {
+		bench_queue.idx = nr_queues + 1;
+		bench_queue.cpu = -1;
+		bench_queue.port = bench_queue.home = first_port;
+		ret = queue_init (&bench_queue);
+		if (!ret)
+			ret = bench_queue_prepare (&bench_queue);
+		if (ret) {
+			printk (KERN_INFO "bench queue setup failed: %d\n", ret);
+			return;
+		}
+		bench_queue.recv_poll.handler = bench_recv_handler;
+		local_info.bench_qpn = bench_queue.qp->qp_num;
+	}
+
+	if (credits) {
+		credit_queue.idx = nr_queues + 2;
+		credit_queue.cpu = -1;
+		credit_queue.port = credit_queue.home = first_port;
+		ret = queue_init (&credit_queue);
+		if (ret) {
+			printk (KERN_INFO "credit queue setup failed: %d\n", ret);
+			return;
+		}
+		credit_queue.recv_poll.handler = credit_recv_handler;
+		local_info.credit_qpn = credit_queue.qp->qp_num;
+		local_info.recv_credits = recv_depth > refill_batch ? recv_depth - refill_batch : 1;
+		local_info.recv_shared = !!shared_ring;
+	}
+
+	/* next to every data queue, on its port and completion vector */
+	if (rpc) {
+		rpc_queues = vzalloc (nr_queues * sizeof (*rpc_queues));
+		if (!rpc_queues) {
+			printk (KERN_INFO "Memory allocation error\n");
+			return;
+		}
+
+		nr_rpc = nr_queues;
+		for (i = 0; i < nr_rpc; i++) {
+			spin_lock_init (&rpc_queues[i].lock);
+			INIT_LIST_HEAD (&rpc_queues[i].by_deadline);
+			setup_timer (&rpc_queues[i].timer, rpc_timer_func, (unsigned long)&rpc_queues[i]);
+			init_waitqueue_head (&rpc_queues[i].bench_wait);
+		}
+
+		for (i = 0; i < nr_rpc; i++) {
+			struct verbs_queue *q = &rpc_queues[i].q;
+
+			q->idx = i;
+			q->cpu = queues[i].cpu;
+			q->port = q->home = queues[i].home;
+			ret = queue_init (q);
+			if (ret) {
+				printk (KERN_INFO "RPC queue %u setup failed: %d\n", i, ret);
+				return;
+			}
+			q->recv_poll.handler = rpc_recv_handler;
+			local_info.rpc_qpns[i] = q->qp->qp_num;
+			local_info.rpc_ports[i] = q->port;
+		}
+
+		local_info.nr_rpc = nr_rpc;
+		verbs_rpc_register (VERBS_RPC_ECHO, rpc_echo);
+		smp_wmb ();
+		rpc_ready = 1;
+		printk (KERN_INFO "%u RPC queues ready, calls up to %u bytes\n", nr_rpc, verbs_rpc_max_size ());
+	}
+
+	if (rc_bench && rc_init ())
+		return;
+	if (rc_bench && suite && bench_queue_prepare (&rc_queue))
+		return;
+
+	local_info.qp_num = queues[0].qp->qp_num;
+	local_info.nr_qps = nr_queues;
+
+	INIT_IB_EVENT_HANDLER (&port_event_handler, ib_dev, verbs_port_event);
+	ret = ib_register_event_handler (&port_event_handler);
+	if (ret) {
+		printk (KERN_INFO "event handler registration failed: %d\n", ret);
+		port_event_handler.device = NULL;
+		return;
+	}
+
+	if (mcast && !port_attr.lid)
+		printk (KERN_INFO "No subnet manager to join the multicast group with\n");
+	else if (mcast) {
+		ret = mcast_join ();
+		if (ret) {
+			printk (KERN_INFO "multicast join start failed: %d\n", ret);
+			return;
+		}
+	}
+
+	/* now we are ready to send our QP number and other stuff to other
+	 * parties, the benchmark starts once the first of them is known */
+	ret = rdv_start ();
+	if (ret)
+		printk (KERN_INFO "rendezvous start failed: %d\n", ret);
+}
+
+
+static void bench_start_work (struct work_struct *dummy)
+{
+	unsigned int i;
+
+	/* the suite may need the RC queue for itself */
+	if (rc_queue.qp && !suite)
+		rc_start ();
+
+	credit_setup ();
+	rpc_start ();
+
+	/* queue i sends to the peer's queue i, so its receive load spreads too */
+	for (i = 0; i < nr_queues && send_depth; i++) {
+		struct verbs_queue *q = &queues[i];
+
+		q->send_task = kthread_create (send_thread, q, "verbs_send/%u", i);
+		if (IS_ERR (q->send_task)) {
+			printk (KERN_INFO "send thread start failed: %ld\n", PTR_ERR (q->send_task));
+			q->send_task = NULL;
+			continue;
+		}
+		if (q->cpu >= 0)
+			kthread_bind (q->send_task, q->cpu);
+		wake_up_process (q->send_task);
+	}
+
+	if (mc_queue.qp) {
+		mcast_task = kthread_run (mcast_thread, NULL, "verbs_mcast");
+		if (IS_ERR (mcast_task)) {
+			printk (KERN_INFO "multicast thread start failed: %ld\n", PTR_ERR (mcast_task));
+			mcast_task = NULL;
+		}
+	}
+
+	mod_timer (&verbs_timer, NEXTJIFF(1));
+}
+
+
+static void verbs_remove_device (struct ib_device *dev)
+{
+	unsigned int i;
+
+	if (dev != ib_dev)
+		return;
+
+	printk (KERN_INFO "IB remove device called. Name = %s\n", dev->name);
+
+	/* no more peers, and no benchmark starting behind our back */
+	mutex_lock (&bench_mutex);
+	rdv_stop ();
+	if (port_event_handler.device)
+		ib_unregister_event_handler (&port_event_handler);
+	port_event_handler.device = NULL;
+	flush_scheduled_work ();
+
+	if (queues)
+		for (i = 0; i < nr_queues; i++)
+			if (queues[i].send_task) {
+				kthread_stop (queues[i].send_task);
+				queues[i].send_task = NULL;
+			}
+	if (rc_queue.send_task)
+		kthread_stop (rc_queue.send_task);
+	rc_queue.send_task = NULL;
+	if (mcast_task)
+		kthread_stop (mcast_task);
+	mcast_task = NULL;
+	for (i = 0; i < nr_rpc; i++)
+		if (rpc_queues[i].bench_task) {
+			kthread_stop (rpc_queues[i].bench_task);
+			rpc_queues[i].bench_task = NULL;
+		}
+	flush_scheduled_work ();
+
+	/* handlers post to the QPs, stop them first */
+	cq_stopping = 1;
+	if (queues)
+		for (i = 0; i < nr_queues; i++) {
+			tasklet_kill (&queues[i].send_poll.tasklet);
+			tasklet_kill (&queues[i].recv_poll.tasklet);
+		}
+	tasklet_kill (&rc_queue.send_poll.tasklet);
+	tasklet_kill (&rc_queue.recv_poll.tasklet);
+	tasklet_kill (&mc_queue.send_poll.tasklet);
+	tasklet_kill (&mc_queue.recv_poll.tasklet);
+	tasklet_kill (&bench_queue.send_poll.tasklet);
+	tasklet_kill (&bench_queue.recv_poll.tasklet);
+	tasklet_kill (&credit_queue.send_poll.tasklet);
+	tasklet_kill (&credit_queue.recv_poll.tasklet);
+	for (i = 0; i < nr_rpc; i++) {
+		tasklet_kill (&rpc_queues[i].q.send_poll.tasklet);
+		tasklet_kill (&rpc_queues[i].q.recv_poll.tasklet);
+	}
+
+	/* no response can come any more */
+	rpc_shutdown ();
+
+	/* after the free the join callback can't run any more */
+	if (mcast_group)
+		ib_sa_free_multicast (mcast_group);
+	mcast_group = NULL;
+	if (mcast_ah) {
+		ib_detach_mcast (mc_queue.qp, &mcast_mgid_joined, mcast_mlid);
+		ib_destroy_ah (mcast_ah);
+	}
+	mcast_ah = NULL;
+
+	/* address handles go before the PD, and late path completions with them */
+	path_flush_all ();
+	wait_event (path_wait, !atomic_read (&path_pending));
+	flush_scheduled_work ();
+	peer_table_free ();
+
+	if (queues)
+		for (i = 0; i < nr_queues; i++)
+			queue_destroy (&queues[i]);
+	vfree (queues);
+	queues = NULL;
+
+	queue_destroy (&rc_queue);
+	rc_free ();
+	queue_destroy (&mc_queue);
+	queue_destroy (&bench_queue);
+	queue_destroy (&credit_queue);
+	for (i = 0; i < nr_rpc; i++)
+		queue_destroy (&rpc_queues[i].q);
+	vfree (rpc_queues);
+	rpc_queues = NULL;
+	nr_rpc = 0;
+
+	/* the suite's, a send thread frees its own */
+	kfree (bench_queue.send_wrs);
+	kfree (bench_queue.send_sges);
+	kfree (rc_queue.send_wrs);
+	kfree (rc_queue.send_sges);
+	bench_queue.send_wrs = rc_queue.send_wrs = NULL;
+	bench_queue.send_sges = rc_queue.send_sges = NULL;
+
+	if (shared_ring) {
+		if (shared_ring->srq)
+			ib_destroy_srq (shared_ring->srq);
+		recv_ring_free (shared_ring);
+		shared_ring = NULL;
+	}
+
+	/* nothing references the buffers with the QPs gone */
+	if (send_pool)
+		buf_pool_destroy (send_pool);
+	if (recv_pool)
+		buf_pool_destroy (recv_pool);
+	send_pool = recv_pool = NULL;
+
+	if (mr)
+		ib_dereg_mr (mr);
+	if (pd)
+		ib_dealloc_pd (pd);
+
+	mutex_unlock (&bench_mutex);
+}
+
+
+/* CQ pair on the queue's completion vector, the QP, and its receive ring */
+static int queue_init (struct verbs_queue *q)
+{
+	struct ib_qp_init_attr attrs;
+	int vector = q->idx % ib_dev->num_comp_vectors;
+	int ret;
+
+	init_waitqueue_head (&q->send_wait);
+	cq_poll_init (&q->send_poll, q, send_handler);
+	cq_poll_init (&q->recv_poll, q, recv_handler);
+
+	q->send_cq = ib_create_cq (ib_dev, verbs_comp_handler, NULL, &q->send_poll, CQ_SIZE, vector);
+	if (IS_ERR (q->send_cq)) {
+		ret = PTR_ERR (q->send_cq);
+		q->send_cq = NULL;
+		printk (KERN_INFO "ib_create_cq failed: %d\n", ret);
+		return ret;
+	}
+
+	q->recv_cq = ib_create_cq (ib_dev, verbs_comp_handler, NULL, &q->recv_poll, recv_depth, vector);
+	if (IS_ERR (q->recv_cq)) {
+		ret = PTR_ERR (q->recv_cq);
+		q->recv_cq = NULL;
+		printk (KERN_INFO "ib_create_cq failed: %d\n", ret);
+		return ret;
+	}
+
+	q->send_poll.cq = q->send_cq;
+	q->recv_poll.cq = q->recv_cq;
+	ib_req_notify_cq (q->send_cq, IB_CQ_NEXT_COMP);
+	ib_req_notify_cq (q->recv_cq, IB_CQ_NEXT_COMP);
+
+	/* one-sided RDMA consumes no receives */
+	if (q->rc)
+		q->ring = NULL;
+	else if (shared_ring)
+		q->ring = shared_ring;
+	else {
+		q->ring = recv_ring_alloc ();
+		if (!q->ring)
+			return -ENOMEM;
+	}
+
+	if (!q->rc) {
+		q->hdr_pool = buf_pool_create (sizeof (struct verbs_msg_hdr), CQ_SIZE, DMA_TO_DEVICE);
+		if (!q->hdr_pool)
+			return -ENOMEM;
+	}
+
+	memset (&attrs, 0, sizeof (attrs));
+	attrs.qp_type = q->rc ? IB_QPT_RC : IB_QPT_UD;
+	attrs.sq_sig_type = IB_SIGNAL_REQ_WR;
+	attrs.event_handler = verbs_qp_event;
+	attrs.cap.max_send_wr = CQ_SIZE;
+	attrs.cap.max_recv_wr = q->ring && !shared_ring ? recv_depth : 1;
+	attrs.cap.max_send_sge = q->rc ? 1 : min (SEND_SGE, dev_attr.max_sge);
+	attrs.cap.max_recv_sge = 1;
+	attrs.cap.max_inline_data = q->rc ? 0 : inline_size;
+	attrs.send_cq = q->send_cq;
+	attrs.recv_cq = q->recv_cq;
+	attrs.srq = q->ring ? q->ring->srq : NULL;
+
+	q->qp = ib_create_qp (pd, &attrs);
+
+	/* some devices refuse inline data they can't do, rather than trim it */
+	if (IS_ERR (q->qp) && attrs.cap.max_inline_data) {
+		printk (KERN_INFO "QP with %u bytes inline refused, trying without\n", attrs.cap.max_inline_data);
+		attrs.cap.max_inline_data = 0;
+		q->qp = ib_create_qp (pd, &attrs);
+	}
+	if (IS_ERR (q->qp)) {
+		ret = PTR_ERR (q->qp);
+		q->qp = NULL;
+		printk (KERN_INFO "qp allocation failed: %d\n", ret);
+		return ret;
+	}
+
+	/* the device reports back what it gave us */
+	q->max_inline = attrs.cap.max_inline_data;
+	q->max_sge = attrs.cap.max_send_sge;
+
+	printk (KERN_INFO "Create QP with num %x, port %u, CPU %d, completion vector %d, %u bytes inline, %u SGEs\n",
+		q->qp->qp_num, ports[q->port].num, q->cpu, vector, q->max_inline, q->max_sge);
+
+	/* RC goes past INIT once the peer is known */
+	if (q->rc)
+		return 0;
+
+	if (init_qp (q->qp, ports[q->port].num)) {
+		printk (KERN_INFO "Failed to initialize QP\n");
+		return -EIO;
+	}
+
+	/* fill the ring before the peer learns about us */
+	if (!shared_ring) {
+		q->ring->qp = q->qp;
+		recv_refill (q->ring);
+	}
+
+	return 0;
+}
+
+
+static void queue_destroy (struct verbs_queue *q)
+{
+	if (q->qp)
+		ib_destroy_qp (q->qp);
+	if (q->send_cq)
+		ib_destroy_cq (q->send_cq);
+	if (q->recv_cq)
+		ib_destroy_cq (q->recv_cq);
+	if (q->ring && q->ring != shared_ring)
+		recv_ring_free (q->ring);
+	if (q->hdr_pool)
+		buf_pool_destroy (q->hdr_pool);
+}
+
+
+/* RC queue in INIT, with a buffer the peer may read and write */
+static int rc_init (void)
+{
+	struct ib_phys_buf pbuf;
+	u64 iova;
+	int ret;
+
+	rc_msg = clamp (rc_msg, 1U, (unsigned int)RC_MSG_MAX);
+	rc_len = (size_t)rc_msg * RC_SLOTS;
+
+	rc_buf = (void *)__get_free_pages (GFP_KERNEL | __GFP_ZERO, get_order (rc_len));
+	if (!rc_buf) {
+		printk (KERN_INFO "RC buffer allocation failed\n");
+		return -ENOMEM;
+	}
+
+	rc_dma = ib_dma_map_single (ib_dev, rc_buf, rc_len, DMA_BIDIRECTIONAL);
+	if (ib_dma_mapping_error (ib_dev, rc_dma)) {
+		printk (KERN_INFO "Error mapping RC buffer\n");
+		free_pages ((unsigned long)rc_buf, get_order (rc_len));
+		rc_buf = NULL;
+		return -EIO;
+	}
+
+	/* the rkey goes to every peer, so it covers this buffer and nothing else;
+	 * iova is the bus address, so local SGEs address it the same way */
+	pbuf.addr = rc_dma;
+	pbuf.size = rc_len;
+	iova = rc_dma;
+	rc_mr = ib_reg_phys_mr (pd, &pbuf, 1, IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE | IB_ACCESS_REMOTE_READ, &iova);
+	if (IS_ERR (rc_mr)) {
+		ret = PTR_ERR (rc_mr);
+		rc_mr = NULL;
+		printk (KERN_INFO "reg_phys_mr for RC failed: %d\n", ret);
+		return ret;
+	}
+
+	rc_queue.idx = 0;
+	rc_queue.cpu = -1;
+	rc_queue.rc = 1;
+	rc_queue.port = rc_queue.home = first_port;
+
+	ret = queue_init (&rc_queue);
+	if (ret) {
+		printk (KERN_INFO "RC queue setup failed: %d\n", ret);
+		return ret;
+	}
+
+	ret = rc_qp_init ();
+	if (ret)
+		return ret;
+
+	get_random_bytes (&rc_psn, sizeof (rc_psn));
+	rc_psn &= 0xffffff;
+
+	local_info.rc_qpn = rc_queue.qp->qp_num;
+	local_info.rc_psn = rc_psn;
+	local_info.rc_rkey = rc_mr->rkey;
+	local_info.rc_addr = iova;
+	local_info.rc_len = rc_len;
+
+	printk (KERN_INFO "RC QP %x, %zu byte buffer, rkey %x\n", rc_queue.qp->qp_num, rc_len, rc_mr->rkey);
+	return 0;
+}
+
+
+static int rc_qp_init (void)
+{
+	struct ib_qp_attr qp_attr;
+	int ret;
+
+	memset (&qp_attr, 0, sizeof (qp_attr));
+	qp_attr.qp_state = IB_QPS_INIT;
+	qp_attr.pkey_index = 0;
+	qp_attr.port_num = ports[rc_queue.port].num;
+	qp_attr.qp_access_flags = IB_ACCESS_REMOTE_WRITE | IB_ACCESS_REMOTE_READ;
+	ret = ib_modify_qp (rc_queue.qp, &qp_attr, IB_QP_STATE | IB_QP_PKEY_INDEX | IB_QP_PORT | IB_QP_ACCESS_FLAGS);
+	if (ret)
+		printk (KERN_INFO "failed to modify RC QP to init, ret = %d\n", ret);
+	return ret;
+}
+
+
+/* the RC send thread, if the peer's buffer takes our messages */
+static void rc_start (void)
+{
+	struct ib_side_info *remote;
+	int ok;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	ok = remote && remote->rc_qpn && remote->rc_len >= rc_len;
+	rcu_read_unlock ();
+
+	if (!ok) {
+		printk (KERN_INFO "Peer has no RC buffer big enough, RC bench disabled\n");
+		return;
+	}
+
+	rc_queue.send_task = kthread_run (send_thread, &rc_queue, "verbs_rc");
+	if (IS_ERR (rc_queue.send_task)) {
+		printk (KERN_INFO "RC thread start failed: %ld\n", PTR_ERR (rc_queue.send_task));
+		rc_queue.send_task = NULL;
+	}
+}
+
+
+/* The benchmark peer came back with a new RC QP. Ours goes through the error
+ * state, which flushes what was in flight to the old one, back to INIT, and
+ * connects to the new one along the path we have. The send thread stops
+ * meanwhile and starts again if it ran. */
+static void rc_rejoin_work (struct work_struct *dummy)
+{
+	struct ib_qp_attr qp_attr;
+	int restart = 0, ret;
+
+	if (!rc_queue.qp)
+		return;
+
+	cancel_work_sync (&rc_connect);
+	rc_connected = 0;
+	if (rc_queue.send_task) {
+		kthread_stop (rc_queue.send_task);
+		rc_queue.send_task = NULL;
+		restart = 1;
+	}
+
+	memset (&qp_attr, 0, sizeof (qp_attr));
+	qp_attr.qp_state = IB_QPS_ERR;
+	ret = ib_modify_qp (rc_queue.qp, &qp_attr, IB_QP_STATE);
+	if (ret) {
+		printk (KERN_INFO "failed to modify RC QP to error, ret = %d\n", ret);
+		return;
+	}
+
+	wait_event_timeout (rc_queue.send_wait, ACCESS_ONCE (rc_queue.send_done) == rc_queue.send_posted, HZ);
+	if (rc_queue.send_done != rc_queue.send_posted) {
+		printk (KERN_INFO "RC QP: WRs not flushed, not reconnecting\n");
+		return;
+	}
+
+	qp_attr.qp_state = IB_QPS_RESET;
+	ret = ib_modify_qp (rc_queue.qp, &qp_attr, IB_QP_STATE);
+	if (ret) {
+		printk (KERN_INFO "failed to modify RC QP to reset, ret = %d\n", ret);
+		return;
+	}
+	if (rc_qp_init ())
+		return;
+
+	if (have_path)
+		rc_connect_work (NULL);
+	if (restart)
+		rc_start ();
+}
+
+
+static void rc_free (void)
+{
+	if (rc_mr)
+		ib_dereg_mr (rc_mr);
+	rc_mr = NULL;
+
+	if (rc_buf) {
+		ib_dma_unmap_single (ib_dev, rc_dma, rc_len, DMA_BIDIRECTIONAL);
+		free_pages ((unsigned long)rc_buf, get_order (rc_len));
+	}
+	rc_buf = NULL;
+}
+
+
+/* Alternate path for automatic migration of the RC QP: from another port of
+ * ours to another port of the peer, if both have one up and the path to it is
+ * resolved. There is no APM without LIDs. */
+static int rc_alt_path (unsigned int *port, struct ib_sa_path_rec *rec)
+{
+	struct ib_side_info *remote;
+	struct path_entry *e;
+	unsigned long flags;
+	unsigned int i, r;
+	int found = 0;
+
+	if (!port_attr.lid)
+		return 0;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+
+	for (i = 0; remote && i < nr_ports && !found; i++) {
+		if (i == rc_queue.port || !ports[i].active)
+			continue;
+
+		for (r = 0; r < remote->nr_ports && !found; r++) {
+			if (remote->lids[r] == remote->lid)
+				continue;
+
+			spin_lock_irqsave (&path_lock, flags);
+			e = path_find (i, remote->lids[r], &remote->gids[r]);
+			found = e && e->ah;
+			if (found) {
+				*rec = e->rec;
+				*port = i;
+			}
+			spin_unlock_irqrestore (&path_lock, flags);
+		}
+	}
+
+	rcu_read_unlock ();
+	return found;
+}
+
+
+/* RTR and RTS towards the peer's RC QP, along the path we resolved, with an
+ * alternate path armed where there is one */
+static void rc_connect_work (struct work_struct *dummy)
+{
+	struct ib_side_info *remote;
+	struct ib_sa_path_rec alt;
+	struct ib_qp_attr qp_attr;
+	unsigned int alt_port;
+	u32 qpn = 0, psn = 0;
+	int ret, mask, apm;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	if (remote) {
+		qpn = remote->rc_qpn;
+		psn = remote->rc_psn;
+	}
+	rcu_read_unlock ();
+
+	if (!rc_queue.qp || !qpn)
+		return;
+
+	memset (&qp_attr, 0, sizeof (qp_attr));
+	qp_attr.qp_state = IB_QPS_RTR;
+	qp_attr.path_mtu = path.mtu;
+	qp_attr.dest_qp_num = qpn;
+	qp_attr.rq_psn = psn;
+	qp_attr.max_dest_rd_atomic = min (dev_attr.max_qp_rd_atom, 16);
+	qp_attr.min_rnr_timer = 12;
+	ret = path_ah_attr (rc_queue.port, &path, &qp_attr.ah_attr);
+	if (ret) {
+		printk (KERN_INFO "RC address vector setup failed: %d\n", ret);
+		return;
+	}
+	mask = IB_QP_STATE | IB_QP_AV | IB_QP_PATH_MTU | IB_QP_DEST_QPN |
+		IB_QP_RQ_PSN | IB_QP_MAX_DEST_RD_ATOMIC | IB_QP_MIN_RNR_TIMER;
+
+	apm = rc_alt_path (&alt_port, &alt) && !path_ah_attr (alt_port, &alt, &qp_attr.alt_ah_attr);
+	if (apm) {
+		qp_attr.alt_pkey_index = 0;
+		qp_attr.alt_port_num = ports[alt_port].num;
+		qp_attr.alt_timeout = 14;
+		mask |= IB_QP_ALT_PATH;
+	}
+
+	ret = ib_modify_qp (rc_queue.qp, &qp_attr, mask);
+	if (ret) {
+		printk (KERN_INFO "failed to modify RC QP to RTR, ret = %d\n", ret);
+		return;
+	}
+
+	memset (&qp_attr, 0, sizeof (qp_attr));
+	qp_attr.qp_state = IB_QPS_RTS;
+	qp_attr.timeout = 14;
+	qp_attr.retry_cnt = 7;
+	qp_attr.rnr_retry = 7;
+	qp_attr.sq_psn = rc_psn;
+	qp_attr.max_rd_atomic = min (dev_attr.max_qp_rd_atom, 16);
+	mask = IB_QP_STATE | IB_QP_TIMEOUT | IB_QP_RETRY_CNT | IB_QP_RNR_RETRY | IB_QP_SQ_PSN | IB_QP_MAX_QP_RD_ATOMIC;
+	if (apm) {
+		qp_attr.path_mig_state = IB_MIG_REARM;
+		mask |= IB_QP_PATH_MIG_STATE;
+	}
+	ret = ib_modify_qp (rc_queue.qp, &qp_attr, mask);
+	if (ret) {
+		printk (KERN_INFO "failed to modify RC QP to RTS, ret = %d\n", ret);
+		return;
+	}
+
+	if (apm)
+		printk (KERN_INFO "RC QP connected to %x, alternate path from port %u to LID %u\n",
+			qpn, ports[alt_port].num, be16_to_cpu (alt.dlid));
+	else
+		printk (KERN_INFO "RC QP connected to %x, no alternate path\n", qpn);
+	rc_connected = 1;
+	wake_up (&rc_queue.send_wait);
+}
+
+
+static int init_qp (struct ib_qp *qp, u8 port_num)
+{
+	struct ib_qp_attr qp_attr;
+	int ret, attr_mask;
+	struct ib_qp_init_attr init_attr;
+
+	memset (&qp_attr, 0, sizeof (qp_attr));
+
+	qp_attr.qp_state = IB_QPS_INIT;
+	qp_attr.pkey_index = 0;
+	qp_attr.port_num = port_num;
+	qp_attr.qkey = 0;
+	attr_mask = IB_QP_STATE | IB_QP_PKEY_INDEX | IB_QP_PORT | IB_QP_QKEY;
+	ret = ib_modify_qp (qp, &qp_attr, attr_mask);
+	if (ret) {
+		printk (KERN_INFO "failed to modify QP to init, ret = %d\n", ret);
+		return 1;
+	}
+
+	qp_attr.qp_state = IB_QPS_RTR;
+	/* Can't set this in a INIT->RTR transition */
+	attr_mask &= ~IB_QP_PORT;
+	ret = ib_modify_qp(qp, &qp_attr, attr_mask);
+	if (ret) {
+		printk (KERN_INFO "failed to modify QP to RTR, ret = %d\n", ret);
+		return 1;
+	}
+
+	qp_attr.qp_state = IB_QPS_RTS;
+	qp_attr.sq_psn = 0;
+	attr_mask |= IB_QP_SQ_PSN;
+	attr_mask &= ~IB_QP_PKEY_INDEX;
+	ret = ib_modify_qp(qp, &qp_attr, attr_mask);
+	if (ret) {
+		printk (KERN_INFO "failed to modify QP to RTS, ret = %d\n", ret);
+		return 1;
+	}
+
+	ret = ib_query_qp (qp, &qp_attr, IB_QP_QKEY, &init_attr);
+	if (ret) {
+		printk (KERN_INFO "failed to query QP: %d\n", ret);
+		return 1;
+	}
+
+	local_info.qkey = qp_attr.qkey;
+
+	return 0;
+}
+
+
+static void timer_func (unsigned long dummy)
+{
+	unsigned long sent = 0, recvd = 0, posts = 0, send_errors = 0, inlined = 0;
+	unsigned long events = 0, runs = 0, wcs = 0, budget_hits = 0, missed = 0;
+	unsigned long recv_errors = 0, refills = 0, dry = 0;
+	unsigned long stalls = 0, lat_n = 0, drops = 0;
+	unsigned long rpc_calls = 0, rpc_served = 0, rpc_timeouts = 0, rpc_dropped = 0;
+	u64 stall_ns = 0, lat_ns = 0, lat_max = 0;
+	unsigned long port_sent[MAX_PORTS] = { 0 };
+	unsigned int port_queues[MAX_PORTS] = { 0 };
+	unsigned int posted = 0, low = ~0U, i;
+	unsigned int remote_qps = 0;
+	struct ib_side_info *remote;
+	struct verbs_queue *q;
+	struct recv_ring *r;
+	u16 remote_lid = 0;
+
+	if (!have_path)
+		return;
+
+	if (!have_remote_info)
+		return;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	if (remote) {
+		remote_qps = remote->nr_qps;
+		remote_lid = remote->lid;
+	}
+	rcu_read_unlock ();
+
+	/* acks lost on the way, or owed to a queue that stopped sending */
+	if (credit_active)
+		for (i = 0; i < remote_qps; i++)
+			if (credit_rx_next[i] != credit_rx_told[i])
+				credit_post (i);
+
+	for (i = 0; i < nr_queues; i++) {
+		q = &queues[i];
+		port_sent[q->port] += q->send_done - q->stat_last_sent;
+		port_queues[q->port]++;
+		sent += q->send_done - q->stat_last_sent;
+		q->stat_last_sent = q->send_done;
+		posts += q->stat_post_calls;
+		send_errors += q->stat_send_errors;
+		inlined += q->stat_inline;
+		stalls += q->stat_cr_stalls;
+		stall_ns += q->stat_cr_stall_ns;
+		lat_ns += q->stat_cr_lat_ns;
+		lat_n += q->stat_cr_lat_n;
+		lat_max = max (lat_max, q->stat_cr_lat_max);
+
+		events += q->recv_poll.events;
+		runs += q->recv_poll.runs;
+		wcs += q->recv_poll.wcs;
+		budget_hits += q->recv_poll.budget_hits;
+		missed += q->recv_poll.missed;
+
+		/* a shared ring is counted once */
+		r = q->ring;
+		if (r == shared_ring && i)
+			continue;
+		recvd += r->recv;
+		recv_errors += r->errors;
+		refills += r->refills;
+		dry += r->dry;
+		posted += r->posted;
+		low = min (low, r->low);
+	}
+
+	printk (KERN_INFO "verbs_timer: %u queues, UD SEND %lu msgs/s, %lu MB/s to LID = %u%s, %lu posts, %lu inline, %lu errors\n",
+		nr_queues, sent, (sent * buf_size) >> 20, remote_lid, fanout ? " and others" : "", posts, inlined, send_errors);
+	printk (KERN_INFO "verbs_timer: %u peers, path cache %lu queries, %lu misses\n",
+		nr_peers, stat_path_queries, stat_path_misses);
+	for (i = 0; i < nr_ports && nr_ports > 1; i++)
+		printk (KERN_INFO "verbs_timer: port %u %s, %u queues, UD SEND %lu msgs/s\n",
+			ports[i].num, ports[i].active ? "active" : "down", port_queues[i], port_sent[i]);
+
+	if (rc_queue.send_task) {
+		q = &rc_queue;
+		sent = q->send_done - q->stat_last_sent;
+		q->stat_last_sent = q->send_done;
+		printk (KERN_INFO "verbs_timer: RC %s %lu ops/s, %lu MB/s, %lu errors\n",
+			rc_bench == 2 ? "READ" : "WRITE", sent, (sent * rc_msg) >> 20, q->stat_send_errors);
+	}
+	printk (KERN_INFO "verbs_timer: receive rings %u posted, low %u, %lu refills, ran dry %lu times; pools ran out %lu send, %lu recv\n",
+		posted, low, refills, dry, send_pool->empty, recv_pool->empty);
+	printk (KERN_INFO "verbs_timer: received %lu msgs/s, %lu errors; recv CQs %lu events, %lu runs, %lu wcs, %lu over budget, %lu missed\n",
+		recvd - stat_last_recv, recv_errors, events, runs, wcs, budget_hits, missed);
+
+	stat_last_recv = recvd;
+
+	if (credit_active) {
+		for (i = 0; i < remote_qps; i++)
+			drops += credit_drops[i];
+		printk (KERN_INFO "verbs_timer: flow control %lu stalls, %llu ms stalled, credit return avg %llu us, max %llu us, "
+			"%lu acks sent, %lu msgs lost\n", stalls, div64_u64 (stall_ns, NSEC_PER_MSEC),
+			lat_n ? div64_u64 (lat_ns, (u64)lat_n * NSEC_PER_USEC) : 0ULL, div64_u64 (lat_max, NSEC_PER_USEC),
+			stat_credit_updates, drops);
+	}
+
+	if (rpc_queues) {
+		for (i = 0; i < nr_rpc; i++) {
+			rpc_calls += rpc_queues[i].stat_calls;
+			rpc_served += rpc_queues[i].stat_served;
+			rpc_timeouts += rpc_queues[i].stat_timeouts;
+			rpc_dropped += rpc_queues[i].stat_dropped;
+		}
+		printk (KERN_INFO "verbs_timer: RPC %lu calls, %lu served, %lu timed out, %lu dropped\n",
+			rpc_calls, rpc_served, rpc_timeouts, rpc_dropped);
+	}
+
+	if (mcast_ah && mc_queue.ring != shared_ring) {
+		r = mc_queue.ring;
+		printk (KERN_INFO "verbs_timer: multicast group 0x%x, received %lu msgs/s\n",
+			mcast_mlid, r->recv - stat_last_mcast);
+		stat_last_mcast = r->recv;
+	}
+
+	mod_timer (&verbs_timer, NEXTJIFF(SEND_INTERVAL));
+}
+
+
+static void cq_poll_init (struct cq_poll *p, struct verbs_queue *q, void (*handler) (struct verbs_queue *, struct ib_wc *))
+{
+	memset (p, 0, sizeof (*p));
+	p->q = q;
+	p->handler = handler;
+	tasklet_init (&p->tasklet, cq_poll_tasklet, (unsigned long)p);
+}
+
+
+static void cq_poll_tasklet (unsigned long data)
+{
+	struct cq_poll *p = (struct cq_poll *)data;
+	int budget = poll_budget, batch, n, i;
+
+	batch = clamp (poll_batch, 1U, (unsigned int)POLL_BATCH_MAX);
+	p->runs++;
+
+	while (budget > 0) {
+		n = ib_poll_cq (p->cq, min (budget, batch), p->wc);
+		if (n <= 0)
+			break;
+
+		for (i = 0; i < n; i++)
+			p->handler (p->q, &p->wc[i]);
+
+		p->wcs += n;
+		budget -= n;
+	}
+
+	if (cq_stopping)
+		return;
+
+	/* more work waiting, let others run first */
+	if (budget <= 0) {
+		p->budget_hits++;
+		tasklet_schedule (&p->tasklet);
+		return;
+	}
+
+	if (ib_req_notify_cq (p->cq, IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS) > 0) {
+		p->missed++;
+		tasklet_schedule (&p->tasklet);
+	}
+}
+
+
+/* retires every send up to the signaled one that completed */
+static void send_handler (struct verbs_queue *q, struct ib_wc *wc)
+{
+	unsigned long seq = wc->wr_id;
+
+	if (wc->status != IB_WC_SUCCESS && !q->stat_send_errors++)
+		printk (KERN_INFO "send %lu failed on queue %u, status %d\n", seq, q->idx, (int)wc->status);
+
+	if ((long)(seq + 1 - q->send_done) > 0) {
+		if (!q->rc)
+			for (; q->send_done != seq + 1; q->send_done++)
+				buf_put (send_pool, q->send_bufs[q->send_done % CQ_SIZE]);
+		else
+			q->send_done = seq + 1;
+		wake_up (&q->send_wait);
+	}
+}
+
+
+static void recv_handler (struct verbs_queue *q, struct ib_wc *wc)
+{
+	struct recv_ring *r = q->ring;
+
+	spin_lock (&r->lock);
+
+	buf_put (recv_pool, wc->wr_id);
+	r->posted--;
+
+	if (wc->status != IB_WC_SUCCESS) {
+		if (!r->errors++)
+			printk (KERN_INFO "recv %llu failed on queue %u, status %d\n", wc->wr_id, q->idx, (int)wc->status);
+	}
+	else
+		r->recv++;
+
+	if (r->posted < r->low)
+		r->low = r->posted;
+	/* nothing posted: datagrams arriving now are dropped */
+	if (!r->posted)
+		r->dry++;
+
+	if (recv_depth - r->posted >= refill_batch)
+		recv_refill (r);
+
+	spin_unlock (&r->lock);
+}
+
+
+/* posts one chain of up to send_chain sends into the free window */
+static int send_post (struct verbs_queue *q, unsigned int room)
+{
+	struct ib_send_wr *wr, *bad_wr;
+	unsigned int i, n = min (room, send_chain);
+	struct ib_side_info *remote;
+	struct ib_sge *sges;
+	struct verbs_peer *peer;
+	struct ib_ah *ah = NULL, *dah;
+	unsigned long seq;
+	unsigned int peers = 0;
+	size_t off;
+	u32 id;
+	int ret;
+
+	/* out of credits: the peer's queue has no room for more */
+	if (q->fc) {
+		n = min (n, credit_avail (q));
+		if (!n)
+			return -EBUSY;
+
+		/* time this chain's first send to its ack */
+		if (!test_bit (0, &q->cr_sampling)) {
+			q->cr_sample_seq = q->send_posted;
+			q->cr_sample_time = ktime_get ();
+			smp_wmb ();
+			set_bit (0, &q->cr_sampling);
+		}
+	}
+
+	/* the handles and the peers stay valid until the chain is posted */
+	rcu_read_lock ();
+	remote = remote_get ();
+
+	if (!q->rc) {
+		ah = peer_ah (q, remote, q->idx);
+		if (!ah) {
+			rcu_read_unlock ();
+			return -EAGAIN;
+		}
+		if (fanout && !q->fc) {
+			peers = ACCESS_ONCE (nr_peers);
+			smp_rmb ();
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		wr = &q->send_wrs[i];
+		seq = q->send_posted + i;
+
+		/* out of buffers: post what we have, the completions return some */
+		if (!q->rc && buf_get (send_pool, &id)) {
+			if (!i) {
+				rcu_read_unlock ();
+				return -EAGAIN;
+			}
+			n = i;
+			q->send_wrs[i-1].next = NULL;
+			q->send_wrs[i-1].send_flags |= IB_SEND_SIGNALED;
+			break;
+		}
+
+		sges = &q->send_sges[i * SEND_SGE];
+
+		memset (wr, 0, sizeof (*wr));
+		wr->wr_id = seq;
+		wr->next = i + 1 < n ? &q->send_wrs[i+1] : NULL;
+		wr->sg_list = sges;
+		wr->num_sge = 1;
+
+		if (q->rc) {
+			/* slots in turn, the same slot on both sides */
+			off = (seq % RC_SLOTS) * rc_msg;
+			sges[0].addr = rc_dma + off;
+			sges[0].length = rc_msg;
+			sges[0].lkey = rc_mr->lkey;
+			wr->opcode = rc_bench == 2 ? IB_WR_RDMA_READ : IB_WR_RDMA_WRITE;
+			wr->wr.rdma.remote_addr = remote->rc_addr + off;
+			wr->wr.rdma.rkey = remote->rc_rkey;
+		}
+		else {
+			q->send_bufs[seq % CQ_SIZE] = id;
+			send_fill_ud (q, wr, sges, seq, id, buf_size, buf_size <= q->max_inline, MSG_DATA, 0);
+			wr->opcode = IB_WR_SEND;
+			wr->wr.ud.ah = ah;
+			wr->wr.ud.port_num = ports[q->port].num;
+			wr->wr.ud.remote_qkey = remote->qkey;
+			wr->wr.ud.remote_qpn = remote->qpns[q->idx % remote->nr_qps];
+
+			/* a peer without a path yet gets its turn later */
+			if (peers > 1) {
+				peer = rcu_dereference (peer_array[seq % peers]);
+				dah = peer_ah (q, &peer->info, q->idx);
+				if (dah) {
+					wr->wr.ud.ah = dah;
+					wr->wr.ud.remote_qkey = peer->info.qkey;
+					wr->wr.ud.remote_qpn = peer->info.qpns[q->idx % peer->info.nr_qps];
+				}
+			}
+		}
+
+		/* the last send before the window closes must be signaled, or
+		 * nothing would retire the unsignaled ones in front of it */
+		if ((seq + 1) % signal_every == 0 || seq + 1 - q->send_done >= send_depth)
+			wr->send_flags |= IB_SEND_SIGNALED;
+	}
+
+	ret = ib_post_send (q->qp, q->send_wrs, &bad_wr);
+	rcu_read_unlock ();
+	q->stat_post_calls++;
+
+	/* the WRs in front of the bad one went in */
+	if (ret) {
+		n = bad_wr - q->send_wrs;
+		printk (KERN_INFO "post_send failed: %d, %u of the chain posted\n", ret, n);
+		if (!q->rc)
+			for (wr = bad_wr; wr; wr = wr->next)
+				buf_put (send_pool, q->send_bufs[wr->wr_id % CQ_SIZE]);
+	}
+
+	q->send_posted += n;
+	return ret;
+}
+
+
+/* keeps send_depth sends in flight on its queue until the device goes away */
+static int send_thread (void *data)
+{
+	struct verbs_queue *q = data;
+	int ret;
+
+	q->send_wrs = kcalloc (send_chain, sizeof (*q->send_wrs), GFP_KERNEL);
+	q->send_sges = kcalloc (send_chain * SEND_SGE, sizeof (*q->send_sges), GFP_KERNEL);
+	if (!q->send_wrs || !q->send_sges)
+		goto out;
+
+	/* the address handle comes with the path record, RC needs the
+	 * connection made along it */
+	wait_event_interruptible (q->send_wait, (have_path && (!q->rc || rc_connected)) ||
+				  kthread_should_stop ());
+
+	if (lat_bench && !q->rc && !q->idx)
+		lat_sweep (q);
+
+	while (!kthread_should_stop ()) {
+		/* off a port that went down, and back home once it is up */
+		if (!q->rc && (!ACCESS_ONCE (ports[q->port].active) ||
+			       (q->port != q->home && ACCESS_ONCE (ports[q->home].active)))) {
+			ret = queue_move (q);
+			if (ret == -ENODEV)
+				schedule_timeout_interruptible (HZ / 10);
+			else if (ret)
+				break;
+			continue;
+		}
+
+		if (q->send_posted - ACCESS_ONCE (q->send_done) < send_depth) {
+			ret = send_post (q, send_depth - (q->send_posted - q->send_done));
+			if (ret == -EAGAIN)
+				schedule_timeout_interruptible (1);
+			else if (ret == -EBUSY) {
+				/* the acks wake us */
+				ktime_t t0 = ktime_get ();
+
+				q->stat_cr_stalls++;
+				wait_event_interruptible_timeout (q->send_wait, credit_avail (q) ||
+								  !ACCESS_ONCE (ports[q->port].active) ||
+								  kthread_should_stop (), HZ);
+				q->stat_cr_stall_ns += ktime_to_ns (ktime_sub (ktime_get (), t0));
+			}
+			else if (ret)
+				break;
+			continue;
+		}
+
+		/* window is full, the send CQ tasklet opens it */
+		wait_event_interruptible_timeout (q->send_wait,
+						  q->send_posted - ACCESS_ONCE (q->send_done) < send_depth ||
+						  !ACCESS_ONCE (ports[q->port].active) ||
+						  kthread_should_stop (), HZ);
+	}
+
+out:
+	kfree (q->send_wrs);
+	kfree (q->send_sges);
+	q->send_wrs = NULL;
+	q->send_sges = NULL;
+
+	while (!kthread_should_stop ())
+		schedule_timeout_interruptible (HZ);
+	return 0;
+}
+
+
+/* Header from the queue's header slot, body from a pool buffer, gathered by
+ * the HCA. Messages up to the inline limit are copied into the WR at post
+ * time and the HCA reads nothing by DMA; with a single SGE the header is
+ * copied in front of the body instead. Called under rcu_read_lock. */
+static void send_fill_ud (struct verbs_queue *q, struct ib_send_wr *wr, struct ib_sge *sge,
+			  unsigned long seq, u32 id, unsigned int len, int inl, u32 op, u64 tag)
+{
+	unsigned int slot = seq % CQ_SIZE;
+	struct verbs_msg_hdr *hdr = buf_addr (q->hdr_pool, slot);
+	unsigned int hlen = min (len, (unsigned int)sizeof (*hdr));
+	char *body = buf_addr (send_pool, id);
+
+	hdr->seq = cpu_to_be64 (seq);
+	hdr->tag = cpu_to_be64 (tag);
+	hdr->queue = htonl (q->idx);
+	hdr->len = htonl (len);
+	hdr->op = htonl (op);
+	hdr->ack = 0;
+
+	/* the ack for the peer's queue we send to, if the header gets there whole */
+	if (q->fc && len >= sizeof (*hdr)) {
+		unsigned int j = q->idx % remote_get ()->nr_qps;
+
+		credit_rx_told[j] = credit_rx_next[j];
+		hdr->ack = cpu_to_be64 (credit_rx_told[j]);
+	}
+
+	if (q->max_sge < SEND_SGE) {
+		memcpy (body, hdr, hlen);
+		sge[0].addr = inl ? (uintptr_t)body : buf_dma (send_pool, id);
+		sge[0].length = len;
+		sge[0].lkey = mr->lkey;
+		wr->num_sge = 1;
+		if (!inl)
+			buf_sync (send_pool, id, hlen);
+	}
+	else {
+		sge[0].addr = inl ? (uintptr_t)hdr : buf_dma (q->hdr_pool, slot);
+		sge[0].length = hlen;
+		sge[0].lkey = mr->lkey;
+		sge[1].addr = inl ? (uintptr_t)body : buf_dma (send_pool, id);
+		sge[1].length = len - hlen;
+		sge[1].lkey = mr->lkey;
+		wr->num_sge = len > hlen ? 2 : 1;
+		if (!inl)
+			buf_sync (q->hdr_pool, slot, hlen);
+	}
+
+	if (inl) {
+		wr->send_flags |= IB_SEND_INLINE;
+		q->stat_inline++;
+	}
+}
+
+
+/* one signaled send of len bytes, spinning for its completion; returns the
+ * time it took in ns, or an error */
+static s64 lat_one (struct verbs_queue *q, unsigned int len, int inl)
+{
+	struct ib_send_wr *wr = q->send_wrs, *bad_wr;
+	unsigned long seq = q->send_posted;
+	struct ib_side_info *remote;
+	struct ib_ah *ah;
+	ktime_t t0, end;
+	u32 id;
+	int ret;
+
+	if (buf_get (send_pool, &id))
+		return -ENOBUFS;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	ah = peer_ah (q, remote, q->idx);
+	if (!ah) {
+		rcu_read_unlock ();
+		buf_put (send_pool, id);
+		return -EAGAIN;
+	}
+
+	memset (wr, 0, sizeof (*wr));
+	wr->wr_id = seq;
+	wr->sg_list = q->send_sges;
+	wr->opcode = IB_WR_SEND;
+	wr->send_flags = IB_SEND_SIGNALED;
+	wr->wr.ud.ah = ah;
+	wr->wr.ud.port_num = ports[q->port].num;
+	wr->wr.ud.remote_qkey = remote->qkey;
+	wr->wr.ud.remote_qpn = remote->qpns[q->idx % remote->nr_qps];
+	q->send_bufs[seq % CQ_SIZE] = id;
+
+	t0 = ktime_get ();
+	send_fill_ud (q, wr, q->send_sges, seq, id, len, inl, MSG_DATA, 0);
+
+	ret = ib_post_send (q->qp, wr, &bad_wr);
+	rcu_read_unlock ();
+	if (ret) {
+		buf_put (send_pool, id);
+		return ret;
+	}
+	q->send_posted++;
+
+	/* the CQ tasklet runs on the way out of the interrupt, even here */
+	end = ktime_add_ns (t0, NSEC_PER_SEC);
+	while (ACCESS_ONCE (q->send_done) != q->send_posted) {
+		if (ktime_to_ns (ktime_sub (ktime_get (), end)) >= 0)
+			return -ETIMEDOUT;
+		if (need_resched ())
+			schedule ();
+		cpu_relax ();
+	}
+
+	return ktime_to_ns (ktime_sub (ktime_get (), t0));
+}
+
+
+/* Post-to-completion latency of single sends to the peer, from 8 bytes up
+ * to 4K or the MTU, with the payload inline and read by DMA */
+static void lat_sweep (struct verbs_queue *q)
+{
+	unsigned int len, mtu = port_mtu ();
+	u64 sum, lat_min, lat_max;
+	unsigned int i;
+	s64 lat;
+	int inl;
+
+	printk (KERN_INFO "latency bench: %u sends per size, inline up to %u bytes, %u SGEs\n",
+		lat_rounds, q->max_inline, q->max_sge);
+
+	/* with flow control the receiver tells seqs, and so losses, by the header */
+	len = credits ? roundup_pow_of_two (sizeof (struct verbs_msg_hdr)) : LAT_MIN;
+
+	for (; len <= min ((unsigned int)LAT_MAX, mtu) && len <= send_pool->len; len <<= 1)
+		for (inl = 1; inl >= 0; inl--) {
+			if (inl && len > q->max_inline) {
+				printk (KERN_INFO "latency bench: %5u bytes, inline: over the limit\n", len);
+				continue;
+			}
+
+			sum = lat_max = 0;
+			lat_min = ~0ULL;
+
+			for (i = 0; i < lat_rounds && !kthread_should_stop (); i++) {
+				lat = lat_one (q, len, inl);
+				if (lat < 0) {
+					printk (KERN_INFO "latency bench: send of %u bytes failed: %lld\n", len, lat);
+					return;
+				}
+
+				sum += lat;
+				lat_min = min (lat_min, (u64)lat);
+				lat_max = max (lat_max, (u64)lat);
+			}
+
+			if (!i)
+				return;
+
+			printk (KERN_INFO "latency bench: %5u bytes, %s: avg %llu ns, min %llu, max %llu\n",
+				len, inl ? "inline" : "DMA", div64_u64 (sum, i), lat_min, lat_max);
+		}
+}
+
+
+static void send_wake_all (void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_queues; i++)
+		wake_up (&queues[i].send_wait);
+}
+
+
+static u32 path_hash_fn (unsigned int port, u16 dlid, union ib_gid *gid)
+{
+	return jhash (gid->raw, sizeof (gid->raw), dlid | port << 16) & (PATH_HASH_SIZE - 1);
+}
+
+
+/* caller holds rcu_read_lock or path_lock */
+static struct path_entry *path_find (unsigned int port, u16 dlid, union ib_gid *gid)
+{
+	struct path_entry *e;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry_rcu (e, pos, &path_hash[path_hash_fn (port, dlid, gid)], node)
+		if (e->port == port && e->dlid == dlid && !memcmp (e->dgid.raw, gid->raw, sizeof (gid->raw)))
+			return e;
+
+	return NULL;
+}
+
+
+/* Address handle of the destination from one of our ports, NULL while it is
+ * being resolved. Call under rcu_read_lock, the handle stays valid until the
+ * unlock. */
+static struct ib_ah *path_ah (unsigned int port, u16 dlid, union ib_gid *gid)
+{
+	struct path_entry *e = path_find (port, dlid, gid);
+	struct ib_ah *ah = e ? rcu_dereference (e->ah) : NULL;
+
+	if (ah)
+		return ah;
+
+	stat_path_misses++;
+	if (!e || (!e->pending && time_after (jiffies, e->failed + PATH_RETRY)))
+		path_resolve (port, dlid, gid);
+	return NULL;
+}
+
+
+/* starts an SA query for the destination unless it is resolved or on its way */
+static void path_resolve (unsigned int port, u16 dlid, union ib_gid *gid)
+{
+	struct path_entry *e, *new;
+	unsigned long flags;
+
+	new = kzalloc (sizeof (*new), GFP_ATOMIC);
+	if (!new)
+		return;
+
+	new->port = port;
+	new->dlid = dlid;
+	new->dgid = *gid;
+
+	spin_lock_irqsave (&path_lock, flags);
+	e = path_find (port, dlid, gid);
+	if (!e) {
+		e = new;
+		new = NULL;
+		hlist_add_head_rcu (&e->node, &path_hash[path_hash_fn (port, dlid, gid)]);
+	}
+	else if (e->ah || e->pending || time_before (jiffies, e->failed + PATH_RETRY))
+		e = NULL;
+
+	if (e) {
+		e->pending = 1;
+		atomic_inc (&path_pending);
+	}
+	spin_unlock_irqrestore (&path_lock, flags);
+
+	kfree (new);
+	if (e)
+		path_query (e);
+}
+
+
+static void path_query (struct path_entry *e)
+{
+	struct verbs_port *p = &ports[e->port];
+	struct ib_sa_path_rec rec;
+	union ib_gid gid;
+	u16 lid, pk;
+	int qid;
+
+	port_addr (e->port, &lid, &gid, &pk);
+
+	memset (&rec, 0, sizeof (rec));
+	rec.dlid = cpu_to_be16 (e->dlid);
+	rec.slid = cpu_to_be16 (lid);
+	rec.pkey = cpu_to_be16 (pk);
+	rec.numb_path = 1;
+
+	/* no subnet manager (RoCE, rxe): the GID is the whole address */
+	if (!lid) {
+		INIT_WORK (&e->fill, path_fill_work);
+		schedule_work (&e->fill);
+		return;
+	}
+
+	stat_path_queries++;
+	qid = ib_sa_path_rec_get (&verbs_sa_client, ib_dev, p->num, &rec, IB_SA_PATH_REC_DLID | IB_SA_PATH_REC_SLID | IB_SA_PATH_REC_PKEY | IB_SA_PATH_REC_NUMB_PATH,
+				  10000, GFP_ATOMIC, verbs_path_rec_completion, e, &e->query);
+
+	if (qid < 0) {
+		printk (KERN_INFO "path_rec_get failed: %d\n", qid);
+		verbs_path_rec_completion (qid, NULL, e);
+		return;
+	}
+	e->query_id = qid;
+}
+
+
+/* what the SA would have said, had there been one */
+static void path_fill_work (struct work_struct *work)
+{
+	struct path_entry *e = container_of (work, struct path_entry, fill);
+	struct ib_sa_path_rec rec;
+	unsigned int seq;
+
+	memset (&rec, 0, sizeof (rec));
+	do {
+		seq = read_seqbegin (&port_lock);
+		rec.sgid = ports[e->port].gid;
+		rec.slid = cpu_to_be16 (ports[e->port].attr.lid);
+		rec.pkey = cpu_to_be16 (ports[e->port].pkey);
+		rec.mtu = ports[e->port].attr.active_mtu;
+	} while (read_seqretry (&port_lock, seq));
+	rec.dgid = e->dgid;
+	rec.dlid = cpu_to_be16 (e->dlid);
+	rec.hop_limit = PATH_HOP_LIMIT;
+
+	verbs_path_rec_completion (0, &rec, e);
+}
+
+
+/* address vector along a path, routed by GID alone where there are no LIDs */
+static int path_ah_attr (unsigned int port, struct ib_sa_path_rec *rec, struct ib_ah_attr *av)
+{
+	if (ports[port].attr.lid)
+		return ib_init_ah_from_path (ib_dev, ports[port].num, rec, av);
+
+	memset (av, 0, sizeof (*av));
+	av->ah_flags = IB_AH_GRH;
+	av->grh.dgid = rec->dgid;
+	av->grh.sgid_index = 0;
+	av->grh.hop_limit = PATH_HOP_LIMIT;
+	av->port_num = ports[port].num;
+	return 0;
+}
+
+
+static void verbs_path_rec_completion (int status, struct ib_sa_path_rec *resp, void *context)
+{
+	struct path_entry *e = context;
+	struct ib_side_info *remote;
+	struct ib_ah *new_ah = NULL;
+	struct ib_ah_attr av;
+	unsigned long flags;
+	int dead, primary = 0;
+
+	if (status)
+		printk (KERN_INFO "path_rec lookup for LID %u failed: %d\n", e->dlid, status);
+	else if (!e->dead && !path_ah_attr (e->port, resp, &av)) {
+		printk (KERN_INFO "ah: flags = %d, dlid = %d, port = %d\n", (int)av.ah_flags, (int)av.dlid, (int)av.port_num);
+		new_ah = ib_create_ah (pd, &av);
+		if (IS_ERR (new_ah)) {
+			printk (KERN_INFO "ib_create_ah failed: %ld\n", PTR_ERR (new_ah));
+			new_ah = NULL;
+		}
+	}
+
+	spin_lock_irqsave (&path_lock, flags);
+	e->pending = 0;
+	dead = e->dead;
+	if (!dead && new_ah) {
+		e->rec = *resp;
+		e->failed = 0;
+		rcu_assign_pointer (e->ah, new_ah);
+		new_ah = NULL;
+		rcu_read_lock ();
+		remote = remote_get ();
+		primary = remote && e->port == first_port && e->dlid == remote->lid &&
+			!memcmp (e->dgid.raw, remote->gid.raw, sizeof (e->dgid.raw));
+		rcu_read_unlock ();
+	}
+	else if (!dead)
+		e->failed = jiffies;
+	spin_unlock_irqrestore (&path_lock, flags);
+
+	/* flushed meanwhile: nobody else knows the entry any more */
+	if (dead) {
+		if (new_ah)
+			ib_destroy_ah (new_ah);
+		kfree (e);
+	}
+
+	/* the benchmark peer: the send threads and the RC connection wait for it */
+	if (primary && !have_path) {
+		path = *resp;
+		have_path = 1;
+		send_wake_all ();
+		if (rc_queue.qp)
+			schedule_work (&rc_connect);
+	}
+
+	if (atomic_dec_and_test (&path_pending))
+		wake_up (&path_wait);
+}
+
+
+/* Empties the cache. Queries still out are cancelled and their entries freed
+ * by the completion; handles are destroyed once no sender can see them. */
+static void path_flush_all (void)
+{
+	struct path_entry *e, *tmp;
+	struct hlist_node *pos, *n;
+	unsigned long flags;
+	LIST_HEAD (gone);
+	unsigned int i;
+
+	spin_lock_irqsave (&path_lock, flags);
+	for (i = 0; i < PATH_HASH_SIZE; i++)
+		hlist_for_each_entry_safe (e, pos, n, &path_hash[i], node) {
+			hlist_del_rcu (&e->node);
+			if (e->pending) {
+				e->dead = 1;
+				if (e->query)
+					ib_sa_cancel_query (e->query_id, e->query);
+			}
+			else
+				list_add (&e->gc, &gone);
+		}
+	spin_unlock_irqrestore (&path_lock, flags);
+
+	synchronize_rcu ();
+
+	list_for_each_entry_safe (e, tmp, &gone, gc) {
+		if (e->ah)
+			ib_destroy_ah (e->ah);
+		kfree (e);
+	}
+}
+
+
+/* LIDs or paths may have moved: forget them all and resolve every peer again.
+ * Ports that came up get their queues back. */
+static void path_flush_work (struct work_struct *dummy)
+{
+	unsigned int i, n;
+
+	ports_query ();
+
+	path_flush_all ();
+	printk (KERN_INFO "Path cache flushed, local LID %u\n", (unsigned)port_attr.lid);
+
+	n = ACCESS_ONCE (nr_peers);
+	smp_rmb ();
+	rcu_read_lock ();
+	for (i = 0; i < n; i++)
+		peer_resolve (&rcu_dereference (peer_array[i])->info);
+	rcu_read_unlock ();
+
+	send_wake_all ();
+}
+
+
+/* Reads every port's state and addresses into ports[] and local_info; the
+ * first port that is active becomes the one the single queues live on, for
+ * good (see struct verbs_port). A UD message must fit whichever port its
+ * queue moves to, so port_attr gets the smallest MTU of the active ports.
+ * The new state is built aside and goes in at once under port_lock. */
+static int ports_query (void)
+{
+	struct verbs_port new[MAX_PORTS], *p;
+	struct ib_port_attr attr;
+	unsigned long flags;
+	enum ib_mtu mtu;
+	unsigned int i;
+	int first = first_port, ret;
+
+	for (i = 0; i < nr_ports; i++) {
+		p = &new[i];
+		p->num = i + 1;
+
+		ret = ib_query_port (ib_dev, p->num, &p->attr);
+		if (!ret)
+			ret = ib_query_gid (ib_dev, p->num, 0, &p->gid);
+		if (!ret)
+			ret = ib_query_pkey (ib_dev, p->num, 0, &p->pkey);
+		if (ret)
+			return ret;
+
+		p->active = p->attr.state == IB_PORT_ACTIVE;
+		if (first < 0 && p->active)
+			first = i;
+	}
+
+	if (first < 0)
+		first = 0;
+
+	attr = new[first].attr;
+	mtu = attr.active_mtu;
+	for (i = 0; i < nr_ports; i++)
+		if (new[i].active)
+			mtu = min (mtu, new[i].attr.active_mtu);
+	attr.active_mtu = mtu;
+
+	write_seqlock_irqsave (&port_lock, flags);
+	memcpy (ports, new, nr_ports * sizeof (*new));
+	first_port = first;
+	port_attr = attr;
+	pkey = new[first].pkey;
+	for (i = 0; i < nr_ports; i++) {
+		local_info.lids[i] = new[i].attr.lid;
+		local_info.gids[i] = new[i].gid;
+	}
+	/* a port that is down has no LID: the peers keep the one they know */
+	if (new[first].active || !local_info.nr_ports) {
+		local_info.lid = attr.lid;
+		local_info.gid = new[first].gid;
+	}
+	local_info.nr_ports = nr_ports;
+	write_sequnlock_irqrestore (&port_lock, flags);
+
+	return 0;
+}
+
+
+/* the largest UD message every active port takes */
+static unsigned int port_mtu (void)
+{
+	enum ib_mtu mtu;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin (&port_lock);
+		mtu = port_attr.active_mtu;
+	} while (read_seqretry (&port_lock, seq));
+
+	return ib_mtu_enum_to_int (mtu);
+}
+
+
+/* a port's LID, GID and P_Key as the last query left them */
+static void port_addr (unsigned int i, u16 *lid, union ib_gid *gid, u16 *pk)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin (&port_lock);
+		*lid = ports[i].attr.lid;
+		*gid = ports[i].gid;
+		*pk = ports[i].pkey;
+	} while (read_seqretry (&port_lock, seq));
+}
+
+
+/* local_info as a whole, for the exchange */
+static void local_info_get (struct ib_side_info *info)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin (&port_lock);
+		*info = local_info;
+	} while (read_seqretry (&port_lock, seq));
+}
+
+
+/* Moves a UD queue to its home port, or to another active one while that is
+ * down. The QP goes through the error state, which flushes everything posted
+ * on it back to us, and comes up again on the new port with the same QPN;
+ * a new exchange tells the peers where it went. Called by the queue's send
+ * thread only. Returns -ENODEV when no port is up. */
+static int queue_move (struct verbs_queue *q)
+{
+	struct recv_ring *r = q->ring;
+	struct ib_qp_attr qp_attr;
+	unsigned int i, to;
+	int ret;
+
+	to = q->home;
+	for (i = 1; i <= nr_ports && !ports[to].active; i++)
+		to = (q->port + i) % nr_ports;
+	if (!ports[to].active)
+		return -ENODEV;
+	if (to == q->port)
+		return 0;
+
+	/* no refills into a QP on its way down */
+	if (r != shared_ring) {
+		spin_lock_bh (&r->lock);
+		r->qp = NULL;
+		spin_unlock_bh (&r->lock);
+	}
+
+	memset (&qp_attr, 0, sizeof (qp_attr));
+	qp_attr.qp_state = IB_QPS_ERR;
+	ret = ib_modify_qp (q->qp, &qp_attr, IB_QP_STATE);
+	if (ret) {
+		printk (KERN_INFO "queue %u: failed to modify QP to error, ret = %d\n", q->idx, ret);
+		return ret;
+	}
+
+	/* the flushed WRs return their buffers through the CQ tasklets */
+	wait_event_timeout (q->send_wait, ACCESS_ONCE (q->send_done) == q->send_posted, HZ);
+	for (i = 0; r != shared_ring && ACCESS_ONCE (r->posted) && i < 1000; i++)
+		msleep (1);
+
+	if (q->send_done != q->send_posted || (r != shared_ring && r->posted)) {
+		printk (KERN_INFO "queue %u: WRs not flushed, stopped on port %u\n", q->idx, ports[q->port].num);
+		return -EIO;
+	}
+
+	qp_attr.qp_state = IB_QPS_RESET;
+	ret = ib_modify_qp (q->qp, &qp_attr, IB_QP_STATE);
+	if (!ret && init_qp (q->qp, ports[to].num))
+		ret = -EIO;
+	if (ret) {
+		printk (KERN_INFO "queue %u: move to port %u failed: %d\n", q->idx, ports[to].num, ret);
+		return ret;
+	}
+
+	printk (KERN_INFO "Queue %u moved from port %u to port %u\n", q->idx, ports[q->port].num, ports[to].num);
+	q->port = to;
+	write_seqlock_irq (&port_lock);
+	local_info.qp_ports[q->idx] = to;
+	write_sequnlock_irq (&port_lock);
+
+	if (r != shared_ring) {
+		spin_lock_bh (&r->lock);
+		r->qp = q->qp;
+		recv_refill (r);
+		spin_unlock_bh (&r->lock);
+	}
+
+	schedule_work (&rdv_announce);
+	return 0;
+}
+
+
+static void verbs_port_event (struct ib_event_handler *handler, struct ib_event *event)
+{
+	unsigned int i = event->element.port_num - 1;
+
+	if (i >= nr_ports)
+		return;
+
+	switch (event->event) {
+	case IB_EVENT_PORT_ERR:
+		/* the send threads move their queues off it */
+		printk (KERN_INFO "Port %u down\n", ports[i].num);
+		ports[i].active = 0;
+		send_wake_all ();
+		break;
+	case IB_EVENT_PORT_ACTIVE:
+	case IB_EVENT_LID_CHANGE:
+	case IB_EVENT_PKEY_CHANGE:
+	case IB_EVENT_SM_CHANGE:
+	case IB_EVENT_CLIENT_REREGISTER:
+		printk (KERN_INFO "Port event %d, flushing paths\n", event->event);
+		schedule_work (&path_flush);
+		break;
+	default:
+		break;
+	}
+}
+
+
+/* Full member of the benchmark group, the group is created by the first
+ * joiner. The SA calls back again after a port event re-registers us. */
+static int mcast_join (void)
+{
+	struct ib_sa_mcmember_rec rec;
+	union ib_gid gid;
+	u16 lid, pk;
+
+	port_addr (mc_queue.port, &lid, &gid, &pk);
+
+	memset (&rec, 0, sizeof (rec));
+	rec.mgid = mcast_mgid;
+	rec.mgid.raw[4] = pk >> 8;
+	rec.mgid.raw[5] = pk & 0xff;
+	rec.port_gid = gid;
+	rec.qkey = cpu_to_be32 (local_info.qkey);
+	rec.pkey = cpu_to_be16 (pk);
+	rec.join_state = 1;
+
+	mcast_group = ib_sa_join_multicast (&verbs_sa_client, ib_dev, ports[mc_queue.port].num, &rec,
+					    IB_SA_MCMEMBER_REC_MGID | IB_SA_MCMEMBER_REC_PORT_GID |
+					    IB_SA_MCMEMBER_REC_QKEY | IB_SA_MCMEMBER_REC_PKEY |
+					    IB_SA_MCMEMBER_REC_SL | IB_SA_MCMEMBER_REC_FLOW_LABEL |
+					    IB_SA_MCMEMBER_REC_TRAFFIC_CLASS | IB_SA_MCMEMBER_REC_JOIN_STATE,
+					    GFP_KERNEL, verbs_mcast_join_done, NULL);
+	if (IS_ERR (mcast_group)) {
+		int ret = PTR_ERR (mcast_group);
+
+		mcast_group = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+
+static int verbs_mcast_join_done (int status, struct ib_sa_multicast *m)
+{
+	struct ib_ah_attr av;
+	struct ib_ah *new_ah;
+	int ret;
+
+	if (status) {
+		printk (KERN_INFO "multicast join failed: %d\n", status);
+		return 0;
+	}
+
+	/* rejoin, the attachment is still there */
+	if (mcast_ah)
+		return 0;
+
+	ret = ib_init_ah_from_mcmember (ib_dev, ports[mc_queue.port].num, &m->rec, &av);
+	if (ret) {
+		printk (KERN_INFO "multicast address vector setup failed: %d\n", ret);
+		return 0;
+	}
+
+	new_ah = ib_create_ah (pd, &av);
+	if (IS_ERR (new_ah)) {
+		printk (KERN_INFO "ib_create_ah for multicast failed: %ld\n", PTR_ERR (new_ah));
+		return 0;
+	}
+
+	mcast_mlid = be16_to_cpu (m->rec.mlid);
+	mcast_qkey = be32_to_cpu (m->rec.qkey);
+	mcast_mgid_joined = m->rec.mgid;
+
+	ret = ib_attach_mcast (mc_queue.qp, &mcast_mgid_joined, mcast_mlid);
+	if (ret) {
+		printk (KERN_INFO "ib_attach_mcast failed: %d\n", ret);
+		ib_destroy_ah (new_ah);
+		return 0;
+	}
+
+	printk (KERN_INFO "Joined multicast group, MLID 0x%x, QP %x attached\n", mcast_mlid, mc_queue.qp->qp_num);
+	mcast_ah = new_ah;
+	wake_up (&mc_queue.send_wait);
+	return 0;
+}
+
+
+/* one message to every subscriber: a single send to the group, or one
+ * send to each known peer. Returns the number of sends posted. */
+static int mcast_publish (struct verbs_queue *q, int multicast)
+{
+	struct ib_send_wr *wr, *bad_wr;
+	struct verbs_peer *peer = NULL;
+	struct ib_ah *dah;
+	unsigned int i, n = 0, dests;
+	unsigned long seq;
+	u32 id;
+	int ret;
+
+	dests = multicast ? 1 : min (ACCESS_ONCE (nr_peers), (unsigned int)MCAST_FANOUT_MAX);
+	smp_rmb ();
+
+	rcu_read_lock ();
+
+	for (i = 0; i < dests; i++) {
+		if (multicast)
+			dah = mcast_ah;
+		else {
+			peer = rcu_dereference (peer_array[i]);
+			dah = path_ah (q->port, peer->info.lid, &peer->info.gid);
+			if (!dah)
+				continue;
+		}
+
+		if (buf_get (send_pool, &id))
+			break;
+
+		wr = &q->send_wrs[n];
+		seq = q->send_posted + n;
+		q->send_bufs[seq % CQ_SIZE] = id;
+
+		memset (wr, 0, sizeof (*wr));
+		wr->wr_id = seq;
+		wr->sg_list = &q->send_sges[n * SEND_SGE];
+		send_fill_ud (q, wr, wr->sg_list, seq, id, buf_size, buf_size <= q->max_inline, MSG_DATA, 0);
+		wr->opcode = IB_WR_SEND;
+		wr->wr.ud.ah = dah;
+		wr->wr.ud.port_num = ports[q->port].num;
+		wr->wr.ud.remote_qkey = multicast ? mcast_qkey : peer->info.qkey;
+		wr->wr.ud.remote_qpn = multicast ? MCAST_QPN : peer->info.qpns[0];
+
+		if (n)
+			q->send_wrs[n-1].next = wr;
+		n++;
+	}
+
+	if (!n) {
+		rcu_read_unlock ();
+		return 0;
+	}
+
+	/* the completion of the last one retires them all */
+	q->send_wrs[n-1].send_flags |= IB_SEND_SIGNALED;
+
+	ret = ib_post_send (q->qp, q->send_wrs, &bad_wr);
+	rcu_read_unlock ();
+
+	if (ret) {
+		printk (KERN_INFO "multicast bench post_send failed: %d\n", ret);
+		for (wr = bad_wr; wr; wr = wr->next)
+			buf_put (send_pool, q->send_bufs[wr->wr_id % CQ_SIZE]);
+		n = bad_wr - q->send_wrs;
+	}
+
+	q->send_posted += n;
+	return ret ? ret : n;
+}
+
+
+/* mcast_count publishes, each timed from the post to the completion of its
+ * last send */
+static void mcast_pass (struct verbs_queue *q, int multicast)
+{
+	u64 lat, lat_min = ~0ULL, lat_max = 0, lat_sum = 0, ns;
+	unsigned long done = 0, sends = 0;
+	ktime_t start, t0;
+	int n;
+
+	start = ktime_get ();
+
+	while (done < mcast_count && !kthread_should_stop ()) {
+		t0 = ktime_get ();
+
+		n = mcast_publish (q, multicast);
+		if (n < 0)
+			break;
+		if (!n) {
+			/* no destination reachable yet, or out of buffers */
+			schedule_timeout_interruptible (1);
+			continue;
+		}
+
+		wait_event_interruptible_timeout (q->send_wait, ACCESS_ONCE (q->send_done) == q->send_posted ||
+						  kthread_should_stop (), HZ);
+		if (q->send_done != q->send_posted)
+			break;
+
+		lat = ktime_to_ns (ktime_sub (ktime_get (), t0));
+		lat_min = min (lat_min, lat);
+		lat_max = max (lat_max, lat);
+		lat_sum += lat;
+		sends += n;
+		done++;
+	}
+
+	ns = ktime_to_ns (ktime_sub (ktime_get (), start));
+	if (!done || !ns)
+		return;
+
+	printk (KERN_INFO "mcast bench: %s, %lu publishes in %llu ms, %lu sends, %llu publishes/s, %llu MB/s sent; latency avg %llu ns, min %llu, max %llu\n",
+		multicast ? "multicast" : "unicast fan-out", done, div64_u64 (ns, NSEC_PER_MSEC), sends,
+		div64_u64 ((u64)done * NSEC_PER_SEC, ns), div64_u64 ((u64)sends * buf_size * NSEC_PER_SEC, ns) >> 20,
+		div64_u64 (lat_sum, done), lat_min, lat_max);
+}
+
+
+/* publishes to all subscribers the multicast way, then the unicast way */
+static int mcast_thread (void *dummy)
+{
+	struct verbs_queue *q = &mc_queue;
+
+	q->send_wrs = kcalloc (MCAST_FANOUT_MAX, sizeof (*q->send_wrs), GFP_KERNEL);
+	q->send_sges = kcalloc (MCAST_FANOUT_MAX * SEND_SGE, sizeof (*q->send_sges), GFP_KERNEL);
+	if (!q->send_wrs || !q->send_sges)
+		goto out;
+
+	wait_event_interruptible (q->send_wait, (mcast_ah && have_path) || kthread_should_stop ());
+
+	/* let the other subscribers join and resolve their paths */
+	schedule_timeout_interruptible (MCAST_SETTLE);
+
+	if (!kthread_should_stop ())
+		mcast_pass (q, 1);
+	if (!kthread_should_stop ())
+		mcast_pass (q, 0);
+
+out:
+	kfree (q->send_wrs);
+	kfree (q->send_sges);
+	q->send_wrs = NULL;
+	q->send_sges = NULL;
+
+	while (!kthread_should_stop ())
+		schedule_timeout_interruptible (HZ);
+	return 0;
+}
+
+
+/* Rendezvous. The listener stays open for the life of the module: the
+ * accept thread hands every connection to rdv_wq, so any number of peers
+ * exchange ib_side_info at once and may join, or rejoin after a reload on
+ * their side, at any time. Outgoing exchanges (server_addr, peer_addrs) go
+ * through the same workqueue. It is unbound, so an exchange that sleeps in
+ * rdv_connect's retries waiting for an absent peer holds only its own
+ * worker and the others go on. Each exchanged peer lands in the peer table;
+ * the first one is the peer the benchmark runs against. */
+static int rdv_start (void)
+{
+	struct rdv_conn *conn;
+	int i;
+
+	rdv_wq = alloc_workqueue ("verbs_rdv", WQ_UNBOUND, WQ_UNBOUND_MAX_ACTIVE);
+	if (!rdv_wq)
+		return -ENOMEM;
+
+	if (sock) {
+		rdv_task = kthread_run (rdv_accept_thread, NULL, "verbs_rdv");
+		if (IS_ERR (rdv_task)) {
+			printk (KERN_INFO "rendezvous thread start failed: %ld\n", PTR_ERR (rdv_task));
+			rdv_task = NULL;
+			return -ENOMEM;
+		}
+	}
+
+	for (i = -1; i < nr_peer_addrs; i++) {
+		if (i < 0 && !server_addr)
+			continue;
+
+		conn = kzalloc (sizeof (*conn), GFP_KERNEL);
+		if (!conn)
+			return -ENOMEM;
+
+		INIT_WORK (&conn->work, rdv_work);
+		conn->addr = i < 0 ? server_addr : peer_addrs[i];
+		queue_work (rdv_wq, &conn->work);
+	}
+
+	return 0;
+}
+
+
+static void rdv_stop (void)
+{
+	/* shutdown of the listener wakes the thread sleeping in accept */
+	rdv_stopping = 1;
+	if (sock)
+		kernel_sock_shutdown (sock, SHUT_RDWR);
+	if (rdv_task)
+		kthread_stop (rdv_task);
+	rdv_task = NULL;
+
+	/* an announce that got past rdv_stopping queues its last work now */
+	flush_scheduled_work ();
+
+	/* exchanges in progress end with their timeouts at the latest */
+	if (rdv_wq)
+		destroy_workqueue (rdv_wq);
+	rdv_wq = NULL;
+}
+
+
+static int rdv_accept_thread (void *dummy)
+{
+	struct socket *c_sock;
+	struct rdv_conn *conn;
+	int ret;
+
+	while (!kthread_should_stop () && !rdv_stopping) {
+		c_sock = NULL;
+		ret = kernel_accept (sock, &c_sock, 0);
+
+		if (ret) {
+			if (rdv_stopping)
+				break;
+			printk (KERN_INFO "kernel_accept failed: %d\n", ret);
+			msleep (10);
+			continue;
+		}
+
+		conn = kzalloc (sizeof (*conn), GFP_KERNEL);
+		if (!conn) {
+			sock_release (c_sock);
+			continue;
+		}
+
+		INIT_WORK (&conn->work, rdv_work);
+		conn->sock = c_sock;
+		queue_work (rdv_wq, &conn->work);
+	}
+
+	/* kthread_stop expects us to be alive until it is called */
+	set_current_state (TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop ()) {
+		schedule ();
+		set_current_state (TASK_INTERRUPTIBLE);
+	}
+	__set_current_state (TASK_RUNNING);
+
+	return 0;
+}
+
+
+/* Connects to addr, retrying while the peer has no listener yet: nodes of a
+ * cluster come up in no particular order. */
+static int rdv_connect (struct rdv_conn *conn)
+{
+	struct sockaddr_in sin;
+	unsigned int tries;
+	int ret = -ECONNREFUSED;
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons (PORT);
+	sin.sin_addr.s_addr = htonl (conn->addr);
+
+	for (tries = 0; tries < RDV_RETRIES && !rdv_stopping; tries++) {
+		if (tries)
+			msleep_interruptible (1000);
+
+		ret = sock_create (AF_INET, SOCK_STREAM, 0, &conn->sock);
+		if (ret)
+			return ret;
+		rdv_set_timeouts (conn->sock);
+
+		ret = kernel_connect (conn->sock, (struct sockaddr*)&sin, sizeof (sin), 0);
+		if (!ret)
+			return 0;
+
+		sock_release (conn->sock);
+		conn->sock = NULL;
+		if (ret != -ECONNREFUSED)
+			break;
+	}
+
+	return ret;
+}
+
+
+/* one exchange, the side that accepted talks first */
+static void rdv_work (struct work_struct *work)
+{
+	struct rdv_conn *conn = container_of (work, struct rdv_conn, work);
+	struct ib_side_info info;
+	struct sockaddr_in sin;
+	int ret, len;
+
+	if (conn->sock) {
+		rdv_set_timeouts (conn->sock);
+
+		ret = kernel_getpeername (conn->sock, (struct sockaddr*)&sin, &len);
+		if (ret) {
+			printk (KERN_INFO "getpeername failed: %d\n", ret);
+			goto out;
+		}
+		conn->addr = ntohl (sin.sin_addr.s_addr);
+
+		local_info_get (&conn->local);
+		ret = send_remote_info (conn->sock, &conn->local);
+		if (!ret)
+			ret = recv_remote_info (conn->sock, &info);
+	}
+	else {
+		printk (KERN_INFO "Trying to connect to 0x%x\n", conn->addr);
+
+		ret = rdv_connect (conn);
+		if (ret) {
+			printk (KERN_INFO "Connect to 0x%x failed: %d\n", conn->addr, ret);
+			goto out;
+		}
+
+		ret = recv_remote_info (conn->sock, &info);
+		local_info_get (&conn->local);
+		if (!ret)
+			ret = send_remote_info (conn->sock, &conn->local);
+	}
+
+	if (ret)
+		printk (KERN_INFO "Exchange with 0x%x failed: %d\n", conn->addr, ret);
+	else
+		peer_add (&info, conn->addr);
+out:
+	if (conn->sock)
+		sock_release (conn->sock);
+	kfree (conn);
+}
+
+
+/* our QPs moved: a new exchange with every peer tells them where */
+static void rdv_announce_work (struct work_struct *dummy)
+{
+	struct rdv_conn *conn;
+	unsigned int i, n;
+
+	if (!rdv_wq)
+		return;
+
+	n = ACCESS_ONCE (nr_peers);
+	smp_rmb ();
+
+	for (i = 0; i < n && !rdv_stopping; i++) {
+		conn = kzalloc (sizeof (*conn), GFP_KERNEL);
+		if (!conn)
+			return;
+
+		INIT_WORK (&conn->work, rdv_work);
+		rcu_read_lock ();
+		conn->addr = rcu_dereference (peer_array[i])->addr;
+		rcu_read_unlock ();
+		queue_work (rdv_wq, &conn->work);
+	}
+}
+
+
+/* a stuck peer must not hold a worker for long */
+static void rdv_set_timeouts (struct socket *s)
+{
+	struct timeval tv;
+
+	tv.tv_sec = RDV_TIMEOUT;
+	tv.tv_usec = 0;
+	kernel_setsockopt (s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof (tv));
+	kernel_setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof (tv));
+}
+
+
+static u32 peer_hash_fn (union ib_gid *gid, u16 lid)
+{
+	return jhash (gid->raw, sizeof (gid->raw), lid) & (PEER_HASH_SIZE - 1);
+}
+
+
+/* caller holds peer_lock */
+static struct verbs_peer *peer_find (union ib_gid *gid, u16 lid)
+{
+	struct verbs_peer *peer;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry (peer, pos, &peer_hash[peer_hash_fn (gid, lid)], node)
+		if (peer->info.lid == lid && !memcmp (peer->info.gid.raw, gid->raw, sizeof (gid->raw)))
+			return peer;
+
+	return NULL;
+}
+
+
+/* Adds the peer to the table, or replaces its entry when it comes again with
+ * new queue pairs. The first peer ever also becomes the benchmark's remote
+ * side; when that one comes again, our RC QP goes over to its new one. */
+static void peer_add (struct ib_side_info *info, u32 addr)
+{
+	struct verbs_peer *old, *new;
+	int first = 0, rejoined;
+	unsigned int i;
+
+	new = kzalloc (sizeof (*new), GFP_KERNEL);
+	if (!new)
+		return;
+
+	/* don't trust the peer's count blindly */
+	if (!info->nr_qps || info->nr_qps > MAX_QUEUES) {
+		info->nr_qps = 1;
+		info->qpns[0] = info->qp_num;
+	}
+	if (!info->nr_ports || info->nr_ports > MAX_PORTS) {
+		info->nr_ports = 1;
+		info->lids[0] = info->lid;
+		info->gids[0] = info->gid;
+	}
+	for (i = 0; i < info->nr_qps; i++)
+		if (info->qp_ports[i] >= info->nr_ports)
+			info->qp_ports[i] = 0;
+	if (info->nr_rpc > MAX_QUEUES)
+		info->nr_rpc = 0;
+	for (i = 0; i < info->nr_rpc; i++)
+		if (info->rpc_ports[i] >= info->nr_ports)
+			info->rpc_ports[i] = 0;
+
+	new->info = *info;
+	new->addr = addr;
+	new->joined = jiffies;
+	new->exchanges = 1;
+	new->slot = -1;
+
+	/* readers hold on to the old entry under RCU, it stays as it was */
+	spin_lock (&peer_lock);
+	old = peer_find (&info->gid, info->lid);
+	rejoined = !!old;
+	if (old) {
+		new->slot = old->slot;
+		new->exchanges += old->exchanges;
+		hlist_replace_rcu (&old->node, &new->node);
+		if (new->slot >= 0)
+			rcu_assign_pointer (peer_array[new->slot], new);
+	}
+	else {
+		hlist_add_head_rcu (&new->node, &peer_hash[peer_hash_fn (&info->gid, info->lid)]);
+		if (nr_peers < MAX_PEERS) {
+			new->slot = nr_peers;
+			rcu_assign_pointer (peer_array[nr_peers], new);
+			smp_wmb ();
+			first = !nr_peers++;
+		}
+	}
+	spin_unlock (&peer_lock);
+
+	if (rejoined) {
+		synchronize_rcu ();
+		kfree (old);
+	}
+
+	printk (KERN_INFO "Peer 0x%x %s, %u known. QPN: 0x%x, QKey: %u, LID: 0x%x, GID: %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
+		addr, rejoined ? "rejoined" : "joined", nr_peers, info->qp_num, info->qkey, (int)info->lid,
+		info->gid.raw[0], info->gid.raw[1], info->gid.raw[2], info->gid.raw[3],
+		info->gid.raw[4], info->gid.raw[5], info->gid.raw[6], info->gid.raw[7],
+		info->gid.raw[8], info->gid.raw[9], info->gid.raw[10], info->gid.raw[11],
+		info->gid.raw[12], info->gid.raw[13], info->gid.raw[14], info->gid.raw[15]);
+
+	/* the senders find the new QPs in the new entry; RC has to reconnect */
+	if (first) {
+		have_remote_info = 1;
+		schedule_work (&bench_start);
+	}
+	else if (rejoined && new->slot == 0 && rc_queue.qp)
+		schedule_work (&rc_rejoin);
+
+	/* resolved now, so that sending to it takes no SA query */
+	peer_resolve (info);
+}
+
+
+/* paths from every port of ours that is up to every port of the peer */
+static void peer_resolve (struct ib_side_info *info)
+{
+	unsigned int i, r;
+
+	for (i = 0; i < nr_ports; i++)
+		if (ports[i].active)
+			for (r = 0; r < info->nr_ports; r++)
+				path_resolve (i, info->lids[r], &info->gids[r]);
+}
+
+
+/* address handle from the queue's port to the port the peer's j-th QP is on */
+static struct ib_ah *peer_ah (struct verbs_queue *q, struct ib_side_info *info, unsigned int j)
+{
+	unsigned int p = info->qp_ports[j % info->nr_qps];
+
+	return path_ah (q->port, info->lids[p], &info->gids[p]);
+}
+
+
+static void peer_table_free (void)
+{
+	struct verbs_peer *peer;
+	struct hlist_node *pos, *tmp;
+	unsigned int i;
+
+	nr_peers = 0;
+	for (i = 0; i < MAX_PEERS; i++)
+		rcu_assign_pointer (peer_array[i], NULL);
+	synchronize_rcu ();
+
+	for (i = 0; i < PEER_HASH_SIZE; i++)
+		hlist_for_each_entry_safe (peer, pos, tmp, &peer_hash[i], node) {
+			hlist_del (&peer->node);
+			kfree (peer);
+		}
+}
+
+
+/* how many of nr sending queues, spread round robin, go to queue k of m */
+static unsigned int credit_senders (unsigned int nr, unsigned int m, unsigned int k)
+{
+	return nr / m + (k < nr % m);
+}
+
+
+/* Flow control with the first peer, if it does it too. Each of our queues
+ * gets an equal share of the buffers behind the peer's queue it sends to;
+ * the peer's queues are acked explicitly once they have used half of what
+ * we allow them and no message of ours has carried the ack yet. */
+static void credit_setup (void)
+{
+	struct ib_side_info *remote;
+	unsigned int i, n, nr, credits, shared;
+	u32 qpn;
+
+	if (!credit_queue.qp)
+		return;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	nr = remote->nr_qps;
+	qpn = remote->credit_qpn;
+	credits = remote->recv_credits;
+	shared = remote->recv_shared;
+	rcu_read_unlock ();
+
+	if (!qpn || !credits) {
+		printk (KERN_INFO "Peer has no flow control, sending without\n");
+		return;
+	}
+
+	for (i = 0; i < nr_queues; i++) {
+		n = shared ? nr_queues : credit_senders (nr_queues, nr, i % nr);
+		queues[i].cr_grant = max (credits / n, 1U);
+		queues[i].fc = 1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		n = shared_ring ? nr : credit_senders (nr, nr_queues, i % nr_queues);
+		credit_thresh[i] = max (local_info.recv_credits / n / 2, 1U);
+	}
+
+	printk (KERN_INFO "Flow control: queue 0 may have %u sends unacked, peer queue 0 acked every %u\n",
+		queues[0].cr_grant, credit_thresh[0]);
+
+	smp_wmb ();
+	credit_active = 1;
+}
+
+
+/* sends the peer's queue has room for now */
+static unsigned int credit_avail (struct verbs_queue *q)
+{
+	long ahead = q->send_posted - ACCESS_ONCE (q->cr_acked);
+
+	if (ahead <= 0)
+		return q->cr_grant;
+	return ahead < q->cr_grant ? q->cr_grant - ahead : 0;
+}
+
+
+/* the peer has everything before ack; acks may come late and out of order */
+static void credit_acked (struct verbs_queue *q, unsigned long ack)
+{
+	unsigned long old;
+	u64 lat;
+
+	do {
+		old = q->cr_acked;
+		if ((long)(ack - old) <= 0)
+			return;
+	} while (cmpxchg (&q->cr_acked, old, ack) != old);
+
+	if (test_bit (0, &q->cr_sampling)) {
+		smp_rmb ();
+		if ((long)(ack - q->cr_sample_seq) > 0 && test_and_clear_bit (0, &q->cr_sampling)) {
+			lat = ktime_to_ns (ktime_sub (ktime_get (), q->cr_sample_time));
+			q->stat_cr_lat_ns += lat;
+			q->stat_cr_lat_n++;
+			q->stat_cr_lat_max = max (q->stat_cr_lat_max, lat);
+		}
+	}
+
+	/* cmpxchg is a full barrier, a sender that went to sleep is seen */
+	if (waitqueue_active (&q->send_wait))
+		wake_up (&q->send_wait);
+}
+
+
+/* Explicit ack to the peer's queue s, from the credit queue to the peer's.
+ * Softirq context only. Without room or a buffer the ack waits for the next
+ * message from s, or the timer. */
+static void credit_post (unsigned int s)
+{
+	struct verbs_queue *q = &credit_queue;
+	struct ib_send_wr wr, *bad_wr;
+	struct ib_sge sges[SEND_SGE];
+	struct ib_side_info *remote;
+	unsigned long seq, ack;
+	struct ib_ah *ah;
+	u32 id;
+
+	spin_lock (&credit_lock);
+
+	seq = q->send_posted;
+	if (seq - ACCESS_ONCE (q->send_done) >= CQ_SIZE || buf_get (send_pool, &id)) {
+		spin_unlock (&credit_lock);
+		return;
+	}
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	ah = path_ah (q->port, remote->lid, &remote->gid);
+	if (!ah) {
+		rcu_read_unlock ();
+		buf_put (send_pool, id);
+		spin_unlock (&credit_lock);
+		return;
+	}
+
+	ack = credit_rx_next[s];
+
+	memset (&wr, 0, sizeof (wr));
+	wr.wr_id = seq;
+	wr.sg_list = sges;
+	wr.opcode = IB_WR_SEND;
+	wr.send_flags = IB_SEND_SIGNALED;
+	wr.wr.ud.ah = ah;
+	wr.wr.ud.port_num = ports[q->port].num;
+	wr.wr.ud.remote_qkey = remote->qkey;
+	wr.wr.ud.remote_qpn = remote->credit_qpn;
+	q->send_bufs[seq % CQ_SIZE] = id;
+
+	/* a 48 bit ack outlasts any run */
+	send_fill_ud (q, &wr, sges, seq, id, sizeof (struct verbs_msg_hdr),
+		      sizeof (struct verbs_msg_hdr) <= q->max_inline, MSG_CREDIT,
+		      (u64)s << CREDIT_ACK_BITS | (ack & ((1ULL << CREDIT_ACK_BITS) - 1)));
+
+	if (!ib_post_send (q->qp, &wr, &bad_wr)) {
+		q->send_posted++;
+		credit_rx_told[s] = ack;
+		stat_credit_updates++;
+	}
+	else
+		buf_put (send_pool, id);
+
+	rcu_read_unlock ();
+	spin_unlock (&credit_lock);
+}
+
+
+/* Data queues under flow control: the ack for our sends comes in the header
+ * of the peer's messages, and whatever arrives from the peer's queue s
+ * moves its ack on, or tells us what got lost. */
+static void credit_data_handler (struct verbs_queue *q, struct ib_wc *wc)
+{
+	struct ib_side_info *remote;
+	struct verbs_msg_hdr *hdr;
+	unsigned long seq;
+	unsigned int s;
+	int ours;
+
+	if (credit_active && wc->status == IB_WC_SUCCESS && wc->byte_len >= GRH_SIZE + sizeof (*hdr)) {
+		ib_dma_sync_single_for_cpu (ib_dev, buf_dma (recv_pool, wc->wr_id), GRH_SIZE + sizeof (*hdr), DMA_FROM_DEVICE);
+		hdr = buf_addr (recv_pool, wc->wr_id) + GRH_SIZE;
+		s = ntohl (hdr->queue);
+
+		rcu_read_lock ();
+		remote = remote_get ();
+		ours = remote && s < remote->nr_qps && wc->src_qp == remote->qpns[s];
+		rcu_read_unlock ();
+
+		if (ours) {
+			if (q->fc)
+				credit_acked (q, be64_to_cpu (hdr->ack));
+
+			seq = be64_to_cpu (hdr->seq);
+			if ((long)(seq - credit_rx_next[s]) > 0)
+				credit_drops[s] += seq - credit_rx_next[s];
+			if ((long)(seq + 1 - credit_rx_next[s]) > 0)
+				credit_rx_next[s] = seq + 1;
+
+			if (credit_rx_next[s] - credit_rx_told[s] >= credit_thresh[s])
+				credit_post (s);
+		}
+	}
+
+	recv_handler (q, wc);
+}
+
+
+/* explicit acks from the peer's credit queue */
+static void credit_recv_handler (struct verbs_queue *q, struct ib_wc *wc)
+{
+	struct ib_side_info *remote;
+	struct verbs_msg_hdr *hdr;
+	unsigned int s;
+	int ours;
+	u64 tag;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	ours = remote && wc->src_qp == remote->credit_qpn;
+	rcu_read_unlock ();
+
+	if (credit_active && wc->status == IB_WC_SUCCESS && wc->byte_len >= GRH_SIZE + sizeof (*hdr) && ours) {
+		ib_dma_sync_single_for_cpu (ib_dev, buf_dma (recv_pool, wc->wr_id), GRH_SIZE + sizeof (*hdr), DMA_FROM_DEVICE);
+		hdr = buf_addr (recv_pool, wc->wr_id) + GRH_SIZE;
+		tag = be64_to_cpu (hdr->tag);
+		s = tag >> CREDIT_ACK_BITS;
+
+		if (ntohl (hdr->op) == MSG_CREDIT && s < nr_queues && queues[s].fc)
+			credit_acked (&queues[s], tag & ((1ULL << CREDIT_ACK_BITS) - 1));
+	}
+
+	recv_handler (q, wc);
+}
+
+
+/* WR and SGE arrays of a queue the suite sends on */
+static int bench_queue_prepare (struct verbs_queue *q)
+{
+	q->send_wrs = kcalloc (BENCH_CHAIN, sizeof (*q->send_wrs), GFP_KERNEL);
+	q->send_sges = kcalloc (BENCH_CHAIN * SEND_SGE, sizeof (*q->send_sges), GFP_KERNEL);
+	if (!q->send_wrs || !q->send_sges)
+		return -ENOMEM;
+
+	init_waitqueue_head (&q->send_wait);
+	return 0;
+}
+
+
+/* Posts up to n sends of len bytes in one chain, seq end - 1 and every
+ * signal_every-th one signaled, as is the one filling the window. Returns
+ * how many went in, -EAGAIN if none could. Called from the recv tasklet
+ * too, to answer pings. */
+static int bench_post (struct verbs_queue *q, unsigned int n, unsigned int len, u32 op, u64 tag, unsigned long end)
+{
+	struct ib_send_wr *wr, *bad_wr;
+	struct ib_side_info *remote;
+	struct ib_sge *sges;
+	struct ib_ah *ah = NULL;
+	unsigned long seq;
+	unsigned int i;
+	size_t off;
+	u32 id;
+	int ret;
+
+	spin_lock_bh (&bench_lock);
+	rcu_read_lock ();
+	remote = remote_get ();
+
+	if (!q->rc) {
+		ah = path_ah (q->port, remote->lid, &remote->gid);
+		if (!ah) {
+			ret = -EAGAIN;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		wr = &q->send_wrs[i];
+		seq = q->send_posted + i;
+		sges = &q->send_sges[i * SEND_SGE];
+
+		if (!q->rc && buf_get (send_pool, &id))
+			break;
+
+		memset (wr, 0, sizeof (*wr));
+		wr->wr_id = seq;
+		wr->sg_list = sges;
+		if (i)
+			q->send_wrs[i-1].next = wr;
+
+		if (q->rc) {
+			off = (seq % RC_SLOTS) * rc_msg;
+			sges[0].addr = rc_dma + off;
+			sges[0].length = len;
+			sges[0].lkey = rc_mr->lkey;
+			wr->num_sge = 1;
+			wr->opcode = IB_WR_RDMA_WRITE;
+			wr->wr.rdma.remote_addr = remote->rc_addr + off;
+			wr->wr.rdma.rkey = remote->rc_rkey;
+		}
+		else {
+			q->send_bufs[seq % CQ_SIZE] = id;
+			send_fill_ud (q, wr, sges, seq, id, len, len <= q->max_inline, op, tag);
+			wr->opcode = IB_WR_SEND;
+			wr->wr.ud.ah = ah;
+			wr->wr.ud.port_num = ports[q->port].num;
+			wr->wr.ud.remote_qkey = remote->qkey;
+			wr->wr.ud.remote_qpn = remote->bench_qpn;
+		}
+
+		if ((seq + 1) % signal_every == 0 || seq + 1 == end || seq + 1 - q->send_done >= bench_depth)
+			wr->send_flags |= IB_SEND_SIGNALED;
+	}
+
+	/* out of buffers: what is posted must retire */
+	if (!i) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	n = i;
+	q->send_wrs[n-1].send_flags |= IB_SEND_SIGNALED;
+
+	ret = ib_post_send (q->qp, q->send_wrs, &bad_wr);
+	if (ret) {
+		printk (KERN_INFO "bench post_send failed: %d\n", ret);
+		if (!q->rc)
+			for (wr = bad_wr; wr; wr = wr->next)
+				buf_put (send_pool, q->send_bufs[wr->wr_id % CQ_SIZE]);
+		n = bad_wr - q->send_wrs;
+	}
+
+	q->send_posted += n;
+	if (!ret)
+		ret = n;
+out:
+	rcu_read_unlock ();
+	spin_unlock_bh (&bench_lock);
+	return ret;
+}
+
+
+/* waits for the sends up to end to retire, a second at most */
+static int bench_drain (struct verbs_queue *q, unsigned long end)
+{
+	long left;
+
+	left = wait_event_interruptible_timeout (q->send_wait, (long)(ACCESS_ONCE (q->send_done) - end) >= 0, HZ);
+	if (left < 0)
+		return left;
+	return left ? 0 : -ETIMEDOUT;
+}
+
+
+/* bench_iters sends, bench_depth in flight, posted chain at a time */
+static int bench_stream (struct verbs_queue *q, unsigned int chain, struct bench_result *res)
+{
+	unsigned long end = q->send_posted + bench_iters;
+	unsigned int room;
+	ktime_t t0;
+	int ret;
+
+	t0 = ktime_get ();
+
+	while (q->send_posted != end) {
+		room = bench_depth - (q->send_posted - ACCESS_ONCE (q->send_done));
+		if (!room) {
+			ret = bench_drain (q, q->send_done + 1);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		ret = bench_post (q, min3 (room, chain, (unsigned int)(end - q->send_posted)), bench_size, MSG_DATA, 0, end);
+		if (ret == -EAGAIN)
+			cond_resched ();
+		else if (ret < 0)
+			return ret;
+	}
+
+	ret = bench_drain (q, end);
+	if (ret)
+		return ret;
+
+	res->ns = ktime_to_ns (ktime_sub (ktime_get (), t0));
+	res->msgs = bench_iters;
+	return 0;
+}
+
+
+/* UD: round trips of a ping answered by the peer's bench queue. RC: an
+ * RDMA WRITE completes when the peer acknowledges it, a round trip too. */
+static int bench_latency (struct verbs_queue *q, struct bench_result *res)
+{
+	unsigned long seq;
+	unsigned int i = 0;
+	ktime_t t0, end;
+	int ret;
+
+	while (i < bench_iters) {
+		seq = q->send_posted;
+		t0 = ktime_get ();
+		end = ktime_add_ns (t0, NSEC_PER_SEC);
+
+		ret = bench_post (q, 1, bench_size, MSG_PING, seq, seq + 1);
+		if (ret == -EAGAIN) {
+			cond_resched ();
+			continue;
+		}
+		if (ret < 0)
+			return ret;
+
+		/* the completion tasklet runs on the way out of the interrupt */
+		while (q->rc ? ACCESS_ONCE (q->send_done) != seq + 1 : ACCESS_ONCE (bench_pong) != seq + 1) {
+			if (ktime_to_ns (ktime_sub (ktime_get (), end)) >= 0)
+				return -ETIMEDOUT;
+			if (need_resched ())
+				schedule ();
+			cpu_relax ();
+		}
+
+		hist_record (&res->hist, ktime_to_ns (ktime_sub (ktime_get (), t0)));
+		i++;
+	}
+
+	res->msgs = bench_iters;
+	return bench_drain (q, q->send_posted);
+}
+
+
+/* answers pings, notes pongs, then returns the buffer as usual */
+static void bench_recv_handler (struct verbs_queue *q, struct ib_wc *wc)
+{
+	struct verbs_msg_hdr *hdr;
+	u64 tag;
+
+	if (wc->status == IB_WC_SUCCESS && wc->byte_len >= GRH_SIZE + sizeof (*hdr)) {
+		ib_dma_sync_single_for_cpu (ib_dev, buf_dma (recv_pool, wc->wr_id), GRH_SIZE + sizeof (*hdr), DMA_FROM_DEVICE);
+		hdr = buf_addr (recv_pool, wc->wr_id) + GRH_SIZE;
+		tag = be64_to_cpu (hdr->tag);
+
+		if (ntohl (hdr->op) == MSG_PING)
+			bench_post (q, 1, min (ntohl (hdr->len), (u32)send_pool->len), MSG_PONG, tag, q->send_posted + 1);
+		else if (ntohl (hdr->op) == MSG_PONG)
+			bench_pong = tag + 1;
+	}
+
+	recv_handler (q, wc);
+}
+
+
+static int bench_run (int test)
+{
+	struct verbs_queue *q = bench_transport ? &rc_queue : &bench_queue;
+	struct bench_result *res = &bench_results[test];
+	struct ib_side_info *remote;
+	unsigned int max_size;
+	u32 bench_qpn = 0;
+	int ret;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	if (remote)
+		bench_qpn = remote->bench_qpn;
+	rcu_read_unlock ();
+
+	if (!have_path || !q->qp || !q->send_wrs)
+		return -ENOTCONN;
+	if (q->rc ? !rc_connected : !bench_qpn)
+		return -ENOTCONN;
+
+	/* a datagram is one MTU, a WRITE goes into one RC slot of the peer */
+	max_size = q->rc ? rc_msg : min ((unsigned int)send_pool->len, port_mtu ());
+	bench_size = clamp (bench_size, 1U, max_size);
+	bench_depth = clamp (bench_depth, 1U, (unsigned int)CQ_SIZE);
+	bench_iters = max (bench_iters, 1U);
+
+	/* a pong must carry the header back */
+	if (test == BENCH_SEND_LAT && !q->rc)
+		bench_size = max (bench_size, (unsigned int)sizeof (struct verbs_msg_hdr));
+
+	memset (res, 0, sizeof (*res));
+	res->transport = bench_transport;
+	res->size = bench_size;
+	res->depth = bench_depth;
+	res->iters = bench_iters;
+
+	printk (KERN_INFO "bench: %s over %s, %u bytes, depth %u, %u iterations\n", bench_names[test],
+		q->rc ? "RC" : "UD", bench_size, bench_depth, bench_iters);
+
+	if (test == BENCH_SEND_LAT)
+		ret = bench_latency (q, res);
+	else
+		ret = bench_stream (q, test == BENCH_MSG_RATE ? BENCH_CHAIN : 1, res);
+
+	if (ret)
+		printk (KERN_INFO "bench: %s failed: %d\n", bench_names[test], ret);
+	res->valid = !ret;
+	return ret;
+}
+
+
+static ssize_t bench_run_write (struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	char name[16];
+	size_t len = min (count, sizeof (name) - 1);
+	int test, ret;
+
+	if (copy_from_user (name, ubuf, len))
+		return -EFAULT;
+	name[len] = 0;
+	if (len && name[len-1] == '\n')
+		name[len-1] = 0;
+
+	for (test = 0; test < BENCH_TESTS; test++)
+		if (!strcmp (name, bench_names[test]))
+			break;
+	if (test == BENCH_TESTS)
+		return -EINVAL;
+
+	if (!mutex_trylock (&bench_mutex))
+		return -EBUSY;
+	ret = bench_run (test);
+	mutex_unlock (&bench_mutex);
+
+	return ret ? ret : count;
+}
+
+
+static int bench_results_show (struct seq_file *m, void *v)
+{
+	struct bench_result *res;
+	struct lat_hist *h;
+	unsigned long mbit, kpps;
+	int test;
+
+	mutex_lock (&bench_mutex);
+
+	for (test = 0; test < BENCH_TESTS; test++) {
+		res = &bench_results[test];
+		if (!res->valid)
+			continue;
+
+		seq_printf (m, "%s: %s, %u bytes, depth %u, %u iterations\n", bench_names[test],
+			    res->transport ? "RC" : "UD", res->size, res->depth, res->iters);
+
+		if (test != BENCH_SEND_LAT) {
+			mbit = div64_u64 (res->msgs * res->size * 8 * 1000, res->ns);
+			kpps = div64_u64 (res->msgs * 1000000, res->ns);
+			seq_printf (m, "  %lu.%03lu Gbit/s, %lu.%03lu Mpps\n",
+				    mbit / 1000, mbit % 1000, kpps / 1000, kpps % 1000);
+			continue;
+		}
+
+		h = &res->hist;
+		seq_printf (m, "  min %llu ns, mean %llu, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+			    (unsigned long long)h->min, (unsigned long long)div64_u64 (h->sum, h->count),
+			    (unsigned long long)hist_percentile (h, 50000), (unsigned long long)hist_percentile (h, 90000),
+			    (unsigned long long)hist_percentile (h, 99000), (unsigned long long)hist_percentile (h, 99900),
+			    (unsigned long long)h->max);
+	}
+
+	mutex_unlock (&bench_mutex);
+	return 0;
+}
+
+
+static int bench_results_open (struct inode *inode, struct file *file)
+{
+	return single_open (file, bench_results_show, NULL);
+}
+
+
+/* One RPC message out of a send_pool buffer, header and payload in place,
+ * every signal_every-th send signaled, as is the one filling the window.
+ * Caller holds the queue's lock and the RCU read lock for the handle. */
+static int rpc_post (struct rpc_queue *rq, struct ib_ah *ah, u32 qpn, u32 qkey, u32 id, unsigned int len)
+{
+	struct verbs_queue *q = &rq->q;
+	struct ib_send_wr wr, *bad_wr;
+	unsigned long seq = q->send_posted;
+	struct ib_sge sge;
+	int inl = len <= q->max_inline;
+
+	if (seq - ACCESS_ONCE (q->send_done) >= CQ_SIZE)
+		return -EAGAIN;
+
+	if (inl)
+		sge.addr = (uintptr_t)buf_addr (send_pool, id);
+	else {
+		sge.addr = buf_dma (send_pool, id);
+		buf_sync (send_pool, id, len);
+	}
+	sge.length = len;
+	sge.lkey = mr->lkey;
+
+	memset (&wr, 0, sizeof (wr));
+	wr.wr_id = seq;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IB_WR_SEND;
+	wr.send_flags = inl ? IB_SEND_INLINE : 0;
+	if ((seq + 1) % signal_every == 0 || seq + 1 - q->send_done >= CQ_SIZE)
+		wr.send_flags |= IB_SEND_SIGNALED;
+	wr.wr.ud.ah = ah;
+	wr.wr.ud.port_num = ports[q->port].num;
+	wr.wr.ud.remote_qkey = qkey;
+	wr.wr.ud.remote_qpn = qpn;
+	q->send_bufs[seq % CQ_SIZE] = id;
+
+	if (ib_post_send (q->qp, &wr, &bad_wr))
+		return -EIO;
+
+	q->send_posted++;
+	return 0;
+}
+
+
+/* Caller holds the queue's lock. Timeouts are mostly the same, so a call
+ * finds its place by deadline at or near the tail. */
+static void rpc_pending_add (struct rpc_queue *rq, struct verbs_rpc_call *call)
+{
+	struct list_head *pos = &rq->by_deadline;
+	struct verbs_rpc_call *c;
+
+	hlist_add_head (&call->node, &rq->pending[call->id & (RPC_HASH_SIZE - 1)]);
+
+	list_for_each_entry_reverse (c, &rq->by_deadline, list)
+		if (!time_after (c->deadline, call->deadline)) {
+			pos = &c->list;
+			break;
+		}
+	list_add (&call->list, pos);
+
+	if (rq->by_deadline.next == &call->list || !timer_pending (&rq->timer))
+		mod_timer (&rq->timer, call->deadline);
+}
+
+
+/* the call waiting for the response id, off the queue; caller holds the lock */
+static struct verbs_rpc_call *rpc_pending_take (struct rpc_queue *rq, u64 id)
+{
+	struct verbs_rpc_call *call;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry (call, pos, &rq->pending[id & (RPC_HASH_SIZE - 1)], node)
+		if (call->id == id) {
+			hlist_del (&call->node);
+			list_del (&call->list);
+			return call;
+		}
+
+	return NULL;
+}
+
+
+/* fails the calls past their deadline, and comes back for the next one */
+static void rpc_timer_func (unsigned long data)
+{
+	struct rpc_queue *rq = (struct rpc_queue *)data;
+	struct verbs_rpc_call *call, *tmp;
+	unsigned long flags;
+	LIST_HEAD (expired);
+
+	spin_lock_irqsave (&rq->lock, flags);
+	list_for_each_entry_safe (call, tmp, &rq->by_deadline, list) {
+		if (time_before (jiffies, call->deadline)) {
+			mod_timer (&rq->timer, call->deadline);
+			break;
+		}
+		hlist_del (&call->node);
+		list_move_tail (&call->list, &expired);
+		rq->stat_timeouts++;
+	}
+	spin_unlock_irqrestore (&rq->lock, flags);
+
+	list_for_each_entry_safe (call, tmp, &expired, list)
+		call->done (call, -ETIMEDOUT, NULL, 0);
+}
+
+
+/* whoever still waits gets -ESHUTDOWN, and nobody gets in after them */
+static void rpc_shutdown (void)
+{
+	struct verbs_rpc_call *call, *tmp;
+	struct rpc_queue *rq;
+	unsigned long flags;
+	unsigned int i, b;
+	LIST_HEAD (failed);
+
+	/* callers look at it under RCU; once they are out, nothing they
+	 * reached through it may go before this returns */
+	rpc_ready = 0;
+	synchronize_rcu ();
+
+	for (i = 0; i < nr_rpc; i++) {
+		rq = &rpc_queues[i];
+		spin_lock_irqsave (&rq->lock, flags);
+		list_splice_init (&rq->by_deadline, &failed);
+		for (b = 0; b < RPC_HASH_SIZE; b++)
+			INIT_HLIST_HEAD (&rq->pending[b]);
+		spin_unlock_irqrestore (&rq->lock, flags);
+		del_timer_sync (&rq->timer);
+	}
+
+	list_for_each_entry_safe (call, tmp, &failed, list)
+		call->done (call, -ESHUTDOWN, NULL, 0);
+}
+
+
+/* A request runs the method's handler right here, in the tasklet, and its
+ * response goes back to the QP the request came from. The address is the
+ * port the caller named, which is resolved since it joined. */
+static void rpc_serve (struct rpc_queue *rq, struct ib_wc *wc, struct verbs_rpc_hdr *hdr, unsigned int len)
+{
+	unsigned int max = verbs_rpc_max_size (), resp_len = max;
+	u32 method = ntohl (hdr->method), id;
+	verbs_rpc_handler_t handler;
+	struct verbs_rpc_hdr *resp;
+	unsigned long flags;
+	struct ib_ah *ah;
+	int status, ret;
+
+	if (buf_get (send_pool, &id)) {
+		rq->stat_dropped++;
+		return;
+	}
+	resp = buf_addr (send_pool, id);
+
+	rcu_read_lock ();
+
+	handler = method < VERBS_RPC_METHODS ? rcu_dereference (rpc_handlers[method]) : NULL;
+	status = handler ? handler (method, hdr + 1, len, resp + 1, &resp_len) : -ENOSYS;
+	if (!status && resp_len > max)
+		status = -EMSGSIZE;
+	if (status)
+		resp_len = 0;
+
+	resp->id = hdr->id;
+	resp->method = hdr->method;
+	resp->len = htonl (resp_len);
+	resp->flags = htonl (RPC_RESPONSE);
+	resp->status = htonl (status);
+
+	/* every QP here has the same Q_Key */
+	spin_lock_irqsave (&rq->lock, flags);
+	ah = path_ah (rq->q.port, ntohs (hdr->lid), &hdr->gid);
+	ret = ah ? rpc_post (rq, ah, wc->src_qp, local_info.qkey, id, sizeof (*resp) + resp_len) : -EAGAIN;
+	spin_unlock_irqrestore (&rq->lock, flags);
+
+	rcu_read_unlock ();
+
+	if (ret) {
+		buf_put (send_pool, id);
+		rq->stat_dropped++;
+	}
+	else
+		rq->stat_served++;
+}
+
+
+/* responses complete the call they answer, unless it timed out already */
+static void rpc_recv_handler (struct verbs_queue *q, struct ib_wc *wc)
+{
+	struct rpc_queue *rq = container_of (q, struct rpc_queue, q);
+	struct verbs_rpc_call *call;
+	struct verbs_rpc_hdr *hdr;
+	unsigned long flags;
+	unsigned int len;
+
+	if (wc->status != IB_WC_SUCCESS || wc->byte_len < GRH_SIZE + sizeof (*hdr))
+		goto out;
+
+	ib_dma_sync_single_for_cpu (ib_dev, buf_dma (recv_pool, wc->wr_id), wc->byte_len, DMA_FROM_DEVICE);
+	hdr = buf_addr (recv_pool, wc->wr_id) + GRH_SIZE;
+	len = min (ntohl (hdr->len), wc->byte_len - GRH_SIZE - (unsigned int)sizeof (*hdr));
+
+	if (!(ntohl (hdr->flags) & RPC_RESPONSE)) {
+		rpc_serve (rq, wc, hdr, len);
+		goto out;
+	}
+
+	spin_lock_irqsave (&rq->lock, flags);
+	call = rpc_pending_take (rq, be64_to_cpu (hdr->id));
+	if (!call)
+		rq->stat_dropped++;
+	spin_unlock_irqrestore (&rq->lock, flags);
+
+	if (call)
+		call->done (call, (int)ntohl (hdr->status), hdr + 1, len);
+out:
+	recv_handler (q, wc);
+}
+
+
+static int rpc_echo (u32 method, const void *req, unsigned int len, void *resp, unsigned int *resp_len)
+{
+	if (len > *resp_len)
+		return -EMSGSIZE;
+
+	memcpy (resp, req, len);
+	*resp_len = len;
+	return 0;
+}
+
+
+int verbs_rpc_register (u32 method, verbs_rpc_handler_t handler)
+{
+	int ret = 0;
+
+	if (method >= VERBS_RPC_METHODS || !handler)
+		return -EINVAL;
+
+	spin_lock (&rpc_handlers_lock);
+	if (rpc_handlers[method])
+		ret = -EBUSY;
+	else
+		rcu_assign_pointer (rpc_handlers[method], handler);
+	spin_unlock (&rpc_handlers_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL (verbs_rpc_register);
+
 
-	mr = ib_get_dma_mr (pd, IB_ACCESS_LOCAL_WRITE);
-	if (IS_ERR (mr)) {
-		ret = PTR_ERR (mr);
-		printk (KERN_INFO "get_dma_mr failed: %d\n", ret);
+/* the handler isn't running anywhere once this returns */
+void verbs_rpc_unregister (u32 method)
+{
+	if (method >= VERBS_RPC_METHODS)
 		return;
-	}
 
-	send_cq = ib_create_cq (dev, NULL, NULL, NULL, 1, 1);
-	if (IS_ERR (send_cq)) {
-		ret = PTR_ERR (send_cq);
-		printk (KERN_INFO "ib_create_cq failed: %d\n", ret);
-		return;
-	}
+	spin_lock (&rpc_handlers_lock);
+	rcu_assign_pointer (rpc_handlers[method], NULL);
+	spin_unlock (&rpc_handlers_lock);
 
-	recv_cq = ib_create_cq (dev, verbs_comp_handler_recv, NULL, NULL, 1, 1);
-	if (IS_ERR (recv_cq)) {
-		ret = PTR_ERR (recv_cq);
-		printk (KERN_INFO "ib_create_cq failed: %d\n", ret);
-		return;
+	synchronize_rcu ();
+}
+EXPORT_SYMBOL_GPL (verbs_rpc_unregister);
+
+
+unsigned int verbs_rpc_max_size (void)
+{
+	unsigned int max = 0;
+
+	rcu_read_lock ();
+	if (rpc_ready) {
+		smp_rmb ();
+		max = min ((unsigned int)send_pool->len, port_mtu ()) - sizeof (struct verbs_rpc_hdr);
 	}
+	rcu_read_unlock ();
 
-	ib_req_notify_cq (recv_cq, IB_CQ_NEXT_COMP);
-	printk (KERN_INFO "CQs allocated\n");
+	return max;
+}
+EXPORT_SYMBOL_GPL (verbs_rpc_max_size);
 
-	ib_query_pkey (dev, 1, 0, &pkey);
 
-	/* allocate memory */
-	send_buf = kmalloc (buf_size + 40, GFP_KERNEL);
-	recv_buf = kmalloc (buf_size + 40, GFP_KERNEL);
+unsigned int verbs_rpc_peers (void)
+{
+	return rpc_ready ? ACCESS_ONCE (nr_peers) : 0;
+}
+EXPORT_SYMBOL_GPL (verbs_rpc_peers);
 
-	if (!send_buf || !recv_buf) {
-		printk (KERN_INFO "Memory allocation error\n");
-		return;
-	}
 
-	printk (KERN_INFO "Trying to register regions\n");
-	if (ib_dev->dma_ops)
-		printk (KERN_INFO "DMA ops are defined\n");
+/* Any context. The request goes out on the RPC queue of the CPU we are on,
+ * to the peer's queue with the same index, and the response comes back to
+ * the same queue, where the call waits for it. Everything from the rpc_ready
+ * check on is one RCU section, which device removal waits out before it
+ * frees the queues, the peers or the pools. */
+int verbs_rpc_call (struct verbs_rpc_call *call)
+{
+	struct ib_side_info *info;
+	struct verbs_rpc_hdr *hdr;
+	struct rpc_queue *rq;
+	struct ib_ah *ah;
+	unsigned long flags;
+	union ib_gid gid;
+	unsigned int j, p;
+	u16 lid, pk;
+	u32 id;
+	int ret;
 
-	memset (send_buf, 0, buf_size+40);
-	memset (send_buf, 0, buf_size+40);
+	if (call->method >= VERBS_RPC_METHODS || !call->done)
+		return -EINVAL;
 
-	send_key = ib_dma_map_single (ib_dev, send_buf, buf_size, DMA_FROM_DEVICE);
-	printk (KERN_INFO "send_key obtained %llx\n", send_key);
-	recv_key = ib_dma_map_single (ib_dev, recv_buf, buf_size, DMA_TO_DEVICE);
-	printk (KERN_INFO "recv_key obtained %llx\n", recv_key);
+	rcu_read_lock ();
 
-	if (ib_dma_mapping_error (ib_dev, send_key)) {
-		printk (KERN_INFO "Error mapping send buffer\n");
-		return;
-	}
+	ret = -ENOTCONN;
+	if (!rpc_ready || call->peer >= ACCESS_ONCE (nr_peers))
+		goto out_rcu;
+	smp_rmb ();
 
-	if (ib_dma_mapping_error (ib_dev, recv_key)) {
-		printk (KERN_INFO "Error mapping recv buffer\n");
-		return;
-	}
+	ret = -EMSGSIZE;
+	if (call->len > verbs_rpc_max_size ())
+		goto out_rcu;
 
-	memset (&attrs, 0, sizeof (attrs));
-	attrs.qp_type = IB_QPT_UD;
-	attrs.sq_sig_type = IB_SIGNAL_ALL_WR;
-	attrs.event_handler = verbs_qp_event;
-	attrs.cap.max_send_wr = CQ_SIZE;
-	attrs.cap.max_recv_wr = CQ_SIZE;
-	attrs.cap.max_send_sge = 1;
-	attrs.cap.max_recv_sge = 1;
-	attrs.send_cq = send_cq;
-	attrs.recv_cq = recv_cq;
+	/* the peer's entry as it is now, a rejoin replaces it */
+	ret = -ENOTCONN;
+	info = &rcu_dereference (peer_array[call->peer])->info;
+	if (!info->nr_rpc)
+		goto out_rcu;
 
-	qp = ib_create_qp (pd, &attrs);
-	if (IS_ERR (qp)) {
-		ret = PTR_ERR (qp);
-		printk (KERN_INFO "qp allocation failed: %d\n", ret);
-		return;
-	}
+	rq = &rpc_queues[raw_smp_processor_id () % nr_rpc];
+	j = rq->q.idx % info->nr_rpc;
+	p = info->rpc_ports[j];
 
-	printk (KERN_INFO "Create QP with num %x\n", qp->qp_num);
+	ret = -ENOBUFS;
+	if (buf_get (send_pool, &id))
+		goto out_rcu;
 
-	if (init_qp (qp)) {
-		printk (KERN_INFO "Failed to initialize QP\n");
-		return;
-	}
+	hdr = buf_addr (send_pool, id);
+	hdr->method = htonl (call->method);
+	hdr->len = htonl (call->len);
+	hdr->flags = 0;
+	hdr->status = 0;
+	port_addr (rq->q.port, &lid, &gid, &pk);
+	hdr->lid = htons (lid);
+	hdr->gid = gid;
+	memcpy (hdr + 1, call->req, call->len);
 
-	ret = ib_query_gid (ib_dev, 1, 0, &local_info.gid);
-	if (ret) {
-		printk (KERN_INFO "query_gid failed %d\n", ret);
-		return;
-	}
+	call->deadline = jiffies + (call->timeout ? call->timeout : msecs_to_jiffies (rpc_timeout));
 
-	local_info.qp_num = qp->qp_num;
-	local_info.lid = port_attr.lid;
+	spin_lock_irqsave (&rq->lock, flags);
 
-	/* now we are ready to send our QP number and other stuff to other party */
-	if (!server_addr) {
-		schedule_work (&sock_accept);
-		flush_scheduled_work ();
-	}
-	else
-		exchange_info (server_addr);
+	ret = -EAGAIN;
+	ah = path_ah (rq->q.port, info->lids[p], &info->gids[p]);
+	if (!ah)
+		goto out;
 
-	if (!have_remote_info) {
-		printk (KERN_INFO "Have no remote info, give up\n");
-		return;
+	/* in the table before the response can be */
+	call->id = rq->next_id++;
+	hdr->id = cpu_to_be64 (call->id);
+	ret = rpc_post (rq, ah, info->rpc_qpns[j], info->qkey, id, sizeof (*hdr) + call->len);
+	if (!ret) {
+		rpc_pending_add (rq, call);
+		rq->stat_calls++;
 	}
+out:
+	spin_unlock_irqrestore (&rq->lock, flags);
 
-	ret = path_rec_lookup_start ();
-	if (ret) {
-		printk (KERN_INFO "path_rec lookup start failed: %d\n", ret);
-		return;
-	}
+	if (ret)
+		buf_put (send_pool, id);
+out_rcu:
+	rcu_read_unlock ();
+	return ret;
+}
+EXPORT_SYMBOL_GPL (verbs_rpc_call);
 
-	/* post receive request */
-	verbs_post_recv_req ();
 
-	mod_timer (&verbs_timer, NEXTJIFF(1));
-}
+struct rpc_sync {
+	struct completion done;
+	void *resp;
+	unsigned int *resp_len;
+	int status;
+};
 
 
-static void verbs_remove_device (struct ib_device *dev)
+static void rpc_sync_done (struct verbs_rpc_call *call, int status, const void *resp, unsigned int len)
 {
-	printk (KERN_INFO "IB remove device called. Name = %s\n", dev->name);
+	struct rpc_sync *s = call->context;
 
-	if (ah)
-		ib_destroy_ah (ah);
-	if (qp)
-		ib_destroy_qp (qp);
-	if (send_cq)
-		ib_destroy_cq (send_cq);
-	if (recv_cq)
-		ib_destroy_cq (recv_cq);
-	if (mr)
-		ib_dereg_mr (mr);
-	if (pd)
-		ib_dealloc_pd (pd);
+	if (!status && s->resp_len) {
+		len = min (len, *s->resp_len);
+		memcpy (s->resp, resp, len);
+		*s->resp_len = len;
+	}
+
+	s->status = status;
+	complete (&s->done);
 }
 
 
-static int init_qp (struct ib_qp *qp)
+int verbs_rpc_call_sync (unsigned int peer, u32 method, const void *req, unsigned int len,
+			 void *resp, unsigned int *resp_len, unsigned long timeout)
 {
-	struct ib_qp_attr qp_attr;
-	int ret, attr_mask;
-	struct ib_qp_init_attr init_attr;
+	struct verbs_rpc_call call;
+	struct rpc_sync s;
+	int ret;
 
-	memset (&qp_attr, 0, sizeof (qp_attr));
+	init_completion (&s.done);
+	s.resp = resp;
+	s.resp_len = resp ? resp_len : NULL;
 
-	qp_attr.qp_state = IB_QPS_INIT;
-	qp_attr.pkey_index = 0;
-	qp_attr.port_num = 1;
-	qp_attr.qkey = 0;
-	attr_mask = IB_QP_STATE | IB_QP_PKEY_INDEX | IB_QP_PORT | IB_QP_QKEY;
-	ret = ib_modify_qp (qp, &qp_attr, attr_mask);
-	if (ret) {
-		printk (KERN_INFO "failed to modify QP to init, ret = %d\n", ret);
-		return 1;
-	}
+	memset (&call, 0, sizeof (call));
+	call.peer = peer;
+	call.method = method;
+	call.req = req;
+	call.len = len;
+	call.timeout = timeout;
+	call.done = rpc_sync_done;
+	call.context = &s;
 
-	qp_attr.qp_state = IB_QPS_RTR;
-	/* Can't set this in a INIT->RTR transition */
-	attr_mask &= ~IB_QP_PORT;
-	ret = ib_modify_qp(qp, &qp_attr, attr_mask);
-	if (ret) {
-		printk (KERN_INFO "failed to modify QP to RTR, ret = %d\n", ret);
-		return 1;
-	}
+	ret = verbs_rpc_call (&call);
+	if (ret)
+		return ret;
 
-	qp_attr.qp_state = IB_QPS_RTS;
-	qp_attr.sq_psn = 0;
-	attr_mask |= IB_QP_SQ_PSN;
-	attr_mask &= ~IB_QP_PKEY_INDEX;
-	ret = ib_modify_qp(qp, &qp_attr, attr_mask);
-	if (ret) {
-		printk (KERN_INFO "failed to modify QP to RTS, ret = %d\n", ret);
-		return 1;
-	}
+	/* it completes by the deadline at the latest */
+	wait_for_completion (&s.done);
+	return s.status;
+}
+EXPORT_SYMBOL_GPL (verbs_rpc_call_sync);
 
-	ret = ib_query_qp (qp, &qp_attr, IB_QP_QKEY, &init_attr);
-	if (ret) {
-		printk (KERN_INFO "failed to query QP: %d\n", ret);
-		return 1;
-	}
 
-	local_info.qkey = qp_attr.qkey;
+static void rpc_lat_done (struct verbs_rpc_call *call, int status, const void *resp, unsigned int len)
+{
+	struct rpc_queue *rq = call->context;
 
-	return 0;
+	ACCESS_ONCE (rq->bench_lat) = status ? status : 1;
 }
 
 
-static void timer_func (unsigned long dummy)
+static void rpc_bench_done (struct verbs_rpc_call *call, int status, const void *resp, unsigned int len)
 {
-	struct ib_send_wr wr, *bad_wr;
-	struct ib_sge sge;
+	struct rpc_queue *rq = call->context;
+
+	if (status)
+		atomic_long_inc (&rq->bench_errors);
+	else
+		atomic_long_inc (&rq->bench_calls);
+	kfree (call);
+
+	atomic_dec (&rq->bench_out);
+	smp_mb__after_atomic_dec ();
+	if (waitqueue_active (&rq->bench_wait))
+		wake_up (&rq->bench_wait);
+}
+
+
+/* lat_rounds echo calls to the first peer one at a time, spinning for the
+ * response instead of sleeping on it */
+static void rpc_bench_latency (struct rpc_queue *rq, void *payload)
+{
+	struct verbs_rpc_call call;
+	struct lat_hist *h;
+	unsigned int i = 0;
+	ktime_t t0;
 	int ret;
-	struct ib_wc wc;
-	static int id = 1;
 
-	if (!have_path)
+	h = kzalloc (sizeof (*h), GFP_KERNEL);
+	if (!h)
 		return;
 
-	if (!have_remote_info)
-		return;
+	while (i < lat_rounds && !kthread_should_stop ()) {
+		memset (&call, 0, sizeof (call));
+		call.method = VERBS_RPC_ECHO;
+		call.req = payload;
+		call.len = rpc_size;
+		call.done = rpc_lat_done;
+		call.context = rq;
+		rq->bench_lat = 0;
+
+		t0 = ktime_get ();
+		ret = verbs_rpc_call (&call);
+		if (ret == -EAGAIN || ret == -ENOBUFS) {
+			schedule_timeout_interruptible (1);
+			continue;
+		}
+		if (ret) {
+			printk (KERN_INFO "RPC bench: call failed: %d\n", ret);
+			break;
+		}
 
-	printk (KERN_INFO "verbs_timer: sending datagram to LID = %u, qpn = %x\n", remote_info.lid, remote_info.qp_num);
+		/* the call lives on the stack: wait it out, the deadline ends it anyway */
+		while (!ACCESS_ONCE (rq->bench_lat)) {
+			if (need_resched ())
+				schedule ();
+			cpu_relax ();
+		}
+		if (rq->bench_lat < 0) {
+			printk (KERN_INFO "RPC bench: call failed: %d\n", rq->bench_lat);
+			break;
+		}
 
-	memset (&wr, 0, sizeof (wr));
-	wr.wr_id = id++;
-	wr.wr.ud.ah = ah;
-	wr.wr.ud.port_num = 1;
-	wr.wr.ud.remote_qkey = remote_info.qkey;
-	wr.wr.ud.remote_qpn = remote_info.qp_num;
-	wr.opcode = IB_WR_SEND;
-	wr.sg_list = &sge;
-	wr.send_flags = 0;
-	wr.num_sge = 1;
+		hist_record (h, ktime_to_ns (ktime_sub (ktime_get (), t0)));
+		i++;
+	}
 
-	/* sge */
-	sge.addr = send_key;
-	sge.length = buf_size;
-	sge.lkey = mr->lkey;
+	if (h->count)
+		printk (KERN_INFO "RPC bench: %llu echo calls of %u bytes, min %llu ns, mean %llu, p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+			(unsigned long long)h->count, rpc_size, (unsigned long long)h->min,
+			(unsigned long long)div64_u64 (h->sum, h->count), (unsigned long long)hist_percentile (h, 50000),
+			(unsigned long long)hist_percentile (h, 99000), (unsigned long long)hist_percentile (h, 99900),
+			(unsigned long long)h->max);
 
-	ret = ib_post_send (qp, &wr, &bad_wr);
+	kfree (h);
+}
 
-	if (ret)
-		printk (KERN_INFO "post_send failed: %d\n", ret);
-	else
-		printk (KERN_INFO "post_send succeeded\n");
 
-	ret = ib_req_notify_cq (recv_cq, IB_CQ_NEXT_COMP);
-	printk (KERN_INFO "notify_cq return %d for recv_cq\n", ret);
+/* keeps rpc_depth echo calls in flight until rpc_bench_end */
+static void rpc_bench_rate (struct rpc_queue *rq, void *payload)
+{
+	struct verbs_rpc_call *call;
+	int ret;
 
-/* 	ret = ib_req_notify_cq (send_cq, IB_CQ_NEXT_COMP); */
-/* 	printk (KERN_INFO "notify_cq return %d for send_cq\n", ret); */
+	while (time_before (jiffies, rpc_bench_end) && !kthread_should_stop ()) {
+		if (atomic_read (&rq->bench_out) >= rpc_depth) {
+			wait_event_interruptible_timeout (rq->bench_wait, atomic_read (&rq->bench_out) < rpc_depth ||
+							  kthread_should_stop (), HZ);
+			continue;
+		}
 
-	ret = ib_poll_cq (recv_cq, 1, &wc);
-	printk (KERN_INFO "poll_cq returned %d for recv_cq\n", ret);
+		call = kzalloc (sizeof (*call), GFP_KERNEL);
+		if (!call)
+			break;
+		call->method = VERBS_RPC_ECHO;
+		call->req = payload;
+		call->len = rpc_size;
+		call->done = rpc_bench_done;
+		call->context = rq;
+
+		atomic_inc (&rq->bench_out);
+		ret = verbs_rpc_call (call);
+		if (!ret)
+			continue;
 
-	if (ret) {
-		printk (KERN_INFO "ID: %llu, status: %d, opcode: %d, len: %u\n",
-			wc.wr_id, (int)wc.status, (int)wc.opcode, wc.byte_len);
-		verbs_post_recv_req ();
+		atomic_dec (&rq->bench_out);
+		kfree (call);
+		if (ret != -EAGAIN && ret != -ENOBUFS) {
+			printk (KERN_INFO "RPC bench: call failed: %d\n", ret);
+			break;
+		}
+		/* the send window is full, its completions come in the tasklet */
+		cond_resched ();
 	}
 
-	ret = ib_poll_cq (send_cq, 1, &wc);
-	printk (KERN_INFO "poll_cq returned %d for send_cq\n", ret);
-
-	mod_timer (&verbs_timer, NEXTJIFF(SEND_INTERVAL));
+	/* what is out completes, or times out */
+	wait_event (rq->bench_wait, !atomic_read (&rq->bench_out));
 }
 
 
-static int path_rec_lookup_start (void)
+/* The first thread times single calls while the others wait, then all of
+ * them pipeline calls for RPC_BENCH_SECS; the last one done reports. */
+static int rpc_bench_thread (void *data)
 {
-	int qid;
-	struct ib_sa_path_rec rec;
-	struct ib_sa_query *sa_query;
-
-	rec.dlid = cpu_to_be16 (remote_info.lid);
-	rec.slid = cpu_to_be16 (port_attr.lid);
-	rec.pkey = cpu_to_be16 (pkey);
-	rec.numb_path = 1;
+	struct rpc_queue *rq = data;
+	unsigned long calls = 0, errors = 0;
+	unsigned int i;
+	void *payload;
+	u64 ns;
+
+	payload = kmalloc (max (rpc_size, 1U), GFP_KERNEL);
+	if (payload)
+		memset (payload, 0x5a, rpc_size);
+
+	if (rq == rpc_queues) {
+		printk (KERN_INFO "RPC bench: %u threads, %u calls in flight each, %u bytes\n", nr_rpc, rpc_depth, rpc_size);
+		if (payload)
+			rpc_bench_latency (rq, payload);
+
+		rpc_bench_end = jiffies + RPC_BENCH_SECS * HZ;
+		rpc_bench_t0 = ktime_get ();
+		smp_wmb ();
+		rpc_bench_go = 1;
+		wake_up_all (&rpc_bench_wait);
+	}
+	else
+		wait_event_interruptible (rpc_bench_wait, rpc_bench_go || kthread_should_stop ());
 
-	qid = ib_sa_path_rec_get (&verbs_sa_client, ib_dev, 1, &rec, IB_SA_PATH_REC_DLID | IB_SA_PATH_REC_SLID | IB_SA_PATH_REC_PKEY | IB_SA_PATH_REC_NUMB_PATH,
-				  10000, GFP_KERNEL, verbs_path_rec_completion, NULL, &sa_query);
+	if (payload && rpc_bench_go) {
+		smp_rmb ();
+		rpc_bench_rate (rq, payload);
+	}
+	kfree (payload);
 
-	if (qid < 0) {
-		printk (KERN_INFO "path_rec_get failed: %d\n", qid);
-		sa_query = NULL;
+	if (atomic_dec_and_test (&rpc_bench_running)) {
+		ns = ktime_to_ns (ktime_sub (ktime_get (), rpc_bench_t0));
+		for (i = 0; i < nr_rpc; i++) {
+			calls += atomic_long_read (&rpc_queues[i].bench_calls);
+			errors += atomic_long_read (&rpc_queues[i].bench_errors);
+		}
+		printk (KERN_INFO "RPC bench: %lu echo calls in %llu ms, %llu calls/s, %lu failed\n",
+			calls, div64_u64 (ns, NSEC_PER_MSEC), ns ? div64_u64 ((u64)calls * NSEC_PER_SEC, ns) : 0ULL, errors);
 	}
 
+	while (!kthread_should_stop ())
+		schedule_timeout_interruptible (HZ);
 	return 0;
 }
 
 
-static void verbs_path_rec_completion (int status, struct ib_sa_path_rec *resp, void *context)
+/* the bench goes with the first peer, if it does RPC too */
+static void rpc_start (void)
 {
-	struct ib_ah_attr av;
-	int ret;
+	struct ib_side_info *remote;
+	struct rpc_queue *rq;
+	unsigned int i, n;
+
+	if (!rpc_queues || !rpc_bench)
+		return;
+
+	rcu_read_lock ();
+	remote = remote_get ();
+	n = remote ? remote->nr_rpc : 0;
+	rcu_read_unlock ();
 
-	printk (KERN_INFO "path_rec_completion called. Status = %d\n", status);
-	if (!status) {
-		if (!ib_init_ah_from_path (ib_dev, 1, resp, &av)) {
-			printk (KERN_INFO "ah: flags = %d, dlid = %d, port = %d\n", (int)av.ah_flags, (int)av.dlid, (int)av.port_num);
-			ah = ib_create_ah (pd, &av);
-			if (IS_ERR (ah)) {
-				ret = PTR_ERR (ah);
-				printk (KERN_INFO "ib_create_ah failed: %d\n", ret);
+	if (!n) {
+		printk (KERN_INFO "Peer has no RPC queues, RPC bench disabled\n");
+		return;
+	}
+
+	rpc_size = min (rpc_size, verbs_rpc_max_size ());
+	rpc_depth = max (rpc_depth, 1U);
+	atomic_set (&rpc_bench_running, nr_rpc);
+
+	for (i = 0; i < nr_rpc; i++) {
+		rq = &rpc_queues[i];
+		rq->bench_task = kthread_create (rpc_bench_thread, rq, "verbs_rpc/%u", i);
+		if (IS_ERR (rq->bench_task)) {
+			printk (KERN_INFO "RPC bench thread start failed: %ld\n", PTR_ERR (rq->bench_task));
+			rq->bench_task = NULL;
+			atomic_dec (&rpc_bench_running);
+			/* the others wait for the first */
+			if (!i)
 				return;
-			}
-			path = *resp;
-			have_path = 1;
+			continue;
 		}
+		if (rq->q.cpu >= 0)
+			kthread_bind (rq->bench_task, rq->q.cpu);
+		wake_up_process (rq->bench_task);
 	}
 }
 
 
-static void accept_work (struct work_struct *dummy)
+static struct buf_pool *buf_pool_create (size_t len, unsigned int nr, enum dma_data_direction dir)
 {
-	struct socket *c_sock = NULL;
-	int ret, len;
-	struct sockaddr_in sin;
-
-	ret = kernel_accept (sock, &c_sock, 0);
-
-	if (ret) {
-		printk (KERN_INFO "kernel_accept failed: %d\n", ret);
-		goto out;
-	}
+	struct buf_pool *p;
+	int node = dev_to_node (ib_dev->dma_device);
+	unsigned int i;
+
+	p = kzalloc (sizeof (*p), GFP_KERNEL);
+	if (!p)
+		return NULL;
+
+	spin_lock_init (&p->lock);
+	p->len = ALIGN (len, L1_CACHE_BYTES);
+	p->dir = dir;
+	p->order = max (get_order (p->len), POOL_CHUNK_ORDER);
+	p->per_chunk = (PAGE_SIZE << p->order) / p->len;
+	p->nr_chunks = DIV_ROUND_UP (nr, p->per_chunk);
+	/* the last chunk is filled up too */
+	p->nr = p->nr_chunks * p->per_chunk;
+
+	p->chunks = kcalloc (p->nr_chunks, sizeof (*p->chunks), GFP_KERNEL);
+	p->chunk_dma = kcalloc (p->nr_chunks, sizeof (*p->chunk_dma), GFP_KERNEL);
+	p->free = kcalloc (p->nr, sizeof (*p->free), GFP_KERNEL);
+	p->cache = alloc_percpu (struct pool_cache);
+	if (!p->chunks || !p->chunk_dma || !p->free || !p->cache)
+		goto err;
 
-	ret = kernel_getpeername (c_sock, (struct sockaddr*)&sin, &len);
+	for (i = 0; i < p->nr_chunks; i++) {
+		p->chunks[i] = alloc_pages_node (node, GFP_KERNEL | __GFP_ZERO, p->order);
+		if (!p->chunks[i])
+			goto err;
 
-	if (ret) {
-		printk (KERN_INFO "getpeername failed: %d\n", ret);
-		goto out;
+		p->chunk_dma[i] = ib_dma_map_page (ib_dev, p->chunks[i], 0, PAGE_SIZE << p->order, dir);
+		if (ib_dma_mapping_error (ib_dev, p->chunk_dma[i])) {
+			__free_pages (p->chunks[i], p->order);
+			p->chunks[i] = NULL;
+			goto err;
+		}
 	}
 
-	printk (KERN_INFO "Accepted connection from 0x%x\n", sin.sin_addr.s_addr);
+	/* lowest indices on top */
+	for (i = 0; i < p->nr; i++)
+		p->free[i] = p->nr - 1 - i;
+	p->nfree = p->nr;
 
-	ret = send_remote_info (c_sock, &local_info);
-	if (ret)
-		goto out;
+	return p;
+err:
+	buf_pool_destroy (p);
+	return NULL;
+}
 
-	ret = recv_remote_info (c_sock, &remote_info);
-	if (ret)
-		goto out;
 
-	have_remote_info = 1;
-	printk (KERN_INFO "Got information about remote side.\n");
-	printk (KERN_INFO "QPN: 0x%x, QKey: %u, LID: 0x%x, GID: %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
-		remote_info.qp_num, remote_info.qkey, (int)remote_info.lid,
-		remote_info.gid.raw[0], remote_info.gid.raw[1], remote_info.gid.raw[2], remote_info.gid.raw[3],
-		remote_info.gid.raw[4], remote_info.gid.raw[5], remote_info.gid.raw[6], remote_info.gid.raw[7],
-		remote_info.gid.raw[8], remote_info.gid.raw[9], remote_info.gid.raw[10], remote_info.gid.raw[10],
-		remote_info.gid.raw[12], remote_info.gid.raw[13], remote_info.gid.raw[14], remote_info.gid.raw[15]);
-out:
-	if (c_sock)
-		sock_release (c_sock);
-	if (sock)
-		sock_release (sock);
+static void buf_pool_destroy (struct buf_pool *p)
+{
+	unsigned int i;
+
+	if (p->chunks)
+		for (i = 0; i < p->nr_chunks; i++) {
+			if (!p->chunks[i])
+				continue;
+			ib_dma_unmap_page (ib_dev, p->chunk_dma[i], PAGE_SIZE << p->order, p->dir);
+			__free_pages (p->chunks[i], p->order);
+		}
 
-	c_sock = sock = NULL;
+	if (p->cache)
+		free_percpu (p->cache);
+	kfree (p->chunks);
+	kfree (p->chunk_dma);
+	kfree (p->free);
+	kfree (p);
 }
 
 
-static int send_remote_info (struct socket *sock, struct ib_side_info *info)
+/* takes a free buffer, -ENOBUFS if there is none */
+static int buf_get (struct buf_pool *p, u32 *id)
 {
-	struct msghdr hdr;
-	struct kvec iov;
-	int ret;
-
-	printk (KERN_INFO "send_remote_info\n");
-	iov.iov_base = info;
-	iov.iov_len = sizeof (*info);
-
-	memset (&hdr, 0, sizeof (hdr));
+	struct pool_cache *c;
+	unsigned long flags;
+	unsigned int n;
+	int ret = 0;
+
+	local_irq_save (flags);
+	c = per_cpu_ptr (p->cache, smp_processor_id ());
+
+	if (!c->count) {
+		spin_lock (&p->lock);
+		n = min (p->nfree, (unsigned int)POOL_CACHE / 2);
+		p->nfree -= n;
+		memcpy (c->ids, p->free + p->nfree, n * sizeof (u32));
+		c->count = n;
+		spin_unlock (&p->lock);
+	}
 
-	while (iov.iov_len) {
-		ret = kernel_sendmsg (sock, &hdr, &iov, 1, iov.iov_len);
-		if (ret < 0) {
-			printk (KERN_INFO "sock_sendmsg error: %d\n", ret);
-			return ret;
-		}
-		if (!ret)
-			break;
-		iov.iov_base += ret;
-		iov.iov_len -= ret;
+	if (c->count)
+		*id = c->ids[--c->count];
+	else {
+		p->empty++;
+		ret = -ENOBUFS;
 	}
 
-	return 0;
+	local_irq_restore (flags);
+	return ret;
 }
 
 
-static int recv_remote_info (struct socket *sock, struct ib_side_info *info)
+static void buf_put (struct buf_pool *p, u32 id)
 {
-	struct msghdr hdr;
-	struct kvec iov;
-	int ret;
+	struct pool_cache *c;
+	unsigned long flags;
+	unsigned int n = POOL_CACHE / 2;
+
+	local_irq_save (flags);
+	c = per_cpu_ptr (p->cache, smp_processor_id ());
+
+	if (c->count == POOL_CACHE) {
+		spin_lock (&p->lock);
+		c->count -= n;
+		memcpy (p->free + p->nfree, c->ids + c->count, n * sizeof (u32));
+		p->nfree += n;
+		spin_unlock (&p->lock);
+	}
 
-	printk (KERN_INFO "recv_remote_info\n");
+	c->ids[c->count++] = id;
+	local_irq_restore (flags);
+}
 
-	/* receive remote info */
-	memset (&hdr, 0, sizeof (hdr));
 
-	iov.iov_base = info;
-	iov.iov_len = sizeof (*info);
+static u64 buf_dma (struct buf_pool *p, u32 id)
+{
+	return p->chunk_dma[id / p->per_chunk] + (u64)(id % p->per_chunk) * p->len;
+}
 
-	while (iov.iov_len) {
-		ret = kernel_recvmsg (sock, &hdr, &iov, 1, iov.iov_len, 0);
-		if (ret < 0) {
-			printk (KERN_INFO "sock_recvmsg failed: %d\n", ret);
-			return ret;
-		}
-		if (!ret)
-			break;
-		iov.iov_base += ret;
-		iov.iov_len -= ret;
-	}
 
-	return 0;
+static void *buf_addr (struct buf_pool *p, u32 id)
+{
+	return page_address (p->chunks[id / p->per_chunk]) + (id % p->per_chunk) * p->len;
 }
 
 
-static int exchange_info (unsigned int addr)
+/* hands what the CPU wrote over to the device */
+static void buf_sync (struct buf_pool *p, u32 id, size_t len)
 {
-	struct socket *sock = NULL;
-	struct sockaddr_in sin;
-	int ret;
+	ib_dma_sync_single_for_device (ib_dev, buf_dma (p, id), len, p->dir);
+}
 
-	ret = sock_create (AF_INET, SOCK_STREAM, 0, &sock);
-	if (ret) {
-		printk (KERN_INFO "Sock create failed: %d\n", ret);
-		goto err;
-	}
 
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons (PORT);
-	sin.sin_addr.s_addr = htonl (server_addr);
+static struct recv_ring *recv_ring_alloc (void)
+{
+	struct recv_ring *r;
 
-	printk (KERN_INFO "Trying to connect to 0x%x\n", server_addr);
+	r = kzalloc (sizeof (*r), GFP_KERNEL);
+	if (!r)
+		return NULL;
 
-	ret = kernel_connect (sock, (struct sockaddr*)&sin, sizeof (sin), 0);
-	if (ret) {
-		printk (KERN_INFO "Connect failed: %d\n", ret);
-		goto err;
+	spin_lock_init (&r->lock);
+	r->low = recv_depth;
+
+	r->wrs = kcalloc (recv_depth, sizeof (*r->wrs), GFP_KERNEL);
+	r->sges = kcalloc (recv_depth, sizeof (*r->sges), GFP_KERNEL);
+	if (!r->wrs || !r->sges) {
+		recv_ring_free (r);
+		return NULL;
 	}
 
-	ret = recv_remote_info (sock, &remote_info);
-	if (ret)
-		goto err;
-	ret = send_remote_info (sock, &local_info);
-	if (ret)
-		goto err;
+	return r;
+}
 
-	have_remote_info = 1;
-	printk (KERN_INFO "Got information about remote side.\n");
-	printk (KERN_INFO "QPN: 0x%x, QKey: %u, LID: 0x%x, GID: %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
-		remote_info.qp_num, remote_info.qkey, remote_info.lid,
-		remote_info.gid.raw[0], remote_info.gid.raw[1], remote_info.gid.raw[2], remote_info.gid.raw[3],
-		remote_info.gid.raw[4], remote_info.gid.raw[5], remote_info.gid.raw[6], remote_info.gid.raw[7],
-		remote_info.gid.raw[8], remote_info.gid.raw[9], remote_info.gid.raw[10], remote_info.gid.raw[10],
-		remote_info.gid.raw[12], remote_info.gid.raw[13], remote_info.gid.raw[14], remote_info.gid.raw[15]);
 
-err:
-	if (sock)
-		sock_release (sock);
-	return ret;
+/* buffers still posted belong to the pool, which goes away after us */
+static void recv_ring_free (struct recv_ring *r)
+{
+	kfree (r->wrs);
+	kfree (r->sges);
+	kfree (r);
 }
 
 
-static void verbs_post_recv_req (void)
+/* tops the ring up to recv_depth with one chained post */
+static void recv_refill (struct recv_ring *r)
 {
-	struct ib_recv_wr wr, *bad_wr;
-	struct ib_sge sge;
+	struct ib_recv_wr *bad_wr;
+	unsigned int i, n = recv_depth - r->posted;
+	u32 id;
 	int ret;
-	static int id = 1;
 
-	memset (&wr, 0, sizeof (wr));
-	wr.wr_id = id++;
-	wr.num_sge = 1;
-	wr.sg_list = &sge;
+	/* the QP is being moved to another port */
+	if (!r->srq && !r->qp)
+		return;
 
-	sge.addr = recv_key;
-	sge.length = buf_size + 40;
-	sge.lkey = mr->lkey;
+	for (i = 0; i < n; i++) {
+		if (buf_get (recv_pool, &id))
+			break;
 
-	ret = ib_post_recv (qp, &wr, &bad_wr);
+		r->sges[i].addr = buf_dma (recv_pool, id);
+		r->sges[i].length = recv_pool->len;
+		r->sges[i].lkey = mr->lkey;
 
-	if (ret)
-		printk (KERN_INFO "post_recv failed: %d\n", ret);
-}
+		memset (&r->wrs[i], 0, sizeof (r->wrs[i]));
+		r->wrs[i].wr_id = id;
+		r->wrs[i].sg_list = &r->sges[i];
+		r->wrs[i].num_sge = 1;
+		r->wrs[i].next = &r->wrs[i+1];
+	}
+
+	n = i;
+	if (!n)
+		return;
+	r->wrs[n-1].next = NULL;
+
+	if (r->srq)
+		ret = ib_post_srq_recv (r->srq, r->wrs, &bad_wr);
+	else
+		ret = ib_post_recv (r->qp, r->wrs, &bad_wr);
 
+	/* the WRs in front of the bad one are posted, the rest go back */
+	if (ret) {
+		printk (KERN_INFO "post_recv failed: %d\n", ret);
+		for (i = bad_wr - r->wrs; i < n; i++)
+			buf_put (recv_pool, r->wrs[i].wr_id);
+		n = bad_wr - r->wrs;
+	}
 
+	r->posted += n;
+	r->refills++;
+}
 
 
 static struct ib_client client = {
@@ -673,11 +4794,28 @@ static int __init verbs_init (void)
 		return -EINVAL;
 	}
 
+	if (suite) {
+		dbg_dir = debugfs_create_dir ("verbs", NULL);
+		if (dbg_dir) {
+			debugfs_create_u32 ("transport", 0644, dbg_dir, &bench_transport);
+			debugfs_create_u32 ("size", 0644, dbg_dir, &bench_size);
+			debugfs_create_u32 ("depth", 0644, dbg_dir, &bench_depth);
+			debugfs_create_u32 ("iters", 0644, dbg_dir, &bench_iters);
+			debugfs_create_file ("run", 0200, dbg_dir, NULL, &bench_run_fops);
+			debugfs_create_file ("results", 0444, dbg_dir, NULL, &bench_results_fops);
+		}
+	}
+
 	/* register Subnet Administrator client` */
 	ib_sa_register_client(&verbs_sa_client);
 
 	if (ib_register_client (&client)) {
 		printk (KERN_WARNING "IB client registration failed. Is IB modules loaded?\n");
+		/* the module is gone on return, nothing may point into it */
+		debugfs_remove_recursive (dbg_dir);
+		ib_sa_unregister_client(&verbs_sa_client);
+		if (sock)
+			sock_release (sock);
 		return -ENODEV;
 	}
 
@@ -687,6 +4825,7 @@ static int __init verbs_init (void)
 
 static void __exit verbs_exit (void)
 {
+	debugfs_remove_recursive (dbg_dir);
 	if (sock)
 		sock_release (sock);
 	del_timer (&verbs_timer);
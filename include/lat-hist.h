@@ -0,0 +1,109 @@
+/* Log-linear (HDR style) latency histogram, shared by the test modules.
+ *
+ * Values below HIST_SUB are kept exactly, above that every power of two is
+ * split into HIST_SUB linear buckets, so a recorded value is within
+ * 1/HIST_SUB of the real one. Not locked: one writer per histogram, merge
+ * them afterwards. */
+
+#ifndef __LAT_HIST_H
+#define __LAT_HIST_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(HIST_SUB * (65 - HIST_SUB_BITS))
+
+struct lat_hist {
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u32 buckets[HIST_BUCKETS];
+};
+
+
+static inline unsigned int hist_index (u64 v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	e = fls64 (v) - 1 - HIST_SUB_BITS;
+	return HIST_SUB + e * HIST_SUB + ((v >> e) & (HIST_SUB - 1));
+}
+
+
+/* highest value which lands in bucket idx */
+static inline u64 hist_value (unsigned int idx)
+{
+	unsigned int e, sub;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	e = (idx - HIST_SUB) / HIST_SUB;
+	sub = (idx - HIST_SUB) % HIST_SUB;
+	return ((u64)(HIST_SUB + sub + 1) << e) - 1;
+}
+
+
+static inline void hist_record (struct lat_hist *h, u64 v)
+{
+	if (!h->count || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->buckets[hist_index (v)]++;
+}
+
+
+static inline void hist_merge (struct lat_hist *dst, struct lat_hist *src)
+{
+	unsigned int i;
+
+	if (!src->count)
+		return;
+
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+
+/* p is in units of 1/1000 percent, 99900 is p99.9 */
+static inline u64 hist_percentile (struct lat_hist *h, unsigned int p)
+{
+	u64 target, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = div64_u64 (h->count * p + 99999, 100000);
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			return min (hist_value (i), h->max);
+	}
+
+	return h->max;
+}
+
+
+#endif /* __LAT_HIST_H */
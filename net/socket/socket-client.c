@@ -2,51 +2,240 @@
 #include <linux/kernel.h>
 #include <linux/in.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/tcp.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
 
 #include <net/sock.h>
+#include <net/tcp_states.h>
 
-#define PORT 12345
+#include "lat-hist.h"
+#include "socket-proto.h"
 
-static int do_connect (void);
+
+enum bench_mode {
+	BENCH_NONE,
+	BENCH_SINK,		/* stream to the server */
+	BENCH_PULL,		/* stream from the server */
+	BENCH_PINGPONG,		/* request/response round trips */
+	BENCH_UDP,		/* datagrams to the server's UDP port */
+};
+
+#define UDP_SNDBUF	(4 << 20)
+
+
+static int do_connect (struct socket **res);
+static int do_hello (struct socket *sock, struct frame_rx *rx, u32 op, u32 flags, u32 size, u64 total);
+static int run_bench (void);
+static int pool_open (void);
+static void pool_close (void);
 
 
 static unsigned int server_addr;
 module_param (server_addr, uint, 0644);
 MODULE_PARM_DESC (server_addr, "server address. If specified, start both client and server.");
 
+static int bench;
+module_param (bench, int, 0444);
+MODULE_PARM_DESC (bench, "benchmark: 0 - hello only, 1 - stream to the server, 2 - stream from the server, 3 - ping-pong latency, 4 - UDP datagrams.");
+
+static unsigned int msg_size = 65536;
+module_param (msg_size, uint, 0444);
+MODULE_PARM_DESC (msg_size, "message (frame payload) size in benchmark mode, recv size when pulling, datagram size over UDP.");
+
+static unsigned int batch = 1;
+module_param (batch, uint, 0444);
+MODULE_PARM_DESC (batch, "messages coalesced into one send call when streaming to the server, datagrams sent between the end of run checks over UDP.");
+
+static unsigned long total_bytes;
+module_param (total_bytes, ulong, 0444);
+MODULE_PARM_DESC (total_bytes, "bytes to move per stream. 0 means run for 'duration' seconds.");
+
+static unsigned int duration = 10;
+module_param (duration, uint, 0444);
+MODULE_PARM_DESC (duration, "benchmark duration in seconds, used when total_bytes is 0.");
+
+static unsigned int streams = 1;
+module_param (streams, uint, 0444);
+MODULE_PARM_DESC (streams, "number of parallel benchmark connections.");
+
+static int pull_path;
+module_param (pull_path, int, 0444);
+MODULE_PARM_DESC (pull_path, "server send path when pulling: 0 - server default, 1 - zero-copy, 2 - copy.");
+
+static unsigned int iterations = 10000;
+module_param (iterations, uint, 0444);
+MODULE_PARM_DESC (iterations, "round trips per stream in ping-pong mode.");
+
+static unsigned int busy_poll;
+module_param (busy_poll, uint, 0444);
+MODULE_PARM_DESC (busy_poll, "ping-pong: also run a busy-polling pass, spinning up to this many microseconds per reply on both ends. 0 - interrupt-driven only.");
+
+static unsigned int pool_size;
+module_param (pool_size, uint, 0444);
+MODULE_PARM_DESC (pool_size, "persistent ECHO connections kept open to the server. Ping-pong takes one per round trip.");
+
+static unsigned int pool_check_ms = 1000;
+module_param (pool_check_ms, uint, 0644);
+MODULE_PARM_DESC (pool_check_ms, "connection pool health check interval, ms.");
+
+static unsigned int connect_timeout = 5;
+module_param (connect_timeout, uint, 0644);
+MODULE_PARM_DESC (connect_timeout, "pool connect timeout, and send and receive timeout of pool sockets, seconds.");
+
+
+/* Persistent connection pool. Connections are homed round-robin on online
+ * CPUs; a caller claims an idle one with a cmpxchg on its state, trying its
+ * own CPU's connections first, so the fast path takes no lock. */
+enum pool_state {
+	POOL_DEAD,		/* needs (re)connect */
+	POOL_CONNECTING,
+	POOL_IDLE,
+	POOL_BUSY,		/* handed out, or being checked */
+};
+
+struct pool_conn {
+	struct socket *sock;
+	struct frame_rx rx;
+	atomic_t state;
+	struct completion connected;
+	void (*saved_state_change) (struct sock *);
+	unsigned long uses;
+};
+
+static struct pool_conn *pool;
+static unsigned int pool_ncpus;
+static DEFINE_PER_CPU (unsigned int, pool_slot);
+
+static atomic_t pool_gets = ATOMIC_INIT (0);
+static atomic_t pool_steals = ATOMIC_INIT (0);
+static atomic_t pool_waits = ATOMIC_INIT (0);
+static atomic_t pool_reconnects = ATOMIC_INIT (0);
+
+static void pool_check_work (struct work_struct *);
+
+/* the check reconnects, and blocks doing it: not on the shared workqueue */
+static struct workqueue_struct *pool_wq;
+static DECLARE_DELAYED_WORK (pool_check, pool_check_work);
+
+
+/* one benchmark connection, run by its own thread */
+struct bench_stream {
+	unsigned int id;
+	int busy;
+	struct completion done;
+	int ret;
+	u64 bytes;
+	u64 msgs;
+	u64 ns;
+	u64 cpu_ns;
+	struct lat_hist *hist;
+};
+
+
+/* latency of the last ping-pong run, shown in debugfs, interrupt-driven and
+ * busy-polling */
+static struct lat_hist *lat_result;
+static struct lat_hist *lat_busy;
+static DEFINE_MUTEX (lat_lock);
+
+static struct dentry *dbg_dir;
+
+static int latency_open (struct inode *inode, struct file *file);
+static int pool_stat_open (struct inode *inode, struct file *file);
+
+static const struct file_operations latency_fops = {
+	.owner = THIS_MODULE,
+	.open = latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations pool_fops = {
+	.owner = THIS_MODULE,
+	.open = pool_stat_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 
 
 static int __init sc_init (void)
 {
+	struct socket *sock;
+	struct frame_rx rx;
 	int ret;
 
 	printk (KERN_INFO "Socket test module: client side\n");
 	printk (KERN_INFO "server_addr = %x\n", server_addr);
 
-	ret = do_connect ();
+	if (bench || pool_size) {
+		dbg_dir = debugfs_create_dir ("socket_client", NULL);
+		if (dbg_dir) {
+			debugfs_create_file ("latency", 0444, dbg_dir, &lat_result, &latency_fops);
+			debugfs_create_file ("latency_busy", 0444, dbg_dir, &lat_busy, &latency_fops);
+			debugfs_create_file ("pool", 0444, dbg_dir, NULL, &pool_fops);
+		}
+
+		ret = pool_size ? pool_open () : 0;
+		if (!ret && bench)
+			ret = run_bench ();
+		if (ret) {
+			debugfs_remove_recursive (dbg_dir);
+			pool_close ();
+			kfree (lat_result);
+			kfree (lat_busy);
+		}
+		return ret;
+	}
+
+	ret = do_connect (&sock);
 	if (ret) {
 		printk (KERN_INFO "do_connect failed: %d\n", ret);
 		return ret;
 	}
 
-	return 0;
+	ret = frame_rx_init (&rx, 256);
+	if (!ret) {
+		ret = do_hello (sock, &rx, SOCK_OP_NONE, 0, 0, 0);
+		if (ret)
+			printk (KERN_INFO "hello exchange failed: %d\n", ret);
+		frame_rx_free (&rx);
+	}
+
+	sock_release (sock);
+	return ret;
 }
 
 
 static void __exit sc_exit (void)
 {
 	printk (KERN_INFO "Socket client test module unload\n");
+	debugfs_remove_recursive (dbg_dir);
+	pool_close ();
+	kfree (lat_result);
+	kfree (lat_busy);
 }
 
 
-static int do_connect (void)
+static int do_connect (struct socket **res)
 {
-	struct socket *sock;
+	struct socket *sock = NULL;
 	struct sockaddr_in sin;
 	int ret;
 
-	printk (KERN_INFO "connect_work thread started\n");
-
 	ret = sock_create (AF_INET, SOCK_STREAM, 0, &sock);
 	if (ret) {
 		printk (KERN_INFO "Sock create failed: %d\n", ret);
@@ -66,6 +255,7 @@ static int do_connect (void)
 	}
 
 	printk (KERN_INFO "Client thread connected to 0x%x\n", server_addr);
+	*res = sock;
 	return 0;
 err:
 	if (sock)
@@ -74,6 +264,880 @@ err:
 }
 
 
+/* blocks until a whole frame has arrived */
+static int recv_frame (struct socket *sock, struct frame_rx *rx, void **data, u32 *len)
+{
+	int ret;
+
+	for (;;) {
+		ret = frame_next (rx, data, len);
+		if (ret)
+			return ret < 0 ? ret : 0;
+
+		ret = frame_fill (sock, rx, 0);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -ECONNRESET;
+	}
+}
+
+
+/* server's hello, then ours and the request in one batch */
+static int do_hello (struct socket *sock, struct frame_rx *rx, u32 op, u32 flags, u32 size, u64 total)
+{
+	char buf[HELLO_LEN+1];
+	struct sock_req req;
+	struct kvec msgs[2];
+	void *data;
+	u32 len;
+	int ret;
+
+	ret = recv_frame (sock, rx, &data, &len);
+	if (ret)
+		return ret;
+	if (len != HELLO_LEN)
+		return -EPROTO;
+
+	memcpy (buf, data, HELLO_LEN);
+	buf[HELLO_LEN] = 0;
+	printk (KERN_INFO "Got: %s\n", buf);
+
+	memset (&req, 0, sizeof (req));
+	req.magic = htonl (SOCK_REQ_MAGIC);
+	req.op = htonl (op);
+	req.flags = htonl (flags);
+	req.msg_size = htonl (size);
+	req.total = cpu_to_be64 (total);
+
+	msgs[0].iov_base = (char *)HELLO_MSG;
+	msgs[0].iov_len = HELLO_LEN;
+	msgs[1].iov_base = &req;
+	msgs[1].iov_len = sizeof (req);
+
+	return frame_send_batch (sock, msgs, 2, 0);
+}
+
+
+static void pool_state_change (struct sock *sk)
+{
+	struct pool_conn *c;
+	void (*saved) (struct sock *) = NULL;
+
+	read_lock (&sk->sk_callback_lock);
+	c = sk->sk_user_data;
+	if (c) {
+		saved = c->saved_state_change;
+		if (sk->sk_state != TCP_SYN_SENT)
+			complete (&c->connected);
+	}
+	read_unlock (&sk->sk_callback_lock);
+
+	if (saved)
+		saved (sk);
+}
+
+
+/* kicks off a non-blocking connect, pool_connect_finish() waits for it */
+static int pool_connect_start (struct pool_conn *c)
+{
+	struct sockaddr_in sin;
+	struct timeval tv;
+	struct sock *sk;
+	int ret;
+
+	init_completion (&c->connected);
+
+	ret = sock_create (AF_INET, SOCK_STREAM, 0, &c->sock);
+	if (ret) {
+		c->sock = NULL;
+		return ret;
+	}
+
+	/* a server which accepts and then says nothing fails the hello */
+	tv.tv_sec = connect_timeout;
+	tv.tv_usec = 0;
+	kernel_setsockopt (c->sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof (tv));
+	kernel_setsockopt (c->sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof (tv));
+
+	sk = c->sock->sk;
+	write_lock_bh (&sk->sk_callback_lock);
+	c->saved_state_change = sk->sk_state_change;
+	sk->sk_user_data = c;
+	sk->sk_state_change = pool_state_change;
+	write_unlock_bh (&sk->sk_callback_lock);
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons (PORT);
+	sin.sin_addr.s_addr = htonl (server_addr);
+
+	ret = kernel_connect (c->sock, (struct sockaddr*)&sin, sizeof (sin), O_NONBLOCK);
+	if (ret == -EINPROGRESS)
+		return 0;
+	if (!ret)
+		complete (&c->connected);
+
+	return ret;
+}
+
+
+static int pool_connect_finish (struct pool_conn *c)
+{
+	struct sock *sk = c->sock->sk;
+	int ret, one = 1;
+
+	wait_for_completion_timeout (&c->connected, connect_timeout * HZ);
+
+	write_lock_bh (&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	sk->sk_state_change = c->saved_state_change;
+	write_unlock_bh (&sk->sk_callback_lock);
+
+	if (sk->sk_state != TCP_ESTABLISHED)
+		return sk->sk_err ? -sk->sk_err : -ETIMEDOUT;
+
+	kernel_setsockopt (c->sock, SOL_TCP, TCP_NODELAY, (char *)&one, sizeof (one));
+
+	ret = frame_rx_init (&c->rx, 2 * (msg_size + SOCK_FRAME_HDR));
+	if (ret)
+		return ret;
+
+	return do_hello (c->sock, &c->rx, SOCK_OP_ECHO, 0, msg_size, 0);
+}
+
+
+static void pool_conn_release (struct pool_conn *c)
+{
+	if (c->sock)
+		sock_release (c->sock);
+	frame_rx_free (&c->rx);
+	c->sock = NULL;
+}
+
+
+/* Connects every POOL_CONNECTING connection: all connects are started first
+ * and then waited for, so they proceed in parallel. */
+static unsigned int pool_connect_all (void)
+{
+	unsigned int i, up = 0;
+	int ret;
+
+	for (i = 0; i < pool_size; i++) {
+		if (atomic_read (&pool[i].state) != POOL_CONNECTING)
+			continue;
+		ret = pool_connect_start (&pool[i]);
+		if (ret) {
+			printk (KERN_INFO "pool connect %u failed: %d\n", i, ret);
+			pool_conn_release (&pool[i]);
+			atomic_set (&pool[i].state, POOL_DEAD);
+		}
+	}
+
+	for (i = 0; i < pool_size; i++) {
+		if (atomic_read (&pool[i].state) != POOL_CONNECTING)
+			continue;
+		ret = pool_connect_finish (&pool[i]);
+		if (ret) {
+			printk (KERN_INFO "pool connect %u failed: %d\n", i, ret);
+			pool_conn_release (&pool[i]);
+			atomic_set (&pool[i].state, POOL_DEAD);
+			continue;
+		}
+		atomic_set (&pool[i].state, POOL_IDLE);
+		up++;
+	}
+
+	return up;
+}
+
+
+static int pool_open (void)
+{
+	unsigned int i, cpu, up;
+
+	if (!msg_size || msg_size > SOCK_FRAME_MAX)
+		return -EINVAL;
+
+	pool_wq = create_singlethread_workqueue ("sock_pool");
+	if (!pool_wq)
+		return -ENOMEM;
+
+	pool = kcalloc (pool_size, sizeof (*pool), GFP_KERNEL);
+	if (!pool) {
+		destroy_workqueue (pool_wq);
+		pool_wq = NULL;
+		return -ENOMEM;
+	}
+
+	/* slot of each CPU among the online ones, connection i lives on slot
+	 * i % pool_ncpus */
+	pool_ncpus = 0;
+	for_each_online_cpu (cpu)
+		per_cpu (pool_slot, cpu) = pool_ncpus++;
+
+	for (i = 0; i < pool_size; i++)
+		atomic_set (&pool[i].state, POOL_CONNECTING);
+
+	up = pool_connect_all ();
+	printk (KERN_INFO "Connection pool: %u of %u connections up\n", up, pool_size);
+
+	if (!up) {
+		kfree (pool);
+		pool = NULL;
+		destroy_workqueue (pool_wq);
+		pool_wq = NULL;
+		return -ECONNREFUSED;
+	}
+
+	queue_delayed_work (pool_wq, &pool_check, msecs_to_jiffies (pool_check_ms));
+	return 0;
+}
+
+
+static void pool_close (void)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	cancel_delayed_work_sync (&pool_check);
+	destroy_workqueue (pool_wq);
+	pool_wq = NULL;
+
+	for (i = 0; i < pool_size; i++)
+		pool_conn_release (&pool[i]);
+
+	kfree (pool);
+	pool = NULL;
+}
+
+
+static struct pool_conn *pool_try (unsigned int first, unsigned int step)
+{
+	unsigned int i;
+
+	for (i = first; i < pool_size; i += step)
+		if (atomic_cmpxchg (&pool[i].state, POOL_IDLE, POOL_BUSY) == POOL_IDLE)
+			return &pool[i];
+
+	return NULL;
+}
+
+
+/* an idle connection, preferably one homed on this CPU */
+static struct pool_conn *pool_get (void)
+{
+	struct pool_conn *c;
+	unsigned int slot;
+
+	slot = get_cpu_var (pool_slot);
+	put_cpu_var (pool_slot);
+
+	atomic_inc (&pool_gets);
+
+	c = pool_try (slot % pool_ncpus, pool_ncpus);
+	if (c)
+		return c;
+
+	c = pool_try (0, 1);
+	if (c)
+		atomic_inc (&pool_steals);
+
+	return c;
+}
+
+
+static struct pool_conn *pool_get_wait (void)
+{
+	struct pool_conn *c;
+
+	while (!(c = pool_get ())) {
+		atomic_inc (&pool_waits);
+		schedule_timeout_uninterruptible (1);
+	}
+
+	c->uses++;
+	return c;
+}
+
+
+/* a failed connection is left for the health check to reconnect */
+static void pool_put (struct pool_conn *c, int failed)
+{
+	smp_mb ();
+	atomic_set (&c->state, failed ? POOL_DEAD : POOL_IDLE);
+}
+
+
+/* Idle connections the server has closed or reset are found here, and every
+ * dead connection gets reconnected. */
+static void pool_check_work (struct work_struct *dummy)
+{
+	struct pool_conn *c;
+	struct sock *sk;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < pool_size; i++) {
+		c = &pool[i];
+
+		if (atomic_cmpxchg (&c->state, POOL_IDLE, POOL_BUSY) == POOL_IDLE) {
+			sk = c->sock->sk;
+			/* an idle ECHO connection never has anything to read */
+			if (sk->sk_state == TCP_ESTABLISHED && !sk->sk_err &&
+			    skb_queue_empty (&sk->sk_receive_queue)) {
+				atomic_set (&c->state, POOL_IDLE);
+				continue;
+			}
+			atomic_set (&c->state, POOL_DEAD);
+		}
+
+		if (atomic_cmpxchg (&c->state, POOL_DEAD, POOL_CONNECTING) == POOL_DEAD) {
+			pool_conn_release (c);
+			n++;
+		}
+	}
+
+	if (n) {
+		atomic_add (n, &pool_reconnects);
+		pool_connect_all ();
+	}
+
+	queue_delayed_work (pool_wq, &pool_check, msecs_to_jiffies (pool_check_ms));
+}
+
+
+static int run_stream (struct bench_stream *st)
+{
+	struct socket *sock;
+	struct msghdr hdr;
+	struct kvec iov, msgs[SOCK_FRAME_BATCH];
+	struct frame_rx rx;
+	unsigned long end = jiffies + duration * HZ;
+	u64 cpu_start, queued;
+	ktime_t start;
+	char *buf;
+	size_t len;
+	unsigned int n;
+	u32 flags = 0;
+	int ret, more;
+
+	buf = kmalloc (msg_size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	memset (buf, 'x', msg_size);
+
+	ret = frame_rx_init (&rx, 256);
+	if (ret)
+		goto out_buf;
+
+	ret = do_connect (&sock);
+	if (ret)
+		goto out_rx;
+
+	if (pull_path == 1)
+		flags = SOCK_REQ_ZCOPY;
+	else if (pull_path == 2)
+		flags = SOCK_REQ_COPY;
+
+	ret = do_hello (sock, &rx, bench == BENCH_SINK ? SOCK_OP_SINK : SOCK_OP_PULL, flags, 0, total_bytes);
+	if (ret)
+		goto out;
+
+	cpu_start = current->se.sum_exec_runtime;
+	start = ktime_get ();
+
+	if (bench == BENCH_SINK) {
+		while (total_bytes ? st->bytes < total_bytes : time_before (jiffies, end)) {
+			queued = 0;
+			for (n = 0; n < batch; n++) {
+				len = msg_size;
+				if (total_bytes) {
+					if (st->bytes + queued >= total_bytes)
+						break;
+					if (total_bytes - st->bytes - queued < len)
+						len = total_bytes - st->bytes - queued;
+				}
+				msgs[n].iov_base = buf;
+				msgs[n].iov_len = len;
+				queued += len;
+			}
+
+			/* only the very last batch of a sized run goes out uncorked */
+			more = !total_bytes || st->bytes + queued < total_bytes;
+
+			ret = frame_send_batch (sock, msgs, n, more);
+			if (ret)
+				break;
+
+			st->bytes += queued;
+			st->msgs += n;
+		}
+
+		frame_flush (sock);
+	}
+	else {
+		memset (&hdr, 0, sizeof (hdr));
+
+		for (;;) {
+			iov.iov_base = buf;
+			iov.iov_len = msg_size;
+
+			ret = kernel_recvmsg (sock, &hdr, &iov, 1, msg_size, 0);
+			if (ret <= 0)
+				break;
+
+			st->bytes += ret;
+			st->msgs++;
+
+			if (!total_bytes && time_after_eq (jiffies, end))
+				break;
+		}
+	}
+
+	st->ns = ktime_to_ns (ktime_sub (ktime_get (), start));
+	st->cpu_ns = current->se.sum_exec_runtime - cpu_start;
+
+out:
+	sock_release (sock);
+out_rx:
+	frame_rx_free (&rx);
+out_buf:
+	kfree (buf);
+	return ret < 0 ? ret : 0;
+}
+
+
+/* one request/response, returns the round trip time in ns in *rtt */
+static int round_trip (struct socket *sock, struct frame_rx *rx, char *buf, int busy, u64 *rtt)
+{
+	struct kvec msg;
+	ktime_t t0;
+	void *data;
+	u32 len;
+	int ret;
+
+	t0 = ktime_get ();
+
+	msg.iov_base = buf;
+	msg.iov_len = msg_size;
+
+	ret = frame_send_batch (sock, &msg, 1, 0);
+	if (ret)
+		return ret;
+	/* the reply is normally in by the time the spin gives up */
+	if (busy)
+		frame_busy_wait (sock, busy_poll);
+	ret = recv_frame (sock, rx, &data, &len);
+	if (ret)
+		return ret;
+	if (len != msg_size)
+		return -EPROTO;
+
+	*rtt = ktime_to_ns (ktime_sub (ktime_get (), t0));
+	return 0;
+}
+
+
+/* ping-pong over pooled connections, a fresh claim for every round trip */
+static int run_pingpong_pool (struct bench_stream *st, char *buf)
+{
+	struct pool_conn *c;
+	unsigned int i;
+	u64 rtt;
+	int ret = 0;
+
+	for (i = 0; i < iterations; i++) {
+		c = pool_get_wait ();
+		ret = round_trip (c->sock, &c->rx, buf, 0, &rtt);
+		pool_put (c, ret);
+		if (ret)
+			break;
+
+		hist_record (st->hist, rtt);
+		st->bytes += msg_size;
+		st->msgs++;
+	}
+
+	return ret;
+}
+
+
+static int run_pingpong (struct bench_stream *st)
+{
+	struct socket *sock;
+	struct frame_rx rx;
+	u64 cpu_start, rtt;
+	ktime_t start;
+	char *buf;
+	unsigned int i;
+	int ret, one = 1;
+
+	buf = kmalloc (msg_size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	memset (buf, 'x', msg_size);
+
+	/* pooled connections are set up sleeping, the busy pass has its own */
+	if (pool && !st->busy) {
+		cpu_start = current->se.sum_exec_runtime;
+		start = ktime_get ();
+
+		ret = run_pingpong_pool (st, buf);
+
+		st->ns = ktime_to_ns (ktime_sub (ktime_get (), start));
+		st->cpu_ns = current->se.sum_exec_runtime - cpu_start;
+		kfree (buf);
+		return ret;
+	}
+
+	ret = frame_rx_init (&rx, 2 * (msg_size + SOCK_FRAME_HDR));
+	if (ret)
+		goto out_buf;
+
+	ret = do_connect (&sock);
+	if (ret)
+		goto out_rx;
+
+	kernel_setsockopt (sock, SOL_TCP, TCP_NODELAY, (char *)&one, sizeof (one));
+
+	ret = do_hello (sock, &rx, SOCK_OP_ECHO, st->busy ? SOCK_REQ_BUSY_POLL : 0, msg_size, 0);
+	if (ret)
+		goto out;
+
+	cpu_start = current->se.sum_exec_runtime;
+	start = ktime_get ();
+
+	for (i = 0; i < iterations; i++) {
+		ret = round_trip (sock, &rx, buf, st->busy, &rtt);
+		if (ret)
+			break;
+
+		hist_record (st->hist, rtt);
+		st->bytes += msg_size;
+		st->msgs++;
+	}
+
+	st->ns = ktime_to_ns (ktime_sub (ktime_get (), start));
+	st->cpu_ns = current->se.sum_exec_runtime - cpu_start;
+
+out:
+	sock_release (sock);
+out_rx:
+	frame_rx_free (&rx);
+out_buf:
+	kfree (buf);
+	return ret;
+}
+
+
+/* Datagrams of msg_size over a connected UDP socket, so the route is looked
+ * up once. One send call per datagram, 'batch' of them between the checks
+ * for the end of the run.
+ * ENOBUFS from a full queue is a dropped datagram, not an error. */
+static int run_udp (struct bench_stream *st)
+{
+	struct socket *sock;
+	struct sockaddr_in sin;
+	struct sock_dgram *d;
+	struct msghdr hdr;
+	struct kvec iov;
+	unsigned long end = jiffies + duration * HZ;
+	u64 cpu_start, seq = 0, drops = 0;
+	ktime_t start;
+	unsigned int n;
+	char *buf;
+	int ret, val;
+
+	buf = kmalloc (msg_size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	memset (buf, 'x', msg_size);
+
+	d = (struct sock_dgram *)buf;
+	d->magic = htonl (SOCK_DGRAM_MAGIC);
+	d->stream = htonl (st->id);
+
+	ret = sock_create (AF_INET, SOCK_DGRAM, IPPROTO_UDP, &sock);
+	if (ret)
+		goto out_buf;
+
+	val = UDP_SNDBUF;
+	kernel_setsockopt (sock, SOL_SOCKET, SO_SNDBUFFORCE, (char *)&val, sizeof (val));
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons (PORT);
+	sin.sin_addr.s_addr = htonl (server_addr);
+
+	ret = kernel_connect (sock, (struct sockaddr*)&sin, sizeof (sin), 0);
+	if (ret)
+		goto out;
+
+	memset (&hdr, 0, sizeof (hdr));
+
+	cpu_start = current->se.sum_exec_runtime;
+	start = ktime_get ();
+
+	while (total_bytes ? st->bytes < total_bytes : time_before (jiffies, end)) {
+		for (n = 0; n < batch; n++) {
+			d->seq = cpu_to_be64 (seq);
+			iov.iov_base = buf;
+			iov.iov_len = msg_size;
+
+			ret = kernel_sendmsg (sock, &hdr, &iov, 1, msg_size);
+			if (ret == -ENOBUFS || ret == -EAGAIN) {
+				drops++;
+				continue;
+			}
+			if (ret < 0)
+				goto stop;
+
+			seq++;
+			st->bytes += ret;
+			st->msgs++;
+		}
+		cond_resched ();
+	}
+	ret = 0;
+
+stop:
+	st->ns = ktime_to_ns (ktime_sub (ktime_get (), start));
+	st->cpu_ns = current->se.sum_exec_runtime - cpu_start;
+
+	if (drops)
+		printk (KERN_INFO "stream %u: %llu datagrams dropped on send\n",
+			st->id, (unsigned long long)drops);
+out:
+	sock_release (sock);
+out_buf:
+	kfree (buf);
+	return ret < 0 ? ret : 0;
+}
+
+
+static int bench_thread (void *data)
+{
+	struct bench_stream *st = data;
+
+	if (bench == BENCH_PINGPONG)
+		st->ret = run_pingpong (st);
+	else if (bench == BENCH_UDP)
+		st->ret = run_udp (st);
+	else
+		st->ret = run_stream (st);
+	complete_and_exit (&st->done, 0);
+}
+
+
+static const char *bench_names[] = { "none", "sink", "pull", "ping-pong", "udp" };
+
+
+/* Runs 'streams' benchmark threads and adds up their results in sum;
+ * ping-pong latencies are merged into hist. */
+static int run_pass (int busy, struct lat_hist *hist, struct bench_stream *sum)
+{
+	struct bench_stream *st;
+	struct task_struct *task;
+	unsigned int i;
+	int ret = 0;
+
+	st = kcalloc (streams, sizeof (*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+
+	for (i = 0; i < streams; i++) {
+		st[i].id = i;
+		st[i].busy = busy;
+		init_completion (&st[i].done);
+
+		if (hist) {
+			st[i].hist = kzalloc (sizeof (*hist), GFP_KERNEL);
+			if (!st[i].hist) {
+				st[i].ret = -ENOMEM;
+				complete (&st[i].done);
+				continue;
+			}
+		}
+
+		task = kthread_run (bench_thread, &st[i], "sock_bench/%u", i);
+		if (IS_ERR (task)) {
+			st[i].ret = PTR_ERR (task);
+			complete (&st[i].done);
+		}
+	}
+
+	for (i = 0; i < streams; i++) {
+		wait_for_completion (&st[i].done);
+
+		if (st[i].ret) {
+			printk (KERN_INFO "stream %u failed: %d\n", i, st[i].ret);
+			ret = st[i].ret;
+		}
+
+		sum->bytes += st[i].bytes;
+		sum->msgs += st[i].msgs;
+		sum->cpu_ns += st[i].cpu_ns;
+		if (st[i].ns > sum->ns)
+			sum->ns = st[i].ns;
+
+		if (st[i].hist) {
+			hist_merge (hist, st[i].hist);
+			kfree (st[i].hist);
+		}
+	}
+
+	kfree (st);
+	return ret;
+}
+
+
+static void lat_report (const char *name, struct lat_hist *hist)
+{
+	printk (KERN_INFO "bench ping-pong %s: %llu round trips, p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n",
+		name, (unsigned long long)hist->count,
+		(unsigned long long)hist_percentile (hist, 50000),
+		(unsigned long long)hist_percentile (hist, 99000),
+		(unsigned long long)hist_percentile (hist, 99900),
+		(unsigned long long)hist->max);
+}
+
+
+static int run_bench (void)
+{
+	struct bench_stream sum;
+	struct lat_hist *hist = NULL, *hist_busy = NULL;
+	u64 mbit;
+	int ret;
+
+	if (bench > BENCH_UDP || !msg_size || !streams)
+		return -EINVAL;
+	if (bench == BENCH_UDP && (msg_size < sizeof (struct sock_dgram) || msg_size > SOCK_DGRAM_MAX))
+		return -EINVAL;
+	if (msg_size > SOCK_FRAME_MAX || !batch || batch > SOCK_FRAME_BATCH)
+		return -EINVAL;
+
+	if (bench == BENCH_PINGPONG) {
+		hist = kzalloc (sizeof (*hist), GFP_KERNEL);
+		if (busy_poll)
+			hist_busy = kzalloc (sizeof (*hist), GFP_KERNEL);
+		if (!hist || (busy_poll && !hist_busy)) {
+			kfree (hist);
+			kfree (hist_busy);
+			return -ENOMEM;
+		}
+	}
+
+	memset (&sum, 0, sizeof (sum));
+	ret = run_pass (0, hist, &sum);
+
+	if (hist) {
+		lat_report ("interrupt", hist);
+
+		/* same load again with both ends spinning for the reply */
+		if (hist_busy) {
+			struct bench_stream busy_sum;
+			int err;
+
+			memset (&busy_sum, 0, sizeof (busy_sum));
+			err = run_pass (1, hist_busy, &busy_sum);
+			if (err)
+				ret = err;
+			lat_report ("busy-poll", hist_busy);
+		}
+
+		mutex_lock (&lat_lock);
+		kfree (lat_result);
+		kfree (lat_busy);
+		lat_result = hist;
+		lat_busy = hist_busy;
+		mutex_unlock (&lat_lock);
+	}
+
+	if (!sum.ns || !sum.bytes) {
+		printk (KERN_INFO "bench: no data moved\n");
+		return ret ? ret : -EIO;
+	}
+
+	/* bits per nanosecond * 1000 == Mbit/s */
+	mbit = div64_u64 (sum.bytes * 8 * 1000, sum.ns);
+	printk (KERN_INFO "bench %s: %u streams, %llu bytes, %llu msgs in %llu us\n",
+		bench_names[bench], streams,
+		(unsigned long long)sum.bytes, (unsigned long long)sum.msgs,
+		(unsigned long long)div64_u64 (sum.ns, 1000));
+	printk (KERN_INFO "bench: %llu.%03llu Gbit/s, %llu msgs/s, %llu ps CPU per byte\n",
+		(unsigned long long)div64_u64 (mbit, 1000),
+		(unsigned long long)(mbit - div64_u64 (mbit, 1000) * 1000),
+		(unsigned long long)div64_u64 (sum.msgs * NSEC_PER_SEC, sum.ns),
+		(unsigned long long)div64_u64 (sum.cpu_ns * 1000, sum.bytes));
+
+	return ret;
+}
+
+
+static int latency_show (struct seq_file *m, void *v)
+{
+	struct lat_hist *h;
+	unsigned int i;
+
+	mutex_lock (&lat_lock);
+	h = *(struct lat_hist **)m->private;
+
+	if (!h || !h->count) {
+		seq_printf (m, "no data\n");
+		goto out;
+	}
+
+	seq_printf (m, "samples: %llu\n", (unsigned long long)h->count);
+	seq_printf (m, "min:     %llu ns\n", (unsigned long long)h->min);
+	seq_printf (m, "mean:    %llu ns\n", (unsigned long long)div64_u64 (h->sum, h->count));
+	seq_printf (m, "p50:     %llu ns\n", (unsigned long long)hist_percentile (h, 50000));
+	seq_printf (m, "p90:     %llu ns\n", (unsigned long long)hist_percentile (h, 90000));
+	seq_printf (m, "p99:     %llu ns\n", (unsigned long long)hist_percentile (h, 99000));
+	seq_printf (m, "p99.9:   %llu ns\n", (unsigned long long)hist_percentile (h, 99900));
+	seq_printf (m, "max:     %llu ns\n", (unsigned long long)h->max);
+
+	/* non-empty buckets: highest value in the bucket and its count */
+	seq_printf (m, "\n");
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (h->buckets[i])
+			seq_printf (m, "%llu %u\n", (unsigned long long)hist_value (i), h->buckets[i]);
+out:
+	mutex_unlock (&lat_lock);
+	return 0;
+}
+
+
+static int latency_open (struct inode *inode, struct file *file)
+{
+	return single_open (file, latency_show, inode->i_private);
+}
+
+
+static int pool_stat_show (struct seq_file *m, void *v)
+{
+	static const char *states[] = { "dead", "connecting", "idle", "busy" };
+	unsigned int i;
+
+	seq_printf (m, "size:       %u\n", pool ? pool_size : 0);
+	seq_printf (m, "gets:       %u\n", atomic_read (&pool_gets));
+	seq_printf (m, "steals:     %u\n", atomic_read (&pool_steals));
+	seq_printf (m, "waits:      %u\n", atomic_read (&pool_waits));
+	seq_printf (m, "reconnects: %u\n", atomic_read (&pool_reconnects));
+
+	if (pool)
+		for (i = 0; i < pool_size; i++)
+			seq_printf (m, "%u: %s, %lu uses\n", i,
+				    states[atomic_read (&pool[i].state)], pool[i].uses);
+	return 0;
+}
+
+
+static int pool_stat_open (struct inode *inode, struct file *file)
+{
+	return single_open (file, pool_stat_show, NULL);
+}
+
+
 module_init (sc_init);
 module_exit (sc_exit);
 
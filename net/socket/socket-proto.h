@@ -0,0 +1,258 @@
+/* Wire protocol shared by the socket test server and client.
+ *
+ * Everything up to and including the request, and all SINK and ECHO
+ * traffic, travels as frames: a 32-bit big-endian payload length followed by
+ * the payload. PULL data after the request is a raw byte stream. */
+
+#ifndef __SOCKET_PROTO_H
+#define __SOCKET_PROTO_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/tcp.h>
+#include <linux/net.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <net/sock.h>
+
+#define PORT 12345
+
+#define HELLO_MSG	"Hello, World!\n"
+#define HELLO_LEN	(sizeof (HELLO_MSG) - 1)
+
+#define SOCK_REQ_MAGIC	0x534f434b	/* "SOCK" */
+
+
+/* what the client wants after the hello exchange */
+enum sock_op {
+	SOCK_OP_NONE,		/* nothing, close */
+	SOCK_OP_SINK,		/* client streams data, server discards it */
+	SOCK_OP_PULL,		/* server streams data to the client */
+	SOCK_OP_ECHO,		/* server returns every msg_size message */
+};
+
+#define SOCK_FRAME_HDR		sizeof (__be32)
+#define SOCK_FRAME_MAX		(1 << 20)
+#define SOCK_FRAME_BATCH	32
+
+/* PULL: send path on the server, default is the server's zcopy param */
+#define SOCK_REQ_ZCOPY	1
+#define SOCK_REQ_COPY	2
+/* ECHO: spin on the socket for the next message instead of sleeping */
+#define SOCK_REQ_BUSY_POLL	4
+
+
+/* sent by the client right after the hello exchange, network byte order */
+struct sock_req {
+	__be32	magic;
+	__be32	op;
+	__be32	flags;
+	__be32	msg_size;	/* ECHO: expected message size, sizes the buffers */
+	__be64	total;		/* PULL: bytes to send, 0 - until the client closes */
+} __attribute__ ((packed));
+
+
+/* UDP: every datagram starts with this, the rest is padding up to msg_size */
+#define SOCK_DGRAM_MAGIC	0x55445021	/* "UDP!" */
+#define SOCK_DGRAM_MAX		65507
+#define SOCK_DGRAM_STREAMS	64	/* streams the server tracks loss for */
+
+struct sock_dgram {
+	__be32	magic;
+	__be32	stream;
+	__be64	seq;		/* from 0 for every run */
+} __attribute__ ((packed));
+
+
+/* receive side of a framed stream: frames are reassembled in buf across
+ * any number of partial reads */
+struct frame_rx {
+	char *buf;
+	unsigned int cap;
+	unsigned int head;	/* first byte not parsed yet */
+	unsigned int tail;	/* end of received data */
+};
+
+
+static inline int frame_rx_init (struct frame_rx *rx, unsigned int cap)
+{
+	rx->buf = kmalloc (cap, GFP_KERNEL);
+	rx->cap = cap;
+	rx->head = rx->tail = 0;
+	return rx->buf ? 0 : -ENOMEM;
+}
+
+
+static inline void frame_rx_free (struct frame_rx *rx)
+{
+	kfree (rx->buf);
+	rx->buf = NULL;
+}
+
+
+static inline int frame_rx_empty (struct frame_rx *rx)
+{
+	return rx->head == rx->tail;
+}
+
+
+/* Takes the next complete frame out of the buffer. Returns 1 with the
+ * payload, 0 if the frame is not complete yet, -EPROTO on a bogus length.
+ * The payload stays valid until the next frame_fill(). */
+static inline int frame_next (struct frame_rx *rx, void **data, u32 *len)
+{
+	unsigned int avail = rx->tail - rx->head;
+	__be32 hdr;
+	u32 n;
+
+	if (avail < SOCK_FRAME_HDR)
+		return 0;
+
+	memcpy (&hdr, rx->buf + rx->head, SOCK_FRAME_HDR);
+	n = ntohl (hdr);
+	if (n > SOCK_FRAME_MAX)
+		return -EPROTO;
+	if (avail < SOCK_FRAME_HDR + n)
+		return 0;
+
+	*data = rx->buf + rx->head + SOCK_FRAME_HDR;
+	*len = n;
+	rx->head += SOCK_FRAME_HDR + n;
+	return 1;
+}
+
+
+/* Reads whatever the socket has into the buffer, after making room for the
+ * whole frame pending at head. Returns bytes read, 0 on EOF, or an error. */
+static inline int frame_fill (struct socket *sock, struct frame_rx *rx, int flags)
+{
+	unsigned int need = SOCK_FRAME_HDR;
+	struct msghdr hdr;
+	struct kvec iov;
+	__be32 len;
+	char *buf;
+	int ret;
+
+	if (rx->tail - rx->head >= SOCK_FRAME_HDR) {
+		memcpy (&len, rx->buf + rx->head, SOCK_FRAME_HDR);
+		need += min_t (u32, ntohl (len), SOCK_FRAME_MAX);
+	}
+
+	if (rx->head == rx->tail)
+		rx->head = rx->tail = 0;
+	else if (rx->cap - rx->head < need) {
+		memmove (rx->buf, rx->buf + rx->head, rx->tail - rx->head);
+		rx->tail -= rx->head;
+		rx->head = 0;
+	}
+
+	if (need > rx->cap) {
+		buf = krealloc (rx->buf, need, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		rx->buf = buf;
+		rx->cap = need;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	iov.iov_base = rx->buf + rx->tail;
+	iov.iov_len = rx->cap - rx->tail;
+
+	ret = kernel_recvmsg (sock, &hdr, &iov, 1, iov.iov_len, flags);
+	if (ret > 0)
+		rx->tail += ret;
+
+	return ret;
+}
+
+
+/* Sends n messages as frames, all of them in one scatter-gather sendmsg
+ * unless the socket takes them partially. With 'more' set the stack is told
+ * another batch follows (MSG_MORE), so small frames coalesce into full
+ * segments instead of going out one by one. */
+static inline int frame_send_batch (struct socket *sock, struct kvec *msgs, unsigned int n, int more)
+{
+	struct kvec iov[2 * SOCK_FRAME_BATCH], *v = iov;
+	__be32 hdrs[SOCK_FRAME_BATCH];
+	struct msghdr hdr;
+	unsigned int i, nvec = 2 * n;
+	size_t size = 0;
+	int ret;
+
+	if (n > SOCK_FRAME_BATCH)
+		return -EINVAL;
+
+	for (i = 0; i < n; i++) {
+		hdrs[i] = htonl (msgs[i].iov_len);
+		iov[2*i].iov_base = &hdrs[i];
+		iov[2*i].iov_len = SOCK_FRAME_HDR;
+		iov[2*i+1] = msgs[i];
+		size += SOCK_FRAME_HDR + msgs[i].iov_len;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+
+	while (size) {
+		hdr.msg_flags = more ? MSG_MORE : 0;
+
+		ret = kernel_sendmsg (sock, &hdr, v, nvec, size);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EPIPE;
+
+		size -= ret;
+
+		/* skip what went out */
+		while (nvec && (size_t)ret >= v->iov_len) {
+			ret -= v->iov_len;
+			v++;
+			nvec--;
+		}
+		if (ret) {
+			v->iov_base += ret;
+			v->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+
+/* pushes out whatever MSG_MORE left in the socket */
+static inline void frame_flush (struct socket *sock)
+{
+	int val = 1;
+
+	kernel_setsockopt (sock, SOL_TCP, TCP_CORK, (char *)&val, sizeof (val));
+	val = 0;
+	kernel_setsockopt (sock, SOL_TCP, TCP_CORK, (char *)&val, sizeof (val));
+}
+
+
+/* Spins until the socket has data, an error or end of stream, for at most
+ * usecs. On loopback and veth the packet is delivered in the sender's softirq,
+ * so it shows up here without the receiver ever sleeping. Returns 1 if there
+ * is something to read, 0 on timeout or when the CPU is wanted elsewhere. */
+static inline int frame_busy_wait (struct socket *sock, unsigned int usecs)
+{
+	struct sock *sk = sock->sk;
+	ktime_t end = ktime_add_us (ktime_get (), usecs);
+
+	while (skb_queue_empty (&sk->sk_receive_queue)) {
+		if (sk->sk_err || (sk->sk_shutdown & RCV_SHUTDOWN))
+			return 1;
+		if (need_resched () || signal_pending (current))
+			return 0;
+		if (ktime_to_ns (ktime_sub (ktime_get (), end)) >= 0)
+			return 0;
+		cpu_relax ();
+	}
+
+	return 1;
+}
+
+
+#endif /* __SOCKET_PROTO_H */
@@ -2,22 +2,283 @@
 #include <linux/kernel.h>
 #include <linux/in.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/jiffies.h>
+#include <linux/timer.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/fs.h>
+#include <linux/wait.h>
+#include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/completion.h>
+
+#include <linux/tcp.h>
 
 #include <net/sock.h>
+#include <net/tcp_states.h>
+#include <net/tcp.h>
+
+#include "socket-proto.h"
+
+#define RX_BUF		16384
+#define UDP_RCVBUF	(4 << 20)
+#define UDP_DRAIN	1024	/* datagrams taken per wakeup at most */
+
+
+/* module params */
+static unsigned int acceptors;
+module_param (acceptors, uint, 0444);
+MODULE_PARM_DESC (acceptors, "number of acceptor threads. 0 means one per online CPU.");
+
+static int bind_cpus = 1;
+module_param (bind_cpus, int, 0444);
+MODULE_PARM_DESC (bind_cpus, "bind acceptor threads to CPUs (round-robin over online CPUs).");
+
+static unsigned int backlog = 1024;
+module_param (backlog, uint, 0444);
+MODULE_PARM_DESC (backlog, "listen backlog of the server socket.");
+
+static int event_mode;
+module_param (event_mode, int, 0444);
+MODULE_PARM_DESC (event_mode, "drive connections from socket callbacks instead of a blocking thread each.");
 
-#define PORT 12345
+static int zcopy;
+module_param (zcopy, int, 0644);
+MODULE_PARM_DESC (zcopy, "default PULL send path: 0 - copy, 1 - zero-copy from page pool, 2 - alternate per connection.");
+
+static unsigned int pool_pages = 256;
+module_param (pool_pages, uint, 0444);
+MODULE_PARM_DESC (pool_pages, "number of pages in the zero-copy send pool.");
+
+static unsigned int rx_ring;
+module_param (rx_ring, uint, 0444);
+MODULE_PARM_DESC (rx_ring, "event mode SINK: pages in the per-connection receive ring (rounded up to a power of two), 0 - off.");
+
+static unsigned int busy_poll;
+module_param (busy_poll, uint, 0644);
+MODULE_PARM_DESC (busy_poll, "ECHO: microseconds to spin on the socket before sleeping, for clients asking for it. 0 - always sleep.");
+
+static int udp;
+module_param (udp, int, 0444);
+MODULE_PARM_DESC (udp, "also receive datagrams on the UDP port.");
 
 
 static struct socket *sock;
+static struct socket *udp_sock;
+static struct task_struct *udp_task;
+
+
+/* connection states, the same machine runs blocking or non-blocking */
+enum conn_state {
+	CONN_SEND_HELLO,
+	CONN_RECV_HELLO,
+	CONN_RECV_REQ,
+	CONN_SINK,
+	CONN_ECHO,
+	CONN_SEND_BULK,
+	CONN_DONE,
+};
+
+
+/* Receive ring. The data-ready upcall drains the socket with tcp_read_sock
+ * straight from the skbs into these pages; the connection's work consumes
+ * them. head and tail run freely, size is a power of two. When the ring is
+ * full the actor stops taking data, which stays queued on the socket and
+ * closes the TCP window, until the consumer makes room and pulls it in. */
+struct rx_ring {
+	unsigned int size;
+	unsigned int head;	/* consumer */
+	unsigned int tail;	/* producer, under the socket lock */
+	int full;
+	unsigned int hwm;
+	unsigned int full_events;
+
+	/* frame parser of the consumer */
+	unsigned int hdr_got;
+	char hdr[SOCK_FRAME_HDR];
+	u32 frame_left;
+
+	unsigned int nr_pages;
+	struct page *pages[0];
+};
+
+
+/* accepted connection, served by a thread of its own or, in event mode, by work items on srv_wq */
+struct srv_conn {
+	struct socket *sock;
+	struct work_struct work;
+	struct list_head list;
+
+	enum conn_state state;
+	int event;		/* driven by socket upcalls */
+	int cpu;		/* event mode: where the work always runs */
+	int hooked;
+	size_t off;		/* progress inside the current send */
+	struct frame_rx rx;
+	struct sock_req req;
+	struct rx_ring *ring;
+
+	/* echo: span of received frames being sent back as is */
+	unsigned int echo_start;
+	unsigned int echo_len;
+	unsigned int echo_frames;
+	int busy;		/* spin for the next message */
+
+	/* bulk payload */
+	int zcopy;
+	int bulk_unbounded;	/* PULL until the client goes away */
+	u64 bulk_left;
+	int page_idx;		/* pool page being sent, -1 if none */
+	unsigned int page_off;
+	unsigned int page_len;
+	ktime_t bulk_start;
+
+	void (*saved_data_ready) (struct sock *, int);
+	void (*saved_write_space) (struct sock *);
+	void (*saved_state_change) (struct sock *);
+};
+
+
+/* accept engine state */
+static struct task_struct **acceptor_tasks;
+static unsigned int nr_acceptors;
+static struct workqueue_struct *srv_wq;	/* event mode */
+static int srv_stopping;
+
+/* Without events every connection blocks in a kthread of its own, so a slow
+ * peer holds up nobody else. They exit through complete_and_exit(), the
+ * unload waits for as many exits as threads were started. */
+static atomic_t conn_threads = ATOMIC_INIT (0);
+static DECLARE_COMPLETION (conn_thread_exit);
+
+static LIST_HEAD (conn_list);
+static DEFINE_MUTEX (conn_lock);
+static DECLARE_WAIT_QUEUE_HEAD (conn_wait);
+
+/* listener callback saved while in event mode */
+static void (*listen_saved_data_ready) (struct sock *, int);
+
+
+/* Zero-copy send pool. A page is handed to the stack by sendpage and stays
+ * busy until the stack drops its references (page_count back to one), then
+ * it is reclaimed for the next sender. */
+static struct page **pool;
+static unsigned long *pool_busy;
+static unsigned long *pool_inflight;
+static DEFINE_SPINLOCK (pool_lock);
+
+/* source of the copying path, kernel_sendmsg copies it into skbs */
+static struct page *copy_page;
+
+
+/* counters */
+static atomic_t stat_accepted = ATOMIC_INIT (0);
+static atomic_t stat_accept_errors = ATOMIC_INIT (0);
+static atomic_t stat_active = ATOMIC_INIT (0);
+static atomic_t stat_wakeups = ATOMIC_INIT (0);
+static unsigned int stat_accept_rate;
+static unsigned int stat_backlog_max;
+static unsigned int last_accepted;
+
+/* bulk send accounting, per path: bytes and transfer time */
+struct bulk_stat {
+	u64 bytes;
+	u64 ns;
+	unsigned int conns;
+};
+
+static struct bulk_stat stat_zcopy, stat_copy;
+static u64 stat_sink_bytes;
+static u64 stat_sink_msgs;
+static u64 stat_echo_msgs;
+static u64 stat_ring_bytes;
+static unsigned int stat_ring_full;
+static unsigned int stat_ring_hwm;
+static u64 stat_busy_hits;
+static u64 stat_busy_misses;
+/* UDP receive, updated by the UDP thread alone */
+static u64 stat_udp_dgrams;
+static u64 stat_udp_bytes;
+static u64 stat_udp_wakeups;
+static u64 stat_udp_lost;
+static u64 stat_udp_reordered;
+static unsigned int stat_udp_drain_max;
+static unsigned int stat_udp_rate;
+static u64 last_udp_dgrams;
+static u64 udp_next_seq[SOCK_DGRAM_STREAMS];
+static unsigned int stat_pool_empty;
+static unsigned int stat_pool_reclaimed;
+static DEFINE_SPINLOCK (stat_lock);
+
+static struct dentry *dbg_dir;
+
+/* the server's hello, framed once at load */
+static char hello_frame[SOCK_FRAME_HDR + HELLO_LEN];
 
 
 static int make_server_socket (void);
+static int start_udp (void);
+static void stop_udp (void);
+static int udp_thread (void *);
+static void udp_account (struct sock_dgram *d, int len);
+static int pool_init (void);
+static void pool_free (void);
+static int start_acceptors (void);
+static void stop_acceptors (void);
+static void start_event_accept (void);
+static void stop_event_accept (void);
+static void stop_conns (void);
+
+static int acceptor_thread (void *);
+static void ev_accept_work (struct work_struct *);
+static struct srv_conn *conn_alloc (struct socket *c_sock, int event);
+static void conn_hook (struct srv_conn *conn);
+static void conn_work (struct work_struct *);
+static int conn_thread (void *);
+static int send_hello_msg (struct srv_conn *conn, int flags);
+static int recv_hello_msg (struct srv_conn *conn, int flags);
+static int recv_req (struct srv_conn *conn, int flags);
+static int recv_sink (struct srv_conn *conn, int flags);
+static int ring_start (struct srv_conn *conn);
+static void ring_produce (struct sock *sk, struct srv_conn *conn);
+static int ring_sink (struct srv_conn *conn);
+static void ring_free (struct rx_ring *r);
+static int conn_echo (struct srv_conn *conn, int flags);
+static int send_bulk (struct srv_conn *conn, int flags);
+static void bulk_account (struct srv_conn *conn);
+
+static DECLARE_WORK (sock_accept, ev_accept_work);
+
+static void stats_timer_func (unsigned long);
 
-static void accept_work (struct work_struct *);
-static int send_hello_msg (struct socket *sock);
-static int recv_hello_msg (struct socket *sock);
+static DEFINE_TIMER (stats_timer, stats_timer_func, 0, 0);
 
-static DECLARE_WORK (sock_accept, accept_work);
+static int stats_open (struct inode *inode, struct file *file);
+static int rings_open (struct inode *inode, struct file *file);
+
+static const struct file_operations rings_fops = {
+	.owner = THIS_MODULE,
+	.open = rings_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
 
 
@@ -27,21 +288,111 @@ static int __init s_init (void)
 
 	printk (KERN_INFO "Socket test module\n");
 
+	*(__be32 *)hello_frame = htonl (HELLO_LEN);
+	memcpy (hello_frame + SOCK_FRAME_HDR, HELLO_MSG, HELLO_LEN);
+
+	ret = pool_init ();
+	if (ret) {
+		printk (KERN_INFO "Page pool allocation failed\n");
+		return ret;
+	}
+
+	srv_wq = create_workqueue ("sock_srv");
+	if (!srv_wq) {
+		ret = -ENOMEM;
+		goto err_pool;
+	}
+
 	ret = make_server_socket ();
 	if (ret) {
 		printk (KERN_INFO "Server socket creation failed: %d\n", ret);
-		return ret;
+		goto err_wq;
 	}
 
+	/* before the acceptors: past them, a failure has connections to undo */
+	if (udp) {
+		ret = start_udp ();
+		if (ret) {
+			printk (KERN_INFO "UDP receiver start failed: %d\n", ret);
+			goto err_sock;
+		}
+	}
+
+	if (event_mode)
+		start_event_accept ();
+	else {
+		ret = start_acceptors ();
+		if (ret) {
+			printk (KERN_INFO "Acceptors start failed: %d\n", ret);
+			goto err_conns;
+		}
+	}
+
+	dbg_dir = debugfs_create_dir ("socket_srv", NULL);
+	if (dbg_dir) {
+		debugfs_create_file ("stats", 0444, dbg_dir, NULL, &stats_fops);
+		debugfs_create_file ("rings", 0444, dbg_dir, NULL, &rings_fops);
+	}
+
+	mod_timer (&stats_timer, jiffies + HZ);
+
 	return 0;
+
+err_conns:
+	/* the acceptors that did start may have taken some */
+	stop_conns ();
+	stop_udp ();
+err_sock:
+	sock_release (sock);
+	sock = NULL;
+err_wq:
+	destroy_workqueue (srv_wq);
+err_pool:
+	pool_free ();
+	return ret;
 }
 
 
 static void __exit s_exit (void)
 {
 	printk (KERN_INFO "Socket test module unload\n");
+
+	del_timer_sync (&stats_timer);
+	debugfs_remove_recursive (dbg_dir);
+
+	if (udp)
+		stop_udp ();
+
+	if (event_mode)
+		stop_event_accept ();
+	else
+		stop_acceptors ();
+
+	stop_conns ();
+	destroy_workqueue (srv_wq);
+
 	if (sock)
 		sock_release (sock);
+
+	pool_free ();
+}
+
+
+/* Kicks connections waiting on their peers, then waits for them and for the
+ * threads of the blocking ones. No connection may come in any more. */
+static void stop_conns (void)
+{
+	struct srv_conn *conn;
+	int i;
+
+	mutex_lock (&conn_lock);
+	list_for_each_entry (conn, &conn_list, list)
+		kernel_sock_shutdown (conn->sock, SHUT_RDWR);
+	mutex_unlock (&conn_lock);
+
+	wait_event (conn_wait, !atomic_read (&stat_active));
+	for (i = atomic_read (&conn_threads); i; i--)
+		wait_for_completion (&conn_thread_exit);
 }
 
 
@@ -62,116 +413,1279 @@ static int make_server_socket (void)
 	if (ret)
 		goto err;
 
-	ret = kernel_listen (sock, 1024);
+	ret = kernel_listen (sock, backlog);
 	if (ret)
 		goto err;
 
-	schedule_work (&sock_accept);
-
 	return 0;
 err:
 	if (sock)
 		sock_release (sock);
+	sock = NULL;
+	return ret;
+}
+
+
+static int pool_init (void)
+{
+	unsigned int i;
+	size_t words = BITS_TO_LONGS (pool_pages);
+
+	copy_page = alloc_page (GFP_KERNEL);
+	pool = kcalloc (pool_pages, sizeof (*pool), GFP_KERNEL);
+	pool_busy = kcalloc (words, sizeof (long), GFP_KERNEL);
+	pool_inflight = kcalloc (words, sizeof (long), GFP_KERNEL);
+
+	if (!copy_page || !pool || !pool_busy || !pool_inflight)
+		goto err;
+
+	memset (page_address (copy_page), 'x', PAGE_SIZE);
+
+	for (i = 0; i < pool_pages; i++) {
+		pool[i] = alloc_page (GFP_KERNEL);
+		if (!pool[i])
+			goto err;
+		memset (page_address (pool[i]), 'x', PAGE_SIZE);
+	}
+
+	return 0;
+err:
+	pool_free ();
+	return -ENOMEM;
+}
+
+
+/* Pages still referenced by skbs are freed by the stack's final put_page. */
+static void pool_free (void)
+{
+	unsigned int i;
+
+	if (pool)
+		for (i = 0; i < pool_pages; i++)
+			if (pool[i])
+				put_page (pool[i]);
+
+	kfree (pool);
+	kfree (pool_busy);
+	kfree (pool_inflight);
+	pool = NULL;
+	pool_busy = pool_inflight = NULL;
+
+	if (copy_page)
+		__free_page (copy_page);
+	copy_page = NULL;
+}
+
+
+/* called with pool_lock held */
+static unsigned int pool_reclaim (void)
+{
+	unsigned int i, n = 0;
+
+	for (i = find_first_bit (pool_inflight, pool_pages); i < pool_pages;
+	     i = find_next_bit (pool_inflight, pool_pages, i + 1)) {
+		if (page_count (pool[i]) != 1)
+			continue;
+		clear_bit (i, pool_inflight);
+		clear_bit (i, pool_busy);
+		n++;
+	}
+
+	return n;
+}
+
+
+static int pool_get (void)
+{
+	unsigned int i;
+
+	spin_lock (&pool_lock);
+	i = find_first_zero_bit (pool_busy, pool_pages);
+	if (i >= pool_pages) {
+		stat_pool_reclaimed += pool_reclaim ();
+		i = find_first_zero_bit (pool_busy, pool_pages);
+	}
+	if (i < pool_pages)
+		set_bit (i, pool_busy);
+	spin_unlock (&pool_lock);
+
+	return i < pool_pages ? i : -1;
+}
+
+
+/* the page went to sendpage, keep it until the stack lets it go */
+static void pool_put (int i)
+{
+	spin_lock (&pool_lock);
+	set_bit (i, pool_inflight);
+	spin_unlock (&pool_lock);
+}
+
+
+/* All acceptors sleep on the single listener's accept queue. The queue wakes
+ * waiters exclusively, so each connection wakes exactly one acceptor, and the
+ * connection is then served on that acceptor's CPU. */
+static int start_acceptors (void)
+{
+	unsigned int i, cpu;
+	struct task_struct *task;
+
+	nr_acceptors = acceptors ? acceptors : num_online_cpus ();
+
+	acceptor_tasks = kcalloc (nr_acceptors, sizeof (*acceptor_tasks), GFP_KERNEL);
+	if (!acceptor_tasks)
+		return -ENOMEM;
+
+	cpu = first_cpu (cpu_online_map);
+
+	for (i = 0; i < nr_acceptors; i++) {
+		task = kthread_create (acceptor_thread, NULL, "sock_acc/%u", i);
+		if (IS_ERR (task)) {
+			printk (KERN_INFO "acceptor %u creation failed: %ld\n", i, PTR_ERR (task));
+			stop_acceptors ();
+			return PTR_ERR (task);
+		}
+
+		if (bind_cpus) {
+			kthread_bind (task, cpu);
+			cpu = next_cpu (cpu, cpu_online_map);
+			if (cpu >= NR_CPUS)
+				cpu = first_cpu (cpu_online_map);
+		}
+
+		acceptor_tasks[i] = task;
+		wake_up_process (task);
+	}
+
+	printk (KERN_INFO "Started %u acceptor threads\n", nr_acceptors);
+	return 0;
+}
+
+
+/* UDP socket on the same port, drained by one thread */
+static int start_udp (void)
+{
+	struct sockaddr_in sin;
+	struct timeval tv;
+	int val, ret;
+
+	ret = sock_create (AF_INET, SOCK_DGRAM, IPPROTO_UDP, &udp_sock);
+	if (ret)
+		return ret;
+
+	/* room for the bursts between two wakeups of the thread */
+	val = UDP_RCVBUF;
+	kernel_setsockopt (udp_sock, SOL_SOCKET, SO_RCVBUFFORCE, (char *)&val, sizeof (val));
+
+	/* wake up now and then to notice kthread_stop */
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	kernel_setsockopt (udp_sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof (tv));
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons (PORT);
+	sin.sin_addr.s_addr = 0;
+
+	ret = kernel_bind (udp_sock, (struct sockaddr*)&sin, sizeof (sin));
+	if (ret)
+		goto err;
+
+	udp_task = kthread_run (udp_thread, NULL, "sock_udp");
+	if (IS_ERR (udp_task)) {
+		ret = PTR_ERR (udp_task);
+		udp_task = NULL;
+		goto err;
+	}
+
+	return 0;
+err:
+	sock_release (udp_sock);
+	udp_sock = NULL;
 	return ret;
 }
 
 
-static void accept_work (struct work_struct *dummy)
+static void stop_udp (void)
+{
+	if (udp_task)
+		kthread_stop (udp_task);
+	if (udp_sock)
+		sock_release (udp_sock);
+	udp_task = NULL;
+	udp_sock = NULL;
+}
+
+
+/* sequence check: gaps are counted as lost, late arrivals as reordered */
+static void udp_account (struct sock_dgram *d, int len)
+{
+	u32 stream = ntohl (d->stream);
+	u64 seq = be64_to_cpu (d->seq);
+
+	stat_udp_dgrams++;
+	stat_udp_bytes += len;
+
+	if (stream >= SOCK_DGRAM_STREAMS)
+		return;
+
+	/* a new run starts from 0 */
+	if (!seq)
+		udp_next_seq[stream] = 0;
+
+	if (seq > udp_next_seq[stream])
+		stat_udp_lost += seq - udp_next_seq[stream];
+	else if (seq < udp_next_seq[stream]) {
+		stat_udp_reordered++;
+		if (stat_udp_lost)
+			stat_udp_lost--;
+		return;
+	}
+
+	udp_next_seq[stream] = seq + 1;
+}
+
+
+/* Sleeps for one datagram, then receives everything queued behind it one
+ * datagram per call without sleeping again, so a burst costs one wakeup. */
+static int udp_thread (void *data)
+{
+	struct msghdr hdr;
+	struct kvec iov;
+	unsigned int n;
+	char *buf;
+	int ret, flags;
+
+	buf = kmalloc (SOCK_DGRAM_MAX, GFP_KERNEL);
+	if (!buf)
+		goto park;
+
+	while (!kthread_should_stop ()) {
+		n = 0;
+		flags = 0;
+
+		while (n < UDP_DRAIN) {
+			memset (&hdr, 0, sizeof (hdr));
+			iov.iov_base = buf;
+			iov.iov_len = SOCK_DGRAM_MAX;
+
+			ret = kernel_recvmsg (udp_sock, &hdr, &iov, 1, iov.iov_len, flags);
+			if (ret < 0)
+				break;
+
+			if (ret >= sizeof (struct sock_dgram) &&
+			    ntohl (((struct sock_dgram *)buf)->magic) == SOCK_DGRAM_MAGIC)
+				udp_account ((struct sock_dgram *)buf, ret);
+			n++;
+			flags = MSG_DONTWAIT;
+		}
+
+		if (n) {
+			stat_udp_wakeups++;
+			if (n > stat_udp_drain_max)
+				stat_udp_drain_max = n;
+		}
+		else if (ret != -EAGAIN && ret != -EINTR)
+			printk (KERN_INFO "UDP receive failed: %d\n", ret);
+
+		cond_resched ();
+	}
+
+	kfree (buf);
+	return 0;
+
+park:
+	while (!kthread_should_stop ())
+		schedule_timeout_interruptible (HZ);
+	return 0;
+}
+
+
+static void stop_acceptors (void)
+{
+	unsigned int i;
+
+	if (!acceptor_tasks)
+		return;
+
+	/* shutdown of the listener wakes up everyone sleeping in accept */
+	srv_stopping = 1;
+	kernel_sock_shutdown (sock, SHUT_RDWR);
+
+	for (i = 0; i < nr_acceptors; i++)
+		if (acceptor_tasks[i])
+			kthread_stop (acceptor_tasks[i]);
+
+	kfree (acceptor_tasks);
+	acceptor_tasks = NULL;
+}
+
+
+static int acceptor_thread (void *dummy)
+{
+	struct socket *c_sock;
+	int ret;
+
+	while (!kthread_should_stop () && !srv_stopping) {
+		c_sock = NULL;
+		ret = kernel_accept (sock, &c_sock, 0);
+
+		if (ret) {
+			if (srv_stopping)
+				break;
+			atomic_inc (&stat_accept_errors);
+			printk (KERN_INFO "kernel_accept failed: %d\n", ret);
+			msleep (10);
+			continue;
+		}
+
+		if (!conn_alloc (c_sock, 0))
+			sock_release (c_sock);
+	}
+
+	/* kthread_stop expects us to be alive until it is called */
+	set_current_state (TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop ()) {
+		schedule ();
+		set_current_state (TASK_INTERRUPTIBLE);
+	}
+	__set_current_state (TASK_RUNNING);
+
+	return 0;
+}
+
+
+/* Socket upcalls. They run in softirq context, so all they do is kick the
+ * connection's work item; sk_user_data is cleared under sk_callback_lock
+ * before the connection goes away. */
+static void ev_listen_data_ready (struct sock *sk, int bytes)
+{
+	/* accepted children inherit this callback until they are hooked */
+	if (sk->sk_state != TCP_LISTEN)
+		return;
+	queue_work (srv_wq, &sock_accept);
+}
+
+
+static void ev_data_ready (struct sock *sk, int bytes)
+{
+	struct srv_conn *conn;
+
+	read_lock (&sk->sk_callback_lock);
+	conn = sk->sk_user_data;
+	if (conn) {
+		if (conn->ring)
+			ring_produce (sk, conn);
+		atomic_inc (&stat_wakeups);
+		queue_work_on (conn->cpu, srv_wq, &conn->work);
+	}
+	read_unlock (&sk->sk_callback_lock);
+}
+
+
+static void ev_write_space (struct sock *sk)
+{
+	struct srv_conn *conn;
+
+	read_lock (&sk->sk_callback_lock);
+	conn = sk->sk_user_data;
+	if (conn && sk_stream_wspace (sk) >= sk_stream_min_wspace (sk)) {
+		clear_bit (SOCK_NOSPACE, &sk->sk_socket->flags);
+		atomic_inc (&stat_wakeups);
+		queue_work_on (conn->cpu, srv_wq, &conn->work);
+	}
+	read_unlock (&sk->sk_callback_lock);
+}
+
+
+static void ev_state_change (struct sock *sk)
+{
+	ev_data_ready (sk, 0);
+}
+
+
+static void start_event_accept (void)
+{
+	struct sock *sk = sock->sk;
+
+	write_lock_bh (&sk->sk_callback_lock);
+	listen_saved_data_ready = sk->sk_data_ready;
+	sk->sk_data_ready = ev_listen_data_ready;
+	write_unlock_bh (&sk->sk_callback_lock);
+
+	/* pick up anything which was queued before the hook */
+	queue_work (srv_wq, &sock_accept);
+	printk (KERN_INFO "Event-driven accept started\n");
+}
+
+
+static void stop_event_accept (void)
+{
+	struct sock *sk = sock->sk;
+
+	write_lock_bh (&sk->sk_callback_lock);
+	sk->sk_data_ready = listen_saved_data_ready;
+	write_unlock_bh (&sk->sk_callback_lock);
+
+	cancel_work_sync (&sock_accept);
+}
+
+
+static void ev_accept_work (struct work_struct *dummy)
 {
-	struct socket *c_sock = NULL;
+	struct socket *c_sock;
+	struct srv_conn *conn;
 	int ret;
+
+	for (;;) {
+		c_sock = NULL;
+		ret = kernel_accept (sock, &c_sock, O_NONBLOCK);
+		if (ret == -EAGAIN)
+			break;
+		if (ret) {
+			atomic_inc (&stat_accept_errors);
+			printk (KERN_INFO "kernel_accept failed: %d\n", ret);
+			break;
+		}
+
+		conn = conn_alloc (c_sock, 1);
+		if (!conn)
+			sock_release (c_sock);
+	}
+}
+
+
+static struct srv_conn *conn_alloc (struct socket *c_sock, int event)
+{
+	struct task_struct *task = NULL;
+	struct srv_conn *conn;
 	struct sockaddr_in sin;
 	int len;
 
-	ret = kernel_accept (sock, &c_sock, 0);
+	conn = kzalloc (sizeof (*conn), GFP_KERNEL);
+	if (!conn || frame_rx_init (&conn->rx, RX_BUF)) {
+		atomic_inc (&stat_accept_errors);
+		kfree (conn);
+		return NULL;
+	}
+
+	conn->sock = c_sock;
+	conn->event = event;
+	conn->state = CONN_SEND_HELLO;
+	conn->page_idx = -1;
+	INIT_WORK (&conn->work, conn_work);
 
-	if (ret) {
-		printk (KERN_INFO "kernel_accept failed: %d\n", ret);
-		goto out;
+	if (!event) {
+		task = kthread_create (conn_thread, conn, "sock_conn");
+		if (IS_ERR (task)) {
+			printk (KERN_INFO "Connection thread start failed: %ld\n", PTR_ERR (task));
+			atomic_inc (&stat_accept_errors);
+			frame_rx_free (&conn->rx);
+			kfree (conn);
+			return NULL;
+		}
+		atomic_inc (&conn_threads);
 	}
 
-	ret = kernel_getpeername (c_sock, (struct sockaddr*)&sin, &len);
+	if (!kernel_getpeername (c_sock, (struct sockaddr*)&sin, &len))
+		printk (KERN_INFO "Accepted connection from 0x%x\n", sin.sin_addr.s_addr);
 
-	if (ret) {
-		printk (KERN_INFO "getpeername failed: %d\n", ret);
-		goto out;
+	mutex_lock (&conn_lock);
+	list_add (&conn->list, &conn_list);
+	mutex_unlock (&conn_lock);
+
+	atomic_inc (&stat_accepted);
+	atomic_inc (&stat_active);
+
+	/* Upcalls come on whatever CPU took the packet, and a work item
+	 * still running on one CPU may be queued and run on another: all of
+	 * the connection's runs go to the CPU that accepted it, so they never
+	 * overlap and conn_close() sees every one still queued. */
+	if (event) {
+		conn->cpu = raw_smp_processor_id ();
+		conn_hook (conn);
+		queue_work_on (conn->cpu, srv_wq, &conn->work);
 	}
+	else
+		wake_up_process (task);
 
-	printk (KERN_INFO "Accepted connection from 0x%x\n", sin.sin_addr.s_addr);
+	return conn;
+}
 
-	ret = send_hello_msg (c_sock);
-	if (ret) {
-		printk (KERN_INFO "Message send failed: %d\n", ret);
-		goto out;
+
+static void conn_hook (struct srv_conn *conn)
+{
+	struct sock *sk = conn->sock->sk;
+
+	write_lock_bh (&sk->sk_callback_lock);
+	conn->saved_data_ready = sk->sk_data_ready;
+	if (conn->saved_data_ready == ev_listen_data_ready)
+		conn->saved_data_ready = listen_saved_data_ready;
+	conn->saved_write_space = sk->sk_write_space;
+	conn->saved_state_change = sk->sk_state_change;
+
+	sk->sk_user_data = conn;
+	sk->sk_data_ready = ev_data_ready;
+	sk->sk_write_space = ev_write_space;
+	sk->sk_state_change = ev_state_change;
+	conn->hooked = 1;
+	write_unlock_bh (&sk->sk_callback_lock);
+}
+
+
+static void conn_unhook (struct srv_conn *conn)
+{
+	struct sock *sk = conn->sock->sk;
+
+	if (!conn->hooked)
+		return;
+
+	write_lock_bh (&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	sk->sk_data_ready = conn->saved_data_ready;
+	sk->sk_write_space = conn->saved_write_space;
+	sk->sk_state_change = conn->saved_state_change;
+	conn->hooked = 0;
+	write_unlock_bh (&sk->sk_callback_lock);
+}
+
+
+/* switch to the state serving the client's request */
+static int conn_start_op (struct srv_conn *conn)
+{
+	u32 flags = ntohl (conn->req.flags);
+	u32 size;
+	char *buf;
+	int one;
+
+	if (ntohl (conn->req.magic) != SOCK_REQ_MAGIC)
+		return -EPROTO;
+
+	switch (ntohl (conn->req.op)) {
+	case SOCK_OP_NONE:
+		conn->state = CONN_DONE;
+		break;
+	case SOCK_OP_SINK:
+		conn->state = CONN_SINK;
+		if (conn->event && rx_ring && ring_start (conn))
+			printk (KERN_INFO "Receive ring setup failed, plain receive\n");
+		break;
+	case SOCK_OP_PULL:
+		conn->bulk_left = be64_to_cpu (conn->req.total);
+		conn->bulk_unbounded = !conn->bulk_left;
+		if (conn->bulk_unbounded)
+			conn->bulk_left = ~0ULL;
+
+		if (flags & SOCK_REQ_ZCOPY)
+			conn->zcopy = 1;
+		else if (flags & SOCK_REQ_COPY)
+			conn->zcopy = 0;
+		else if (zcopy == 2)
+			conn->zcopy = atomic_read (&stat_accepted) & 1;
+		else
+			conn->zcopy = zcopy;
+
+		conn->bulk_start = ktime_get ();
+		conn->state = CONN_SEND_BULK;
+		break;
+	case SOCK_OP_ECHO:
+		/* room for a few frames of the announced size */
+		size = min_t (u32, ntohl (conn->req.msg_size), SOCK_FRAME_MAX);
+		size = 4 * (size + SOCK_FRAME_HDR);
+		if (size > conn->rx.cap) {
+			buf = krealloc (conn->rx.buf, size, GFP_KERNEL);
+			if (!buf)
+				return -ENOMEM;
+			conn->rx.buf = buf;
+			conn->rx.cap = size;
+		}
+		one = 1;
+		kernel_setsockopt (conn->sock, SOL_TCP, TCP_NODELAY, (char *)&one, sizeof (one));
+		conn->busy = ntohl (conn->req.flags) & SOCK_REQ_BUSY_POLL;
+		conn->off = 0;
+		conn->state = CONN_ECHO;
+		break;
+	default:
+		return -EPROTO;
 	}
 
-	ret = recv_hello_msg (c_sock);
-	if (ret) {
-		printk (KERN_INFO "Message recv failed: %d\n", ret);
-		goto out;
+	return 0;
+}
+
+
+/* Runs the connection as far as the socket allows. Returns 0 when the
+ * connection is finished, -EAGAIN when a non-blocking step has to wait for
+ * an upcall, or an error. */
+static int conn_step (struct srv_conn *conn, int flags)
+{
+	int ret;
+
+	switch (conn->state) {
+	case CONN_SEND_HELLO:
+		ret = send_hello_msg (conn, flags);
+		if (ret)
+			return ret;
+		conn->state = CONN_RECV_HELLO;
+		conn->off = 0;
+		/* fall through */
+	case CONN_RECV_HELLO:
+		ret = recv_hello_msg (conn, flags);
+		if (ret)
+			return ret;
+		conn->state = CONN_RECV_REQ;
+		/* fall through */
+	case CONN_RECV_REQ:
+		ret = recv_req (conn, flags);
+		if (ret)
+			return ret;
+		ret = conn_start_op (conn);
+		if (ret)
+			return ret;
+		return conn_step (conn, flags);
+	case CONN_SINK:
+		if (conn->ring)
+			ret = ring_sink (conn);
+		else
+			ret = recv_sink (conn, flags);
+		if (ret)
+			return ret;
+		conn->state = CONN_DONE;
+		break;
+	case CONN_ECHO:
+		ret = conn_echo (conn, flags);
+		if (ret)
+			return ret;
+		conn->state = CONN_DONE;
+		break;
+	case CONN_SEND_BULK:
+		ret = send_bulk (conn, flags);
+		if (ret && !(conn->bulk_unbounded && (ret == -EPIPE || ret == -ECONNRESET)))
+			return ret;
+		bulk_account (conn);
+		conn->state = CONN_DONE;
+		break;
+	case CONN_DONE:
+		break;
 	}
 
-out:
-	if (c_sock)
-		sock_release (c_sock);
+	return 0;
+}
+
+
+static void conn_close (struct srv_conn *conn)
+{
+	if (conn->event) {
+		conn_unhook (conn);
+		conn->state = CONN_DONE;
+		/* an upcall raced with us, the queued run frees the connection */
+		if (work_pending (&conn->work))
+			return;
+	}
+
+	if (conn->page_idx >= 0)
+		pool_put (conn->page_idx);
+	frame_rx_free (&conn->rx);
 
-	return;
+	mutex_lock (&conn_lock);
+	list_del (&conn->list);
+	mutex_unlock (&conn_lock);
+
+	ring_free (conn->ring);
+
+	sock_release (conn->sock);
+	kfree (conn);
+
+	if (atomic_dec_and_test (&stat_active))
+		wake_up (&conn_wait);
 }
 
 
-static int send_hello_msg (struct socket *sock)
+static void conn_work (struct work_struct *work)
 {
-	int ret = 0, len;
-	struct msghdr hdr;
-	struct iovec iov;
-	char* msg = "Hello, World!\n";
+	struct srv_conn *conn = container_of (work, struct srv_conn, work);
+	int ret;
+
+	ret = conn_step (conn, conn->event ? MSG_DONTWAIT : 0);
+
+	if (ret == -EAGAIN && conn->event)
+		return;
+
+	if (ret)
+		printk (KERN_INFO "Connection failed: %d\n", ret);
+
+	conn_close (conn);
+}
 
-	len = strlen (msg);
 
-	iov.iov_base = msg;
-	iov.iov_len = len;
+static int conn_thread (void *data)
+{
+	struct srv_conn *conn = data;
+
+	conn_work (&conn->work);
+
+	/* the exit is in the kernel proper, the module may go once it's signaled */
+	complete_and_exit (&conn_thread_exit, 0);
+}
+
+
+/* sends buf up to len, keeping the progress in conn->off across calls */
+static int send_exact (struct srv_conn *conn, void *buf, size_t len, int flags)
+{
+	struct msghdr hdr;
+	struct kvec iov;
+	int ret;
 
 	memset (&hdr, 0, sizeof (hdr));
-	hdr.msg_iov = &iov;
-	hdr.msg_iovlen = 1;
+	hdr.msg_flags = flags;
+
+	while (conn->off < len) {
+		iov.iov_base = buf + conn->off;
+		iov.iov_len = len - conn->off;
+
+		ret = kernel_sendmsg (conn->sock, &hdr, &iov, 1, iov.iov_len);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EPIPE;
+
+		conn->off += ret;
+	}
+
+	return 0;
+}
+
+
+static int send_hello_msg (struct srv_conn *conn, int flags)
+{
+	return send_exact (conn, hello_frame, sizeof (hello_frame), flags);
+}
+
+
+/* Next frame from the connection, reading the socket as needed. Returns 1
+ * with the frame, 0 if the client closed between frames, or an error. */
+static int recv_frame (struct srv_conn *conn, void **data, u32 *len, int flags)
+{
+	int ret;
+
+	for (;;) {
+		ret = frame_next (&conn->rx, data, len);
+		if (ret)
+			return ret;
+
+		ret = frame_fill (conn->sock, &conn->rx, flags);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return frame_rx_empty (&conn->rx) ? 0 : -ECONNRESET;
+	}
+}
+
+
+static int recv_hello_msg (struct srv_conn *conn, int flags)
+{
+	char buf[HELLO_LEN+1];
+	void *data;
+	u32 len;
+	int ret;
+
+	ret = recv_frame (conn, &data, &len, flags);
+	if (ret <= 0)
+		return ret ? ret : -ECONNRESET;
+	if (len != HELLO_LEN)
+		return -EPROTO;
+
+	memcpy (buf, data, HELLO_LEN);
+	buf[HELLO_LEN] = 0;
+	printk (KERN_INFO "Got: %s\n", buf);
+	return 0;
+}
+
+
+static int recv_req (struct srv_conn *conn, int flags)
+{
+	void *data;
+	u32 len;
+	int ret;
+
+	ret = recv_frame (conn, &data, &len, flags);
+	if (ret <= 0)
+		return ret ? ret : -ECONNRESET;
+	if (len != sizeof (conn->req))
+		return -EPROTO;
+
+	memcpy (&conn->req, data, sizeof (conn->req));
+	return 0;
+}
+
+
+/* SINK: count and drop frames until the client closes */
+static int recv_sink (struct srv_conn *conn, int flags)
+{
+	u64 bytes, msgs;
+	void *data;
+	u32 len;
+	int ret;
+
+	for (;;) {
+		bytes = msgs = 0;
+		while ((ret = frame_next (&conn->rx, &data, &len)) > 0) {
+			bytes += len;
+			msgs++;
+		}
+
+		spin_lock (&stat_lock);
+		stat_sink_bytes += bytes;
+		stat_sink_msgs += msgs;
+		spin_unlock (&stat_lock);
+
+		if (ret < 0)
+			return ret;
+
+		ret = frame_fill (conn->sock, &conn->rx, flags);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return frame_rx_empty (&conn->rx) ? 0 : -ECONNRESET;
+	}
+}
 
-	while (iov.iov_len) {
-		ret = sock_sendmsg (sock, &hdr, iov.iov_len);
 
-		if (ret <= 0)
+static void ring_free (struct rx_ring *r)
+{
+	unsigned int i;
+
+	if (!r)
+		return;
+
+	for (i = 0; i < r->nr_pages; i++)
+		if (r->pages[i])
+			__free_page (r->pages[i]);
+	kfree (r);
+}
+
+
+static int ring_start (struct srv_conn *conn)
+{
+	struct sock *sk = conn->sock->sk;
+	struct rx_ring *r;
+	unsigned int i, n, off, left, chunk;
+
+	n = roundup_pow_of_two (rx_ring);
+
+	r = kzalloc (sizeof (*r) + n * sizeof (struct page *), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+
+	r->nr_pages = n;
+	r->size = n * PAGE_SIZE;
+
+	for (i = 0; i < n; i++) {
+		r->pages[i] = alloc_page (GFP_KERNEL);
+		if (!r->pages[i]) {
+			ring_free (r);
+			return -ENOMEM;
+		}
+	}
+
+	/* whatever the frame parser already took off the socket goes first */
+	left = conn->rx.tail - conn->rx.head;
+	if (left > r->size) {
+		ring_free (r);
+		return -ENOBUFS;
+	}
+
+	for (off = 0; off < left; off += chunk) {
+		chunk = min_t (unsigned int, left - off, PAGE_SIZE - off % PAGE_SIZE);
+		memcpy (page_address (r->pages[off / PAGE_SIZE]) + off % PAGE_SIZE,
+			conn->rx.buf + conn->rx.head + off, chunk);
+	}
+	r->tail = r->hwm = left;
+	conn->rx.head = conn->rx.tail;
+
+	write_lock_bh (&sk->sk_callback_lock);
+	conn->ring = r;
+	write_unlock_bh (&sk->sk_callback_lock);
+
+	/* pull in what was queued before the ring existed */
+	lock_sock (sk);
+	ring_produce (sk, conn);
+	release_sock (sk);
+
+	return 0;
+}
+
+
+/* tcp_read_sock actor: copy from the skb into the ring, as much as fits */
+static int ring_actor (read_descriptor_t *desc, struct sk_buff *skb,
+		       unsigned int offset, size_t len)
+{
+	struct rx_ring *r = desc->arg.data;
+	unsigned int tail = r->tail, room, chunk, pos;
+	size_t done = 0;
+
+	room = r->size - (tail - ACCESS_ONCE (r->head));
+	/* the consumer has to finish reading before we overwrite */
+	smp_mb ();
+
+	while (done < len && room) {
+		pos = tail & (r->size - 1);
+		chunk = min_t (size_t, len - done, PAGE_SIZE - pos % PAGE_SIZE);
+		chunk = min (chunk, room);
+
+		if (skb_copy_bits (skb, offset + done, page_address (r->pages[pos / PAGE_SIZE]) + pos % PAGE_SIZE, chunk))
+			break;
+
+		tail += chunk;
+		room -= chunk;
+		done += chunk;
+	}
+
+	smp_wmb ();
+	r->tail = tail;
+
+	if (r->size - room > r->hwm)
+		r->hwm = r->size - room;
+
+	if (done < len) {
+		/* ring is full, leave the rest on the socket */
+		r->full = 1;
+		r->full_events++;
+		desc->count = 0;
+	}
+
+	return done;
+}
+
+
+/* called with the socket locked, from the upcall or by the consumer */
+static void ring_produce (struct sock *sk, struct srv_conn *conn)
+{
+	read_descriptor_t desc;
+
+	desc.arg.data = conn->ring;
+	desc.error = 0;
+	desc.count = 1;
+	tcp_read_sock (sk, &desc, ring_actor);
+}
+
+
+/* SINK through the ring: count frames, free the room, refill if the
+ * producer had stopped. 0 at the end of stream, -EAGAIN to wait for data. */
+static int ring_sink (struct srv_conn *conn)
+{
+	struct sock *sk = conn->sock->sk;
+	struct rx_ring *r = conn->ring;
+	unsigned int head, tail, pos, n;
+	u64 bytes = 0, msgs = 0;
+	unsigned int fulls = 0;
+	char *p;
+	int ret = -EAGAIN;
+
+	for (;;) {
+		head = r->head;
+		tail = ACCESS_ONCE (r->tail);
+		smp_rmb ();
+
+		while (head != tail) {
+			pos = head & (r->size - 1);
+			p = page_address (r->pages[pos / PAGE_SIZE]) + pos % PAGE_SIZE;
+			n = min_t (unsigned int, tail - head, PAGE_SIZE - pos % PAGE_SIZE);
+
+			if (r->hdr_got < SOCK_FRAME_HDR) {
+				n = min_t (unsigned int, n, SOCK_FRAME_HDR - r->hdr_got);
+				memcpy (r->hdr + r->hdr_got, p, n);
+				r->hdr_got += n;
+				if (r->hdr_got == SOCK_FRAME_HDR) {
+					r->frame_left = ntohl (*(__be32 *)r->hdr);
+					if (r->frame_left > SOCK_FRAME_MAX) {
+						ret = -EPROTO;
+						goto out;
+					}
+				}
+			}
+			else {
+				n = min_t (unsigned int, n, r->frame_left);
+				r->frame_left -= n;
+				bytes += n;
+			}
+
+			if (r->hdr_got == SOCK_FRAME_HDR && !r->frame_left) {
+				r->hdr_got = 0;
+				msgs++;
+			}
+
+			head += n;
+		}
+
+		/* done reading the data before the producer may reuse it */
+		smp_mb ();
+		r->head = head;
+
+		if (!ACCESS_ONCE (r->full))
 			break;
 
-		iov.iov_base += ret;
-		iov.iov_len -= ret;
-		ret = iov.iov_len;
+		fulls++;
+		lock_sock (sk);
+		r->full = 0;
+		ring_produce (sk, conn);
+		release_sock (sk);
 	}
 
+	if (sk->sk_err)
+		ret = -sk->sk_err;
+	else if ((sk->sk_shutdown & RCV_SHUTDOWN) && r->head == ACCESS_ONCE (r->tail) &&
+		 skb_queue_empty (&sk->sk_receive_queue))
+		ret = r->hdr_got ? -ECONNRESET : 0;
+
+out:
+	spin_lock (&stat_lock);
+	stat_sink_bytes += bytes;
+	stat_sink_msgs += msgs;
+	stat_ring_bytes += bytes;
+	stat_ring_full += fulls;
+	if (r->hwm > stat_ring_hwm)
+		stat_ring_hwm = r->hwm;
+	spin_unlock (&stat_lock);
+
 	return ret;
 }
 
 
-static int recv_hello_msg (struct socket *sock)
+/* ECHO: every complete frame buffered so far goes back in one send, straight
+ * from the receive buffer since it is already framed */
+static int conn_echo (struct srv_conn *conn, int flags)
 {
-	struct msghdr hdr;
-	struct iovec iov;
-	char buf[16+1];
+	void *data;
+	u32 len;
 	int ret;
 
-	memset (&hdr, 0, sizeof (hdr));
-	hdr.msg_iov = &iov;
-	hdr.msg_iovlen = 1;
+	for (;;) {
+		if (!conn->echo_len) {
+			conn->echo_start = conn->rx.head;
+			conn->echo_frames = 0;
+
+			while ((ret = frame_next (&conn->rx, &data, &len)) > 0)
+				conn->echo_frames++;
+			if (ret < 0)
+				return ret;
+
+			conn->echo_len = conn->rx.head - conn->echo_start;
+			conn->off = 0;
+		}
 
-	iov.iov_base = &buf;
-	iov.iov_len = sizeof (buf)-1;
+		if (!conn->echo_len) {
+			/* busy_poll may be changed at run time, 0 turns spinning off */
+			if (conn->busy && busy_poll) {
+				ret = frame_busy_wait (conn->sock, busy_poll);
+				spin_lock (&stat_lock);
+				if (ret)
+					stat_busy_hits++;
+				else
+					stat_busy_misses++;
+				spin_unlock (&stat_lock);
+			}
 
-	ret = sock_recvmsg (sock, &hdr, iov.iov_len, 0);
+			ret = frame_fill (conn->sock, &conn->rx, flags);
+			if (ret < 0)
+				return ret;
+			if (!ret)
+				return frame_rx_empty (&conn->rx) ? 0 : -ECONNRESET;
+			continue;
+		}
 
-	if (ret > 0) {
-		buf[ret] = 0;
-		printk (KERN_INFO "Got: %s\n", buf);
+		ret = send_exact (conn, conn->rx.buf + conn->echo_start, conn->echo_len, flags);
+		if (ret)
+			return ret;
+		conn->echo_len = 0;
+
+		spin_lock (&stat_lock);
+		stat_echo_msgs += conn->echo_frames;
+		spin_unlock (&stat_lock);
 	}
+}
 
-	return ret;
+
+/* Pushes conn->bulk_left bytes one page at a time. Zero-copy connections
+ * hand pool pages to sendpage; the copying path sends the same data through
+ * kernel_sendmsg. An exhausted pool degrades to copying for that page. */
+static int send_bulk (struct srv_conn *conn, int flags)
+{
+	struct msghdr hdr;
+	struct kvec iov;
+	struct bulk_stat *st;
+	int ret, more;
+
+	while (conn->bulk_left) {
+		if (conn->page_len == 0) {
+			conn->page_off = 0;
+			conn->page_len = min_t (u64, conn->bulk_left, PAGE_SIZE);
+			if (conn->zcopy) {
+				conn->page_idx = pool_get ();
+				if (conn->page_idx < 0) {
+					spin_lock (&stat_lock);
+					stat_pool_empty++;
+					spin_unlock (&stat_lock);
+				}
+			}
+		}
+
+		more = conn->bulk_left > conn->page_len - conn->page_off ? MSG_MORE : 0;
+
+		if (conn->page_idx >= 0)
+			ret = kernel_sendpage (conn->sock, pool[conn->page_idx], conn->page_off,
+					       conn->page_len - conn->page_off, flags | more);
+		else {
+			memset (&hdr, 0, sizeof (hdr));
+			hdr.msg_flags = flags | more;
+			iov.iov_base = page_address (copy_page) + conn->page_off;
+			iov.iov_len = conn->page_len - conn->page_off;
+			ret = kernel_sendmsg (conn->sock, &hdr, &iov, 1, iov.iov_len);
+		}
+
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EPIPE;
+
+		st = conn->page_idx >= 0 ? &stat_zcopy : &stat_copy;
+		spin_lock (&stat_lock);
+		st->bytes += ret;
+		spin_unlock (&stat_lock);
+
+		conn->page_off += ret;
+		conn->bulk_left -= ret;
+
+		if (conn->page_off == conn->page_len) {
+			if (conn->page_idx >= 0)
+				pool_put (conn->page_idx);
+			conn->page_idx = -1;
+			conn->page_len = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+static void bulk_account (struct srv_conn *conn)
+{
+	struct bulk_stat *st = conn->zcopy ? &stat_zcopy : &stat_copy;
+	u64 ns;
+
+	ns = ktime_to_ns (ktime_sub (ktime_get (), conn->bulk_start));
+
+	spin_lock (&stat_lock);
+	st->ns += ns;
+	st->conns++;
+	spin_unlock (&stat_lock);
+}
+
+
+/* once a second: accept rate and listener backlog depth */
+static void stats_timer_func (unsigned long dummy)
+{
+	unsigned int accepted = atomic_read (&stat_accepted);
+	unsigned int depth = sock->sk->sk_ack_backlog;
+
+	stat_accept_rate = accepted - last_accepted;
+	last_accepted = accepted;
+
+	stat_udp_rate = stat_udp_dgrams - last_udp_dgrams;
+	last_udp_dgrams = stat_udp_dgrams;
+
+	if (depth > stat_backlog_max)
+		stat_backlog_max = depth;
+
+	mod_timer (&stats_timer, jiffies + HZ);
+}
+
+
+static int stats_show (struct seq_file *m, void *v)
+{
+	struct bulk_stat zc, cp;
+	u64 sink, sink_msgs, echo;
+
+	seq_printf (m, "mode:           %s\n", event_mode ? "event" : "thread");
+	seq_printf (m, "acceptors:      %u\n", nr_acceptors);
+	seq_printf (m, "accepted:       %u\n", atomic_read (&stat_accepted));
+	seq_printf (m, "accept_errors:  %u\n", atomic_read (&stat_accept_errors));
+	seq_printf (m, "accepts_per_s:  %u\n", stat_accept_rate);
+	seq_printf (m, "active:         %u\n", atomic_read (&stat_active));
+	seq_printf (m, "wakeups:        %u\n", atomic_read (&stat_wakeups));
+	seq_printf (m, "backlog:        %u\n", (unsigned int)sock->sk->sk_ack_backlog);
+	seq_printf (m, "backlog_max:    %u\n", stat_backlog_max);
+	seq_printf (m, "backlog_limit:  %u\n", (unsigned int)sock->sk->sk_max_ack_backlog);
+
+	spin_lock (&stat_lock);
+	zc = stat_zcopy;
+	cp = stat_copy;
+	sink = stat_sink_bytes;
+	sink_msgs = stat_sink_msgs;
+	echo = stat_echo_msgs;
+	spin_unlock (&stat_lock);
+
+	seq_printf (m, "sink_bytes:     %llu\n", (unsigned long long)sink);
+	seq_printf (m, "sink_msgs:      %llu\n", (unsigned long long)sink_msgs);
+	seq_printf (m, "echo_msgs:      %llu\n", (unsigned long long)echo);
+
+	/* bytes per microsecond == MB/s, averaged over finished transfers */
+	seq_printf (m, "zcopy_bytes:    %llu\n", (unsigned long long)zc.bytes);
+	seq_printf (m, "zcopy_conns:    %u\n", zc.conns);
+	seq_printf (m, "zcopy_mbps:     %llu\n", (unsigned long long)(zc.ns ? div64_u64 (zc.bytes * 1000, zc.ns) : 0));
+	seq_printf (m, "copy_bytes:     %llu\n", (unsigned long long)cp.bytes);
+	seq_printf (m, "copy_conns:     %u\n", cp.conns);
+	seq_printf (m, "copy_mbps:      %llu\n", (unsigned long long)(cp.ns ? div64_u64 (cp.bytes * 1000, cp.ns) : 0));
+	/* written by the UDP thread only */
+	if (udp) {
+		seq_printf (m, "udp_dgrams:     %llu\n", (unsigned long long)stat_udp_dgrams);
+		seq_printf (m, "udp_bytes:      %llu\n", (unsigned long long)stat_udp_bytes);
+		seq_printf (m, "udp_pps:        %u\n", stat_udp_rate);
+		seq_printf (m, "udp_wakeups:    %llu\n", (unsigned long long)stat_udp_wakeups);
+		seq_printf (m, "udp_drain_max:  %u\n", stat_udp_drain_max);
+		seq_printf (m, "udp_lost:       %llu\n", (unsigned long long)stat_udp_lost);
+		seq_printf (m, "udp_reordered:  %llu\n", (unsigned long long)stat_udp_reordered);
+	}
+	seq_printf (m, "busy_hits:      %llu\n", (unsigned long long)stat_busy_hits);
+	seq_printf (m, "busy_misses:    %llu\n", (unsigned long long)stat_busy_misses);
+	seq_printf (m, "ring_bytes:     %llu\n", (unsigned long long)stat_ring_bytes);
+	seq_printf (m, "ring_full:      %u\n", stat_ring_full);
+	seq_printf (m, "ring_hwm:       %u\n", stat_ring_hwm);
+	seq_printf (m, "pool_empty:     %u\n", stat_pool_empty);
+	seq_printf (m, "pool_reclaimed: %u\n", stat_pool_reclaimed);
+	return 0;
+}
+
+
+static int stats_open (struct inode *inode, struct file *file)
+{
+	return single_open (file, stats_show, NULL);
+}
+
+
+/* occupancy of every live receive ring */
+static int rings_show (struct seq_file *m, void *v)
+{
+	struct srv_conn *conn;
+	struct rx_ring *r;
+
+	seq_printf (m, "used size hwm full_events\n");
+
+	mutex_lock (&conn_lock);
+	list_for_each_entry (conn, &conn_list, list) {
+		r = conn->ring;
+		if (!r)
+			continue;
+		seq_printf (m, "%u %u %u %u\n", ACCESS_ONCE (r->tail) - ACCESS_ONCE (r->head),
+			    r->size, r->hwm, r->full_events);
+	}
+	mutex_unlock (&conn_lock);
+
+	return 0;
+}
+
+
+static int rings_open (struct inode *inode, struct file *file)
+{
+	return single_open (file, rings_show, NULL);
 }
 
 